@@ -0,0 +1,621 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+#include "road_graph.cpp"
+#include "route_query.cpp"
+
+using namespace std;
+
+static const uint32_t NO_MIDDLE_NODE = UINT32_MAX;
+
+// Contraction Hierarchy on top of a RoadGraph, node ids are the same as in the graph.
+// Every node gets a rank, the upward graph holds the edges u -> x with rank[x] > rank[u]
+// and the downward graph the edges x -> u with rank[x] > rank[u], stored at u.
+// A shortcut remembers the contracted node in its middle, which is how paths are unpacked.
+struct ContractionHierarchy
+{
+    vector<uint32_t> rank;
+
+    vector<uint32_t> first_up;
+    vector<uint32_t> up_targets;
+    vector<uint32_t> up_weights;
+    vector<uint32_t> up_middle;
+
+    vector<uint32_t> first_down;
+    vector<uint32_t> down_sources;
+    vector<uint32_t> down_weights;
+    vector<uint32_t> down_middle;
+
+    uint32_t NodeCount() const
+    {
+        return (uint32_t)rank.size();
+    }
+
+    uint32_t EdgeCount() const
+    {
+        return (uint32_t)(up_targets.size() + down_sources.size());
+    }
+
+    /// witness searches give up after settling this many nodes or on paths with more
+    /// than this many edges (at most 255), which can only add superfluous shortcuts, never wrong ones
+    uint32_t witness_settle_limit = 500;
+    uint32_t witness_hop_limit = 8;
+
+    void Build(const RoadGraph& graph, unsigned n_threads = 0);
+
+    RouteResult Query(uint32_t source, uint32_t target,
+                      QueryWorkspace& forward = ThreadQueryWorkspace(0),
+                      QueryWorkspace& backward = ThreadQueryWorkspace(1)) const;
+
+    void Serialize(Serializer& serializer);
+
+    /// Returns false, with the hierarchy left empty, if the stored counts do not fit
+    /// the section or an edge or middle node lies outside of the graph
+    bool DeSerialize(Serializer& serializer);
+
+private:
+    struct DynamicEdge
+    {
+        uint32_t other;
+        uint32_t weight;
+        uint32_t middle;
+    };
+
+    struct Shortcut
+    {
+        uint32_t from;
+        uint32_t to;
+        uint32_t weight;
+    };
+
+    // the state of the witness searches of one thread
+    struct WitnessWorkspace
+    {
+        QueryWorkspace search;
+        /// edges on the path to every node the search reached
+        vector<uint8_t> hops;
+        /// the out neighbours of the node being contracted carry the current stamp
+        vector<uint32_t> target_stamp;
+        uint32_t current_stamp = 0;
+
+        void MarkTargets(const vector<DynamicEdge>& outs, uint32_t n_nodes)
+        {
+            if (target_stamp.size() < n_nodes)
+            {
+                hops.resize(n_nodes);
+                target_stamp.assign(n_nodes, 0);
+                current_stamp = 0;
+            }
+            if (++current_stamp == 0)
+            {
+                fill(target_stamp.begin(), target_stamp.end(), 0);
+                current_stamp = 1;
+            }
+            for (const auto& out : outs)
+                target_stamp[out.other] = current_stamp;
+        }
+
+        bool IsTarget(uint32_t node) const
+        {
+            return target_stamp[node] == current_stamp;
+        }
+    };
+
+    // the remaining graph while contracting
+    vector<vector<DynamicEdge> > out_edges;
+    vector<vector<DynamicEdge> > in_edges;
+    /// set for the nodes of the current round before their shortcuts are searched
+    vector<uint8_t> contracted;
+
+    void AddOrImprove(uint32_t from, uint32_t to, uint32_t weight, uint32_t middle);
+
+    /// collects the shortcuts contracting v would need
+    void SimulateContraction(uint32_t v, WitnessWorkspace& ws, vector<Shortcut>& shortcuts) const;
+
+    /// appends the original nodes of the edge from -> to, without from itself
+    void UnpackEdge(uint32_t from, uint32_t to, vector<uint32_t>& path) const;
+};
+
+void ContractionHierarchy::AddOrImprove(uint32_t from, uint32_t to, uint32_t weight, uint32_t middle)
+{
+    for (auto& e : out_edges[from])
+    {
+        if (e.other == to)
+        {
+            if (weight < e.weight)
+            {
+                e.weight = weight;
+                e.middle = middle;
+                for (auto& r : in_edges[to])
+                {
+                    if (r.other == from)
+                    {
+                        r.weight = weight;
+                        r.middle = middle;
+                    }
+                }
+            }
+            return;
+        }
+    }
+
+    out_edges[from].push_back({to, weight, middle});
+    in_edges[to].push_back({from, weight, middle});
+}
+
+void ContractionHierarchy::SimulateContraction(uint32_t v, WitnessWorkspace& ws, vector<Shortcut>& shortcuts) const
+{
+    shortcuts.clear();
+    const auto& outs = out_edges[v];
+    if (outs.empty())
+        return;
+
+    uint32_t max_out = 0;
+    for (const auto& out : outs)
+        max_out = max(max_out, out.weight);
+    ws.MarkTargets(outs, (uint32_t)out_edges.size());
+
+    // one search per in neighbour covers all the out neighbours at once
+    for (const auto& in : in_edges[v])
+    {
+        const uint32_t u = in.other;
+        const uint32_t max_distance = in.weight + max_out;
+        uint32_t targets_left = (uint32_t)outs.size() - ws.IsTarget(u);
+        if (!targets_left)
+            continue;
+
+        // bounded Dijkstra from u which is not allowed to pass v
+        auto& search = ws.search;
+        search.Reset((uint32_t)out_edges.size());
+        search.Set(u, 0, u);
+        search.heap.Push(0, u);
+        ws.hops[u] = 0;
+        uint32_t settled = 0;
+        while (!search.heap.Empty() && settled < witness_settle_limit)
+        {
+            const auto top = search.heap.Pop();
+            if (top.key != search.distance[top.node])
+                continue;
+            if (top.key > max_distance)
+                break;
+            settled++;
+
+            // done once all the out neighbours of v are settled
+            if (top.node != u && ws.IsTarget(top.node) && !--targets_left)
+                break;
+
+            const uint32_t hops = ws.hops[top.node] + 1;
+            if (hops > witness_hop_limit)
+                continue;
+            for (const auto& e : out_edges[top.node])
+            {
+                // witnesses through nodes of the same round would vanish with them
+                if (e.other == v || contracted[e.other])
+                    continue;
+                const uint32_t dist = top.key + e.weight;
+                if (dist < search.Distance(e.other))
+                {
+                    search.Set(e.other, dist, top.node);
+                    search.heap.Push(dist, e.other);
+                    ws.hops[e.other] = (uint8_t)hops;
+                }
+            }
+        }
+
+        for (const auto& out : outs)
+        {
+            const uint32_t x = out.other;
+            if (x == u)
+                continue;
+            const uint32_t via_v = in.weight + out.weight;
+            if (search.Distance(x) > via_v)
+                shortcuts.push_back({u, x, via_v});
+        }
+    }
+}
+
+void ContractionHierarchy::Build(const RoadGraph& graph, unsigned n_threads)
+{
+    const uint32_t n_nodes = graph.NodeCount();
+    if (!n_threads)
+        n_threads = max(1u, thread::hardware_concurrency());
+
+    out_edges.assign(n_nodes, {});
+    in_edges.assign(n_nodes, {});
+    contracted.assign(n_nodes, 0);
+    for (uint32_t u = 0; u < n_nodes; u++)
+    {
+        for (uint32_t e = graph.first_out[u]; e < graph.first_out[u + 1]; e++)
+        {
+            // parallel edges collapse into the shortest one
+            if (graph.targets[e] != u)
+                AddOrImprove(u, graph.targets[e], graph.weights[e], NO_MIDDLE_NODE);
+        }
+    }
+
+    vector<WitnessWorkspace> workspaces(n_threads);
+    vector<vector<Shortcut> > thread_shortcuts(n_threads);
+
+    // priority is the edge difference plus the number of contracted neighbours,
+    // the latter spreads the contraction evenly over the graph
+    vector<int32_t> priority(n_nodes);
+    vector<int32_t> deleted_neighbours(n_nodes, 0);
+    auto Priority = [&] (uint32_t v, const vector<Shortcut>& v_shortcuts) {
+        return (int32_t)v_shortcuts.size()
+             - (int32_t)(in_edges[v].size() + out_edges[v].size())
+             + deleted_neighbours[v];
+    };
+
+    vector<uint32_t> remaining(n_nodes);
+    for (uint32_t v = 0; v < n_nodes; v++)
+        remaining[v] = v;
+    ParallelFor(n_nodes, n_threads, [&] (unsigned t, uint32_t begin, uint32_t end) {
+        for (uint32_t v = begin; v < end; v++)
+        {
+            SimulateContraction(v, workspaces[t], thread_shortcuts[t]);
+            priority[v] = Priority(v, thread_shortcuts[t]);
+        }
+    });
+
+    // ties are broken by a hash of the id, so the independent sets are spread out
+    auto Before = [&] (uint32_t a, uint32_t b) {
+        if (priority[a] != priority[b])
+            return priority[a] < priority[b];
+        const uint32_t ha = a * 2654435761u, hb = b * 2654435761u;
+        return (ha != hb) ? ha < hb : a < b;
+    };
+    auto IsMinimum = [&] (uint32_t v) {
+        bool is_minimum = true;
+        for (const auto& e : out_edges[v])
+            is_minimum &= Before(v, e.other);
+        for (const auto& e : in_edges[v])
+            is_minimum &= Before(v, e.other);
+        return is_minimum;
+    };
+
+    rank.assign(n_nodes, 0);
+    vector<vector<DynamicEdge> > up(n_nodes), down(n_nodes);
+    vector<uint32_t> independent;
+    vector<vector<Shortcut> > shortcuts;
+    vector<uint8_t> keep;
+    uint32_t next_rank = 0;
+
+    while (!remaining.empty())
+    {
+        // nodes which come before all their neighbours can be contracted at the same time
+        independent.clear();
+        for (const auto v : remaining)
+        {
+            if (IsMinimum(v))
+                independent.push_back(v);
+        }
+
+        for (const auto v : independent)
+            contracted[v] = 1;
+
+        shortcuts.resize(independent.size());
+        ParallelFor((uint32_t)independent.size(), n_threads, [&] (unsigned t, uint32_t begin, uint32_t end) {
+            for (uint32_t i = begin; i < end; i++)
+                SimulateContraction(independent[i], workspaces[t], shortcuts[i]);
+        });
+
+        // priorities are only brought up to date here, a node whose priority got worse
+        // since it was last simulated waits for a later round if a neighbour comes first now.
+        // Witnesses avoided the nodes which wait, which only adds superfluous shortcuts.
+        keep.assign(independent.size(), 1);
+        uint32_t n_kept = 0;
+        for (uint32_t i = 0; i < independent.size(); i++)
+        {
+            const uint32_t v = independent[i];
+            const int32_t updated = Priority(v, shortcuts[i]);
+            if (updated > priority[v])
+            {
+                priority[v] = updated;
+                keep[i] = IsMinimum(v);
+            }
+            n_kept += keep[i];
+        }
+        // the nodes whose priorities are up to date already can always go
+        if (!n_kept)
+            keep.assign(independent.size(), 1);
+
+        for (uint32_t i = 0; i < independent.size(); i++)
+        {
+            const uint32_t v = independent[i];
+            if (!keep[i])
+            {
+                contracted[v] = 0;
+                continue;
+            }
+            rank[v] = next_rank++;
+
+            // the edges of v are final now, its neighbours all rank higher
+            up[v] = out_edges[v];
+            down[v] = in_edges[v];
+
+            for (const auto& e : out_edges[v])
+            {
+                auto& list = in_edges[e.other];
+                list.erase(remove_if(list.begin(), list.end(),
+                    [v] (const DynamicEdge& r) { return r.other == v; }), list.end());
+            }
+            for (const auto& e : in_edges[v])
+            {
+                auto& list = out_edges[e.other];
+                list.erase(remove_if(list.begin(), list.end(),
+                    [v] (const DynamicEdge& r) { return r.other == v; }), list.end());
+            }
+
+            // the neighbours are not simulated again, only the cheap part of their priority changes
+            for (const auto* list : {&out_edges[v], &in_edges[v]})
+            {
+                for (const auto& e : *list)
+                {
+                    deleted_neighbours[e.other]++;
+                    priority[e.other]++;
+                }
+            }
+
+            for (const auto& s : shortcuts[i])
+                AddOrImprove(s.from, s.to, s.weight, v);
+
+            vector<DynamicEdge>().swap(out_edges[v]);
+            vector<DynamicEdge>().swap(in_edges[v]);
+        }
+
+        remaining.erase(remove_if(remaining.begin(), remaining.end(),
+            [&] (uint32_t v) { return (bool)contracted[v]; }), remaining.end());
+    }
+
+    out_edges.clear();
+    in_edges.clear();
+    contracted.clear();
+
+    auto ToCsr = [n_nodes] (const vector<vector<DynamicEdge> >& lists, vector<uint32_t>& first,
+                            vector<uint32_t>& heads, vector<uint32_t>& weights, vector<uint32_t>& middle) {
+        first.assign(n_nodes + 1, 0);
+        heads.clear();
+        weights.clear();
+        middle.clear();
+        for (uint32_t u = 0; u < n_nodes; u++)
+        {
+            for (const auto& e : lists[u])
+            {
+                heads.push_back(e.other);
+                weights.push_back(e.weight);
+                middle.push_back(e.middle);
+            }
+            first[u + 1] = (uint32_t)heads.size();
+        }
+    };
+    ToCsr(up, first_up, up_targets, up_weights, up_middle);
+    ToCsr(down, first_down, down_sources, down_weights, down_middle);
+}
+
+void ContractionHierarchy::UnpackEdge(uint32_t from, uint32_t to, vector<uint32_t>& path) const
+{
+    // every pair of nodes has at most one edge, stored at the lower ranked end
+    uint32_t middle = NO_MIDDLE_NODE;
+    bool found = false;
+    if (rank[from] < rank[to])
+    {
+        for (uint32_t e = first_up[from]; e < first_up[from + 1] && !found; e++)
+        {
+            if (up_targets[e] == to)
+            {
+                middle = up_middle[e];
+                found = true;
+            }
+        }
+    }
+    else
+    {
+        for (uint32_t e = first_down[to]; e < first_down[to + 1] && !found; e++)
+        {
+            if (down_sources[e] == from)
+            {
+                middle = down_middle[e];
+                found = true;
+            }
+        }
+    }
+    assert(found);
+
+    if (middle == NO_MIDDLE_NODE)
+    {
+        path.push_back(to);
+        return;
+    }
+    UnpackEdge(from, middle, path);
+    UnpackEdge(middle, to, path);
+}
+
+RouteResult ContractionHierarchy::Query(uint32_t source, uint32_t target,
+                                        QueryWorkspace& forward, QueryWorkspace& backward) const
+{
+    assert(&forward != &backward);
+
+    RouteResult result;
+    forward.Reset(NodeCount());
+    backward.Reset(NodeCount());
+
+    forward.Set(source, 0, source);
+    forward.heap.Push(0, source);
+    backward.Set(target, 0, target);
+    backward.heap.Push(0, target);
+
+    uint32_t best = INFINITE_DISTANCE;
+    uint32_t meeting = source;
+
+    // both searches only go upwards, each one stops once its smallest key exceeds the best connection
+    bool forward_done = false, backward_done = false;
+    for (bool is_forward = true; !(forward_done && backward_done); is_forward = !is_forward)
+    {
+        if (is_forward ? forward_done : backward_done)
+            continue;
+
+        QueryWorkspace& ws = is_forward ? forward : backward;
+        const QueryWorkspace& other = is_forward ? backward : forward;
+
+        if (ws.heap.Empty() || ws.heap.MinKey() >= best)
+        {
+            (is_forward ? forward_done : backward_done) = true;
+            continue;
+        }
+
+        const auto top = ws.heap.Pop();
+        const uint32_t u = top.node;
+        if (top.key != ws.distance[u])
+            continue;
+        result.settled++;
+
+        if (other.Reached(u) && (uint64_t)top.key + other.distance[u] < best)
+        {
+            best = top.key + other.distance[u];
+            meeting = u;
+        }
+
+        const auto& first = is_forward ? first_up : first_down;
+        const auto& heads = is_forward ? up_targets : down_sources;
+        const auto& weights = is_forward ? up_weights : down_weights;
+        const auto& opposite_first = is_forward ? first_down : first_up;
+        const auto& opposite_heads = is_forward ? down_sources : up_targets;
+        const auto& opposite_weights = is_forward ? down_weights : up_weights;
+
+        // stall on demand: if a higher ranked node already reaches u on a
+        // shorter path, u can not be on a shortest path and is not expanded
+        bool stalled = false;
+        for (uint32_t e = opposite_first[u]; e < opposite_first[u + 1] && !stalled; e++)
+        {
+            const uint32_t w = opposite_heads[e];
+            stalled = ws.Reached(w) && (uint64_t)ws.distance[w] + opposite_weights[e] < top.key;
+        }
+        if (stalled)
+            continue;
+
+        for (uint32_t e = first[u]; e < first[u + 1]; e++)
+        {
+            const uint32_t v = heads[e];
+            const uint32_t dist_v = top.key + weights[e];
+            if (dist_v < ws.Distance(v))
+            {
+                ws.Set(v, dist_v, u);
+                ws.heap.Push(dist_v, v);
+            }
+        }
+    }
+
+    if (best == INFINITE_DISTANCE)
+        return result;
+
+    result.distance = best;
+
+    vector<uint32_t> up_path;
+    for (uint32_t node = meeting; node != source; node = forward.parent[node])
+        up_path.push_back(node);
+    up_path.push_back(source);
+    reverse(up_path.begin(), up_path.end());
+
+    result.path.push_back(source);
+    for (uint32_t i = 1; i < up_path.size(); i++)
+        UnpackEdge(up_path[i - 1], up_path[i], result.path);
+    for (uint32_t node = meeting; node != target; node = backward.parent[node])
+        UnpackEdge(node, backward.parent[node], result.path);
+
+    return result;
+}
+
+void ContractionHierarchy::Serialize(Serializer& serializer)
+{
+    const uint32_t n_nodes = NodeCount();
+
+    serializer.WriteU32(n_nodes);
+    serializer.WriteU32((uint32_t)up_targets.size());
+    serializer.WriteU32((uint32_t)down_sources.size());
+
+    for (uint32_t u = 0; u < n_nodes; u++)
+        serializer.WriteVarInt(rank[u]);
+
+    // the other end is written relative to u, a missing middle node as 0
+    auto WriteEdges = [&] (const vector<uint32_t>& first, const vector<uint32_t>& heads,
+                           const vector<uint32_t>& weights, const vector<uint32_t>& middle) {
+        for (uint32_t u = 0; u < n_nodes; u++)
+        {
+            serializer.WriteVarInt(first[u + 1] - first[u]);
+            for (uint32_t e = first[u]; e < first[u + 1]; e++)
+            {
+                serializer.WriteVarInt((int64_t)heads[e] - u);
+                serializer.WriteVarInt(weights[e]);
+                serializer.WriteVarInt(middle[e] == NO_MIDDLE_NODE ? 0 : (int64_t)middle[e] + 1);
+            }
+        }
+    };
+    WriteEdges(first_up, up_targets, up_weights, up_middle);
+    WriteEdges(first_down, down_sources, down_weights, down_middle);
+}
+
+bool ContractionHierarchy::DeSerialize(Serializer& serializer)
+{
+    const uint32_t n_nodes = serializer.ReadU32();
+    const uint32_t n_up = serializer.ReadU32();
+    const uint32_t n_down = serializer.ReadU32();
+    // a node takes at least three bytes and an edge three, nothing is allocated for more
+    if ((uint64_t)n_nodes * 3 + ((uint64_t)n_up + n_down) * 3 > serializer.BytesLeft())
+    {
+        *this = ContractionHierarchy {};
+        return false;
+    }
+
+    rank.resize(n_nodes);
+    for (uint32_t u = 0; u < n_nodes; u++)
+    {
+        int64_t value;
+        serializer.ReadVarInt(&value);
+        rank[u] = (uint32_t)value;
+    }
+
+    auto ReadEdges = [&] (uint32_t n_edges, vector<uint32_t>& first, vector<uint32_t>& heads,
+                          vector<uint32_t>& weights, vector<uint32_t>& middle) {
+        first.resize(n_nodes + 1);
+        heads.resize(n_edges);
+        weights.resize(n_edges);
+        middle.resize(n_edges);
+
+        uint32_t e = 0;
+        first[0] = 0;
+        for (uint32_t u = 0; u < n_nodes; u++)
+        {
+            int64_t degree;
+            serializer.ReadVarInt(&degree);
+            if (degree < 0 || degree > n_edges - e)
+                return false;
+            for (int64_t i = 0; i < degree; i++, e++)
+            {
+                int64_t value;
+                serializer.ReadVarInt(&value);
+                const int64_t head = u + value;
+                if (head < 0 || head >= n_nodes)
+                    return false;
+                heads[e] = (uint32_t)head;
+                serializer.ReadVarInt(&value);
+                weights[e] = (uint32_t)value;
+                serializer.ReadVarInt(&value);
+                if (value < 0 || value > n_nodes)
+                    return false;
+                middle[e] = value ? (uint32_t)(value - 1) : NO_MIDDLE_NODE;
+            }
+            first[u + 1] = e;
+        }
+        return e == n_edges;
+    };
+    if (!ReadEdges(n_up, first_up, up_targets, up_weights, up_middle)
+        || !ReadEdges(n_down, first_down, down_sources, down_weights, down_middle))
+    {
+        *this = ContractionHierarchy {};
+        return false;
+    }
+    return true;
+}
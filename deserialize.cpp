@@ -1,6 +1,11 @@
 #include <unordered_map>
+#include <time.h>
 #include "string_table.cpp"
 #include "ways.h"
+#include "road_graph.cpp"
+#include "turn_restrictions.cpp"
+#include "contraction_hierarchy.cpp"
+#include "spatial_index.cpp"
 
 #define PERF_PRINTOUT 1
 #undef MAYBE_UNUSED
@@ -8,16 +13,32 @@
 #define MAYBE_UNUSED(expr) \
     do { (void)(expr); } while (0)
 
-typedef struct Offsets
+/// the ids of the sections of tags.dat
+enum TagsSection : uint32_t
 {
-} Offsets;
+    SECTION_TAG_NAMES,
+    SECTION_TAG_VALUES,
+    SECTION_STREET_NAMES,
+    SECTION_NODES,
+    SECTION_WAYS,
+    SECTION_ROAD_GRAPH,
+    SECTION_HIERARCHY,
+    SECTION_SEGMENT_INDEX,
+    N_SECTIONS
+};
+
+#define SECTION_BIT(SECTION) \
+    (1u << (SECTION))
+
+static const uint32_t ALL_SECTIONS = SECTION_BIT(N_SECTIONS) - 1;
 
 qSpan<uint32_t> Derserialize_StreetName_indicies(Serializer& serializer
-                                    , Pool* pool
-                                    , uint32_t street_names_offset)
+                                    , Pool* pool)
 {
-    qSpan<uint32_t> street_name_indicies;
-    const auto old_pos = serializer.SetPosition(street_names_offset);
+    qSpan<uint32_t> street_name_indicies {};
+    const auto old_pos = serializer.CurrentPosition();
+    if (!serializer.ReadSection(SECTION_STREET_NAMES))
+        return street_name_indicies;
 
     uint32_t n_street_names = serializer.ReadU32();
     street_name_indicies.AllocFromPool(n_street_names, pool);
@@ -32,6 +53,8 @@ qSpan<uint32_t> Derserialize_StreetName_indicies(Serializer& serializer
     // printf("Read %d street_name_indicies\n", street_name_indicies.size());
 
     serializer.SetPosition(old_pos);
+
+    return street_name_indicies;
 }
 
 struct DeSerializeWays
@@ -45,8 +68,30 @@ struct DeSerializeWays
     qSpan<uint32_t> street_name_indicies {};
     qSpan<Node> nodes;
     qSpan<Way> ways;
+    /// indexed by RoutingProfile, the contraction hierarchy is built on the car graph
+    RoadGraph graphs[N_PROFILES];
+    /// the turn restrictions of the car graph
+    TurnRestrictions turn_restrictions;
+    ContractionHierarchy hierarchy;
+    SegmentIndex segment_index;
     Pool *pool;
 
+    /// SECTION_BITs of the sections read so far
+    uint32_t loaded_sections = 0;
+
+    // coordinates are stored as deltas to the previous node
+    int32_t last_lat_e7 = 0;
+    int32_t last_lon_e7 = 0;
+
+    void ReadCoordinates(Serializer& serializer, Node* node)
+    {
+        int64_t delta;
+        serializer.ReadVarInt(&delta);
+        node->lat_e7 = last_lat_e7 = (int32_t)(last_lat_e7 + delta);
+        serializer.ReadVarInt(&delta);
+        node->lon_e7 = last_lon_e7 = (int32_t)(last_lon_e7 + delta);
+    }
+
     void ReadTags(Serializer& serializer, short_tags_t* tags)
     {
         uint32_t n_tags;
@@ -61,27 +106,26 @@ struct DeSerializeWays
         }
     }
 
-    void DeSerialize (Serializer& serializer, Pool* pool)
+    /// Reads the requested sections which are not loaded yet, each from the offset
+    /// in the section directory. Sections missing in the file are skipped.
+    void DeSerialize (Serializer& serializer, Pool* pool, uint32_t sections = ALL_SECTIONS)
     {
-        const auto tag_names_off = serializer.ReadU32(); // beginning tag names
-        MAYBE_UNUSED(tag_names_off);
-        const auto tag_values_off = serializer.ReadU32(); // beginning tag values
-        MAYBE_UNUSED(tag_values_off);
-        const auto street_names_off = serializer.ReadU32(); // beginning street_names
-        MAYBE_UNUSED(street_names_off);
-        const auto nodes_off = serializer.ReadU32(); // beginning nodes
-        MAYBE_UNUSED(nodes_off);
-        const auto ways_off = serializer.ReadU32(); // beginning ways
-        MAYBE_UNUSED(ways_off);
-
         assert(pool != nullptr);
 
         this->pool = pool;
 
+        sections &= ~loaded_sections;
+        loaded_sections |= sections;
+
+        if (sections & (SECTION_BIT(SECTION_TAG_NAMES) | SECTION_BIT(SECTION_TAG_VALUES)))
         {
             clock_t deserialize_tags_begin = clock();
+            if ((sections & SECTION_BIT(SECTION_TAG_NAMES)) && serializer.ReadSection(SECTION_TAG_NAMES))
             {
                 tag_names.DeSerialize(serializer);
+            }
+            if ((sections & SECTION_BIT(SECTION_TAG_VALUES)) && serializer.ReadSection(SECTION_TAG_VALUES))
+            {
                 tag_values.DeSerialize(serializer);
             }
             clock_t deserialize_tags_end = clock();
@@ -92,21 +136,13 @@ struct DeSerializeWays
         }
 
 
+        if (sections & SECTION_BIT(SECTION_STREET_NAMES))
         {
             clock_t deserialize_street_names_begin = clock();
             {
-                uint32_t n_street_names = serializer.ReadU32();
-                street_name_indicies.AllocFromPool(n_street_names, pool);
-
-                for (uint32_t i = 0;
-                    i < n_street_names;
-                    i++)
-                {
-                    serializer.ReadShortUint(&street_name_indicies[i]);
-                    // printf("street_name: %s\n", tag_values[value].data());
-                }
-                // printf("Read %d street_name_indicies\n", street_name_indicies.size());
-             }
+                street_name_indicies =
+                    Derserialize_StreetName_indicies(serializer, pool);
+            }
             clock_t deserialize_street_names_end = clock();
 #if PERF_PRINTOUT
             printf("deserialisation of street names took %f milliseconds\n",
@@ -114,8 +150,9 @@ struct DeSerializeWays
 #endif
         }
 
+        if ((sections & SECTION_BIT(SECTION_NODES)) && serializer.ReadSection(SECTION_NODES))
         {
-            assert(serializer.CurrentPosition() == nodes_off);
+            last_lat_e7 = last_lon_e7 = 0;
 
             const auto n_nodes = serializer.ReadU32();
             nodes.AllocFromPool(n_nodes, pool);
@@ -135,8 +172,7 @@ struct DeSerializeWays
 
                         n.osmid = base_id;
                         // writing out the number of relative nod
-                        n.lat_m = serializer.ReadF64();
-                        n.lon_m = serializer.ReadF64();
+                        ReadCoordinates(serializer, &n);
                         ReadTags(serializer, &n.tags);
                         // number of children
                         uint32_t n_children = serializer.ReadU8();
@@ -148,8 +184,7 @@ struct DeSerializeWays
                             auto & child = nodes[idx++];
 
                             child.osmid = base_id + serializer.ReadU8();
-                            child.lat_m = serializer.ReadF64();
-                            child.lon_m = serializer.ReadF64();
+                            ReadCoordinates(serializer, &child);
                             ReadTags(serializer, &child.tags);
                         }
                     }
@@ -161,65 +196,143 @@ struct DeSerializeWays
                 ((deserialize_nodes_end - deserialize_nodes_begin) / (double)CLOCKS_PER_SEC) * 1000.0f);
 #endif
         }
-        assert(ways_off == serializer.CurrentPosition());
-
-        const auto n_ways = serializer.ReadU32();
-        ways.AllocFromPool(n_ways, pool);
 
-        clock_t deserialize_ways_begin = clock();
+        if ((sections & SECTION_BIT(SECTION_SEGMENT_INDEX)) && serializer.ReadSection(SECTION_SEGMENT_INDEX))
         {
-            uint64_t base_way_osmid = 0;
 
-            for(auto& w : ways)
+            clock_t deserialize_segment_index_begin = clock();
             {
-                int32_t osmid_delta;
-                serializer.ReadShortInt(&osmid_delta);
-
-                w.osmid = base_way_osmid + osmid_delta;
-                base_way_osmid = w.osmid;
+                segment_index.DeSerialize(serializer);
             }
+            clock_t deserialize_segment_index_end = clock();
+#if PERF_PRINTOUT
+            printf("deserialisation of the spatial index took %f milliseconds\n",
+                ((deserialize_segment_index_end - deserialize_segment_index_begin) / (double)CLOCKS_PER_SEC) * 1000.0f);
+#endif
+        }
+
+        if ((sections & SECTION_BIT(SECTION_WAYS)) && serializer.ReadSection(SECTION_WAYS))
+        {
 
-            for(uint32_t i = 0;
-                i < ways.size();
-                i++)
+            const auto n_ways = serializer.ReadU32();
+            ways.AllocFromPool(n_ways, pool);
+
+            clock_t deserialize_ways_begin = clock();
             {
-                auto &w = ways[i];
-                ReadTags(serializer, &w.tags);
+                uint64_t base_way_osmid = 0;
+
+                for(auto& w : ways)
+                {
+                    int32_t osmid_delta;
+                    serializer.ReadShortInt(&osmid_delta);
 
-                uint32_t n_refs;
-                serializer.ReadShortUint(&n_refs);
+                    w.osmid = base_way_osmid + osmid_delta;
+                    base_way_osmid = w.osmid;
+                }
 
-                if (n_refs)
+                for(uint32_t i = 0;
+                    i < ways.size();
+                    i++)
                 {
-                    w.refs.AllocFromPool(n_refs, pool);
-                    const auto base_ref = serializer.ReadU64();
-                    w.refs[0] = base_ref;
+                    auto &w = ways[i];
+                    ReadTags(serializer, &w.tags);
 
-                    for(uint32_t i = 1;
-                        i < n_refs;
-                        i++)
+                    uint32_t n_refs;
+                    serializer.ReadShortUint(&n_refs);
+
+                    if (n_refs)
                     {
-                        int32_t delta;
+                        w.refs.AllocFromPool(n_refs, pool);
+                        const auto base_ref = serializer.ReadU64();
+                        w.refs[0] = base_ref;
 
-                        auto bytes_read =
-                            serializer.ReadShortInt(&delta);
-                        MAYBE_UNUSED(bytes_read);
-                        w.refs[i] = base_ref + delta;
-                        if (delta == 0)
+                        for(uint32_t i = 1;
+                            i < n_refs;
+                            i++)
                         {
-                            assert(bytes_read == 1);
-                            w.refs[i] = serializer.ReadU64();
+                            int32_t delta;
+
+                            auto bytes_read =
+                                serializer.ReadShortInt(&delta);
+                            MAYBE_UNUSED(bytes_read);
+                            w.refs[i] = base_ref + delta;
+                            if (delta == 0)
+                            {
+                                assert(bytes_read == 1);
+                                w.refs[i] = serializer.ReadU64();
+                            }
                         }
                     }
                 }
             }
+            clock_t deserialize_ways_end = clock();
+#if PERF_PRINTOUT
+            printf("deserialisation of ways took %f milliseconds\n",
+                ((deserialize_ways_end - deserialize_ways_begin) / (double)CLOCKS_PER_SEC) * 1000.0f);
+#endif
         }
-        clock_t deserialize_ways_end = clock();
+
+        if ((sections & SECTION_BIT(SECTION_ROAD_GRAPH)) && serializer.ReadSection(SECTION_ROAD_GRAPH))
+        {
+
+            clock_t deserialize_graph_begin = clock();
+            // every later graph would be misread if the profiles differ, so
+            // a file written with another set of profiles loads without graphs
+            const auto n_graphs = serializer.ReadU32();
+            if (n_graphs != N_PROFILES)
+            {
+                fprintf(stderr, "the road graph section holds %u graphs but there are %u profiles, skipping it\n",
+                    n_graphs, (uint32_t) N_PROFILES);
+                loaded_sections &= ~SECTION_BIT(SECTION_ROAD_GRAPH);
+            }
+            else
+            {
+                bool graphs_valid = true;
+                for (auto& graph : graphs)
+                    graphs_valid = graphs_valid && graph.DeSerialize(serializer);
+                // the restrictions are resolved against the car graph
+                graphs_valid = graphs_valid
+                    && turn_restrictions.DeSerialize(serializer, graphs[PROFILE_CAR].NodeCount());
+                if (!graphs_valid)
+                {
+                    fprintf(stderr, "a road graph or its turn restrictions do not fit the section, skipping it\n");
+                    for (auto& graph : graphs)
+                        graph = RoadGraph {};
+                    turn_restrictions = TurnRestrictions {};
+                    loaded_sections &= ~SECTION_BIT(SECTION_ROAD_GRAPH);
+                }
+            }
+            clock_t deserialize_graph_end = clock();
 #if PERF_PRINTOUT
-        printf("deserialisation of ways took %f milliseconds\n",
-            ((deserialize_ways_end - deserialize_ways_begin) / (double)CLOCKS_PER_SEC) * 1000.0f);
+            printf("deserialisation of the road graphs took %f milliseconds\n",
+                ((deserialize_graph_end - deserialize_graph_begin) / (double)CLOCKS_PER_SEC) * 1000.0f);
 #endif
+        }
 
+        if ((sections & SECTION_BIT(SECTION_HIERARCHY)) && serializer.ReadSection(SECTION_HIERARCHY))
+        {
+
+            clock_t deserialize_hierarchy_begin = clock();
+            if (!hierarchy.DeSerialize(serializer))
+            {
+                fprintf(stderr, "the contraction hierarchy does not fit its section, skipping it\n");
+                loaded_sections &= ~SECTION_BIT(SECTION_HIERARCHY);
+            }
+            // its node ids are the ones of the car graph
+            else if ((loaded_sections & SECTION_BIT(SECTION_ROAD_GRAPH))
+                && hierarchy.NodeCount() != graphs[PROFILE_CAR].NodeCount())
+            {
+                fprintf(stderr, "the contraction hierarchy has %u nodes but the car graph %u, skipping it\n",
+                    hierarchy.NodeCount(), graphs[PROFILE_CAR].NodeCount());
+                hierarchy = ContractionHierarchy {};
+                loaded_sections &= ~SECTION_BIT(SECTION_HIERARCHY);
+            }
+            clock_t deserialize_hierarchy_end = clock();
+#if PERF_PRINTOUT
+            printf("deserialisation of the contraction hierarchy took %f milliseconds\n",
+                ((deserialize_hierarchy_end - deserialize_hierarchy_begin) / (double)CLOCKS_PER_SEC) * 1000.0f);
+#endif
+        }
     }
 } ;
 
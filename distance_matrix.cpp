@@ -0,0 +1,161 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+#include "road_graph.cpp"
+#include "route_query.cpp"
+#include "contraction_hierarchy.cpp"
+
+using namespace std;
+
+// Dense n_sources x n_targets table of shortest path distances in the unit of the edge weights,
+// INFINITE_DISTANCE where a target can not be reached.
+struct DistanceMatrix
+{
+    uint32_t n_sources = 0;
+    uint32_t n_targets = 0;
+    vector<uint32_t> distances;
+
+    uint32_t at(uint32_t source, uint32_t target) const
+    {
+        return distances[(size_t)source * n_targets + target];
+    }
+};
+
+// Many to many distances on a ContractionHierarchy with buckets.
+// A backward upward search from every target leaves (target, distance) in a
+// bucket at each node it settles, a forward upward search from every source
+// then only has to scan the buckets of the nodes it settles. That is one
+// search per source and per target instead of one query per pair.
+struct ManyToMany
+{
+    const ContractionHierarchy& hierarchy;
+    unsigned n_threads;
+
+    ManyToMany(const ContractionHierarchy& hierarchy, unsigned n_threads = 0)
+        : hierarchy(hierarchy)
+        , n_threads(n_threads ? n_threads : max(1u, thread::hardware_concurrency()))
+    {}
+
+    DistanceMatrix Compute(const vector<uint32_t>& sources, const vector<uint32_t>& targets) const;
+
+private:
+    struct BucketEntry
+    {
+        uint32_t node;
+        uint32_t target;
+        uint32_t distance;
+    };
+
+    /// settles the whole upward search space of start and calls f(node, distance) for every node which is not stalled
+    template <typename F>
+    void UpwardSearch(uint32_t start, bool forward, QueryWorkspace& ws, F f) const;
+};
+
+template <typename F>
+void ManyToMany::UpwardSearch(uint32_t start, bool forward, QueryWorkspace& ws, F f) const
+{
+    const auto& h = hierarchy;
+    const auto& first = forward ? h.first_up : h.first_down;
+    const auto& heads = forward ? h.up_targets : h.down_sources;
+    const auto& weights = forward ? h.up_weights : h.down_weights;
+    const auto& opposite_first = forward ? h.first_down : h.first_up;
+    const auto& opposite_heads = forward ? h.down_sources : h.up_targets;
+    const auto& opposite_weights = forward ? h.down_weights : h.up_weights;
+
+    ws.Reset(h.NodeCount());
+    ws.Set(start, 0, start);
+    ws.heap.Push(0, start);
+
+    while (!ws.heap.Empty())
+    {
+        const auto top = ws.heap.Pop();
+        const uint32_t u = top.node;
+        if (top.key != ws.distance[u])
+            continue;
+
+        // stall on demand, see ContractionHierarchy::Query
+        bool stalled = false;
+        for (uint32_t e = opposite_first[u]; e < opposite_first[u + 1] && !stalled; e++)
+        {
+            const uint32_t w = opposite_heads[e];
+            stalled = ws.Reached(w) && (uint64_t)ws.distance[w] + opposite_weights[e] < top.key;
+        }
+        if (stalled)
+            continue;
+
+        f(u, top.key);
+
+        for (uint32_t e = first[u]; e < first[u + 1]; e++)
+        {
+            const uint32_t v = heads[e];
+            const uint32_t dist_v = top.key + weights[e];
+            if (dist_v < ws.Distance(v))
+            {
+                ws.Set(v, dist_v, u);
+                ws.heap.Push(dist_v, v);
+            }
+        }
+    }
+}
+
+DistanceMatrix ManyToMany::Compute(const vector<uint32_t>& sources, const vector<uint32_t>& targets) const
+{
+    DistanceMatrix matrix;
+    matrix.n_sources = (uint32_t)sources.size();
+    matrix.n_targets = (uint32_t)targets.size();
+    matrix.distances.assign((size_t)matrix.n_sources * matrix.n_targets, INFINITE_DISTANCE);
+
+    const uint32_t n_nodes = hierarchy.NodeCount();
+    vector<QueryWorkspace> workspaces(n_threads);
+
+    // fill the buckets with the backward searches, every thread takes a batch of targets
+    vector<vector<BucketEntry> > thread_entries(n_threads);
+    ParallelFor(matrix.n_targets, n_threads, [&] (unsigned t, uint32_t begin, uint32_t end) {
+        for (uint32_t j = begin; j < end; j++)
+        {
+            UpwardSearch(targets[j], false, workspaces[t], [&] (uint32_t node, uint32_t dist) {
+                thread_entries[t].push_back({node, j, dist});
+            });
+        }
+    });
+
+    // the buckets of node u are [first_bucket[u], first_bucket[u + 1])
+    vector<uint32_t> first_bucket(n_nodes + 1, 0);
+    for (const auto& entries : thread_entries)
+        for (const auto& e : entries)
+            first_bucket[e.node + 1]++;
+    for (uint32_t u = 0; u < n_nodes; u++)
+        first_bucket[u + 1] += first_bucket[u];
+
+    vector<pair<uint32_t, uint32_t> > buckets(first_bucket[n_nodes]);
+    {
+        vector<uint32_t> fill(first_bucket.begin(), first_bucket.end() - 1);
+        for (auto& entries : thread_entries)
+        {
+            for (const auto& e : entries)
+                buckets[fill[e.node]++] = {e.target, e.distance};
+            vector<BucketEntry>().swap(entries);
+        }
+    }
+
+    // the forward searches only read the buckets, every thread fills the rows of its batch of sources
+    ParallelFor(matrix.n_sources, n_threads, [&] (unsigned t, uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++)
+        {
+            uint32_t* row = &matrix.distances[(size_t)i * matrix.n_targets];
+            UpwardSearch(sources[i], true, workspaces[t], [&] (uint32_t node, uint32_t dist) {
+                for (uint32_t b = first_bucket[node]; b < first_bucket[node + 1]; b++)
+                {
+                    const uint64_t through = (uint64_t)dist + buckets[b].second;
+                    if (through < row[buckets[b].first])
+                        row[buckets[b].first] = (uint32_t)through;
+                }
+            });
+        }
+    });
+
+    return matrix;
+}
@@ -11,6 +11,10 @@ To run it:
 #include <unordered_map>
 #include <map>
 #include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include "osmpbfreader.h"
 #include <iostream>
 #include <string.h>
@@ -70,22 +74,101 @@ bool CanFind(const map_t& map, const typename map_t::value_type && key_value) {
     return result;
 }
 
-string_view findName(const Tags tags)
+// position of the name among the tags, -1 if there is none or it is empty
+int findName(const TagsView& tags)
 {
-    string_view name = {};
-    auto entry = tags.find("name");
-    if (entry != tags.end()) {
-        name = entry->second;
-    }
+    const int name = tags.find_index("name");
+    if (name >= 0 && tags.value(name).empty())
+        return -1;
     return name;
 }
 
 
 #include "ways.h"
+#include "node_store.h"
+#include "road_graph.cpp"
+#include "turn_restrictions.cpp"
+#include "route_query.cpp"
+#include "contraction_hierarchy.cpp"
+#include "spatial_index.cpp"
+#include "isochrone.cpp"
+#include "distance_matrix.cpp"
 
 
 #include "deserialize.cpp"
 
+// Reads a type=restriction relation from a way via a node to a way, false for anything else.
+// Restrictions for other vehicles than cars or excepting them are skipped, as are
+// the ones via ways and the ones with several from or to ways.
+bool parse_turn_restriction(const TagsView& tags, const References& refs, TurnRestriction& restriction)
+{
+    const auto type = tags.find("type");
+    if(!type || *type != "restriction")
+        return false;
+
+    auto kind = tags.find("restriction");
+    if(!kind)
+        kind = tags.find("restriction:motorcar");
+    const auto except = tags.find("except");
+    if(!kind || (except && except->find("motorcar") != std::string::npos))
+        return false;
+
+    if(0 == kind->compare(0, 3, "no_"))
+        restriction.only = false;
+    else if(0 == kind->compare(0, 5, "only_"))
+        restriction.only = true;
+    else
+        return false;
+
+    uint32_t n_from = 0, n_via = 0, n_to = 0;
+    for(const auto& r : refs) {
+        if(r.role == "from" && r.member_type == OSMPBF::Relation::WAY) {
+            restriction.from_way = r.member_id;
+            n_from++;
+        }
+        else if(r.role == "via") {
+            if(r.member_type != OSMPBF::Relation::NODE)
+                return false;
+            restriction.via_node = r.member_id;
+            n_via++;
+        }
+        else if(r.role == "to" && r.member_type == OSMPBF::Relation::WAY) {
+            restriction.to_way = r.member_id;
+            n_to++;
+        }
+    }
+    return n_from == 1 && n_via == 1 && n_to == 1;
+}
+
+// The encoded sections which are not in the file yet, in the order they were finished.
+// The encoders hand them over here and the writer takes them out one at a time.
+struct FinishedSections
+{
+    void Push(EncodedSection* section)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            sections.push_back(section);
+        }
+        finished_cv.notify_one();
+    }
+
+    /// waits until a section is finished
+    EncodedSection* Pop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished_cv.wait(lock, [this] { return !sections.empty(); });
+        auto section = sections.front();
+        sections.erase(sections.begin());
+        return section;
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable finished_cv;
+    vector<EncodedSection*> sections;
+};
+
 struct SerializeWays
 {
     // the following fields get serialized.
@@ -93,40 +176,118 @@ struct SerializeWays
 #        include "prime_names.h"
     };
     StringTable tag_values {};
+    /// ids into tag_values, provisional ids into tag_strings until FinishTags
     set<uint32_t> street_name_indicies {};
-    std::unordered_map<uint64_t, Node> nodes;
+    NodeStore nodes;
     vector<Way> ways;
+    CompiledProfiles profiles;
+    RoadGraph graphs[N_PROFILES];
+    /// restriction relations as read, resolved against the car graph once it is built
+    vector<TurnRestriction> restrictions;
+    TurnRestrictions turn_restrictions;
+    ContractionHierarchy hierarchy;
+    SegmentIndex segment_index;
     Pool* pool;
 
     // everthing below is just serialisation state
 
+    // The tag strings of every block are interned on the threads which decode the blocks,
+    // see intern_tags. Until FinishTags the tags hold the provisional ids of tag_strings,
+    // the uses of every id as a name and as a value are counted by the callbacks
+    ConcurrentStringTable tag_strings;
+    vector<uint32_t> name_uses = {};
+    vector<uint32_t> value_uses = {};
+
+    struct Interner
+    {
+        Interner(SerializeWays& visitor) : strings(visitor.tag_strings) {}
+
+        uint32_t intern(const std::string& str)
+        {
+            return strings.AddString(str);
+        }
+
+        ConcurrentStringTable::Interner strings;
+    };
+
     uint64_t currentBaseNode = 0;
     uint8_t dependent_nodes[255];
     uint8_t n_dependent_nodes = 0;
 
+    // sections are written out from here as soon as they are encoded
+    FinishedSections finished_sections;
+
+    // indices into ways of the ways the road graph is built from
+    vector<uint32_t> highway_ways = {};
+
     vector<pair<uint64_t, uint8_t> > baseNodes = {};
     vector<vector<uint8_t> > childNodes {};
 
+    // coordinates are written as deltas to the previously written node
+    int32_t last_lat_e7 = 0;
+    int32_t last_lon_e7 = 0;
 
-    short_tags_t ShortenTags(const Tags& tags) {
+
+    static void CountUse(vector<uint32_t>& uses, uint32_t id)
+    {
+        if(id >= uses.size())
+            uses.resize(id + 1, 0);
+        uses[id]++;
+    }
+
+    // the strings were interned while their block was decoded, only their uses are counted here
+    short_tags_t ShortenTags(const TagsView& tags) {
+        assert(tags.string_ids);
         short_tags_t result = {};
-        {
-            uint32_t idx = 0;
-            result.AllocFromPool(tags.size(), pool);
+        result.AllocFromPool(tags.size(), pool);
 
-            for(auto it = tags.begin();
-                it != tags.end();
-                it++)
-            {
-                auto name_id = tag_names.AddString(it->first);
-                auto value_id = tag_values.AddString(it->second);
-                result[idx++] = {name_id, value_id};
-            }
+        for(int i = 0; i < tags.size(); i++)
+        {
+            const uint32_t name_id = tags.key_id(i);
+            const uint32_t value_id = tags.value_id(i);
+            CountUse(name_uses, name_id);
+            CountUse(value_uses, value_id);
+            result[i] = {name_id, value_id};
         }
 
         return result;
     }
 
+    // moves the tag strings into tag_names and tag_values, gives the most used ones the
+    // smallest ids, which take the fewest bytes as ShortUints, and rewrites every id
+    // which was handed out already
+    void FinishTags() {
+        auto names = tag_strings.Finish(tag_names, name_uses);
+        auto values = tag_strings.Finish(tag_values, value_uses);
+        tag_strings.Clear();
+        vector<uint32_t>().swap(name_uses);
+        vector<uint32_t>().swap(value_uses);
+
+        const auto new_names = tag_names.ReorderByUsage();
+        const auto new_values = tag_values.ReorderByUsage();
+        for(auto& id : names)
+            id = new_names[id];
+        for(auto& id : values)
+            id = new_values[id];
+
+        auto Remap = [&](const short_tags_t& tags) {
+            for(auto& tag : tags)
+            {
+                tag.first = names[tag.first];
+                tag.second = values[tag.second];
+            }
+        };
+        for(const auto& w : ways)
+            Remap(w.tags);
+        for(const auto& tags : nodes.tags)
+            Remap(tags);
+
+        set<uint32_t> remapped_street_names;
+        for(auto idx : street_name_indicies)
+            remapped_street_names.emplace(values[idx]);
+        street_name_indicies.swap(remapped_street_names);
+    }
+
     void WriteTags(Serializer& serializer, const short_tags_t& tags)
     {
         serializer.WriteShortUint(tags.size());
@@ -137,20 +298,41 @@ struct SerializeWays
         }
     }
 
-    void node_callback(uint64_t osmid, double lon, double lat, const Tags &tags) {
+    void WriteCoordinates(Serializer& serializer, const Node& node)
+    {
+        serializer.WriteVarInt((int64_t)node.lat_e7 - last_lat_e7);
+        serializer.WriteVarInt((int64_t)node.lon_e7 - last_lon_e7);
+        last_lat_e7 = node.lat_e7;
+        last_lon_e7 = node.lon_e7;
+    }
+
+    // closes the group of the current base node
+    void PushBaseNode()
+    {
+        baseNodes.push_back({currentBaseNode, n_dependent_nodes});
+        vector<uint8_t> dependent_nodes_v {};
+        for(int i = 0; i < n_dependent_nodes; i++)
+        {
+            dependent_nodes_v.push_back(dependent_nodes[i]);
+        }
+        childNodes.push_back(dependent_nodes_v);
+        currentBaseNode = 0;
+        n_dependent_nodes = 0;
+    }
+
+    SerializeWays()
+    {
+        nodes.keep_tags = true;
+    }
+
+    void node_callback(uint64_t osmid, LonLat coords, const TagsView &tags) {
         auto nDiff = ((int64_t)(osmid - currentBaseNode));
         // printf("node_id: %lu .. currentBaseNode: %lu - nDiff: %lu\n", osmid, currentBaseNode, nDiff)
-        if (nDiff > 255)
+        if (!currentBaseNode || nDiff > 255)
         {
-            baseNodes.push_back({currentBaseNode, n_dependent_nodes});
-            vector<uint8_t> dependent_nodes_v {};
-            for(int i = 0; i < n_dependent_nodes; i++)
-            {
-                dependent_nodes_v.push_back(dependent_nodes[i]);
-            }
-            childNodes.push_back(dependent_nodes_v);
+            if (currentBaseNode)
+                PushBaseNode();
             currentBaseNode = osmid;
-            n_dependent_nodes = 0;
         }
         else
         {
@@ -158,244 +340,360 @@ struct SerializeWays
             dependent_nodes[n_dependent_nodes++] = (uint8_t)nDiff;
         }
 
-        const auto street = tags.find("addr:street");
-        if (street != tags.end())
-        {
-            const auto street_name_index = tag_values.LookupString(street->second);
-            street_name_indicies.emplace(street_name_index);
-        }
-        this->nodes[osmid] = Node(osmid, lon, lat, ShortenTags(tags));
+        const int street = tags.find_index("addr:street");
+        if (street >= 0)
+            street_name_indicies.emplace(tags.value_id(street));
+        this->nodes.Add(osmid, coords.lon, coords.lat, ShortenTags(tags));
     }
 
     // This method is called every time a Way is read
-    void way_callback(uint64_t osmid, const Tags &tags, const std::vector<uint64_t> &refs){
+    void way_callback(uint64_t osmid, const TagsView &tags, const std::vector<uint64_t> &refs){
         // If the way is part of the road network we keep it
         // There are other tags that correspond to the street network, however for simplicity, we don't manage them
         // Homework: read more properties like oneways, bicycle lanes…
 
-        if(tags.find("highway") != tags.end()) {
-            const auto& name = findName(tags);
-
-            uint32_t name_index = 0;
-            if (name.size())
-            {
-                name_index = tag_values.LookupString(name);
-                street_name_indicies.emplace(name_index);
-            }
+        if(tags.find("highway")) {
+            highway_ways.push_back(ways.size());
+            const int name = findName(tags);
+            if (name >= 0)
+                street_name_indicies.emplace(tags.value_id(name));
         }
-        ways.push_back({osmid, refs, ShortenTags(tags)});
+        ways.push_back({osmid, {refs, pool}, ShortenTags(tags)});
     }
 
-    // We don't care about relations
-    void relation_callback(uint64_t /*osmid*/, const Tags &/*tags*/, const References & /*refs*/){}
+    // Only turn restrictions are kept of the relations
+    void relation_callback(uint64_t /*osmid*/, const TagsView &tags, const References &refs){
+        TurnRestriction restriction;
+        if(parse_turn_restriction(tags, refs, restriction))
+            restrictions.push_back(restriction);
+    }
 
-    void Serialize (Serializer& serializer)
+    static double MillisecondsSince(chrono::steady_clock::time_point begin)
     {
-        // First we reserve space for the index
-        const auto index_p = serializer.CurrentPosition();
-        serializer.WriteU32(index_p + 20); // beginning tag names
-        serializer.WriteU32(0); // beginning tag values
-        serializer.WriteU32(0); // beginning street_names
-        serializer.WriteU32(0); // beginning nodes
-        serializer.WriteU32(0); // beginning ways
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+    }
 
-        {
-            // then we serialze the tags
-            clock_t serialize_tags_begin = clock();
+    // runs encode on a thread of its own, the section ends up in encoded
+    // and is handed to finished_sections once it is complete
+    template <typename F>
+    thread EncodeSection(EncodedSection* encoded, uint32_t id, F encode)
+    {
+        encoded->id = id;
+        encoded->flags = 0;
+        return thread([this, encoded, encode] {
             {
-                tag_names.Serialize(serializer);
-                const auto tag_value_pos = serializer.CurrentPosition();
-                tag_values.Serialize(serializer);
-                // after serializng we go back and poke the value in
-                const auto after_tag_values = serializer.SetPosition(index_p + 4);
-                serializer.WriteU32(tag_value_pos);
-                serializer.SetPosition(after_tag_values);
+                Serializer serializer {encoded};
+                encode(serializer);
             }
-            clock_t serialize_tags_end = clock();
+            finished_sections.Push(encoded);
+        });
+    }
 
-            printf("serialisation of tags took %f milliseconds\n",
-                ((serialize_tags_end - serialize_tags_begin) / (double)CLOCKS_PER_SEC) * 1000.0f);
-        }
+    void SerializeStreetNames(Serializer& serializer)
+    {
+        serializer.WriteU32(street_name_indicies.size());
+        for(auto& e : street_name_indicies)
+            serializer.WriteShortUint(e);
+    }
+
+    // this will use base_nodes and delta coding
+    void SerializeNodes(Serializer& serializer)
+    {
+        serializer.WriteU32(nodes.size());
+
+        int idx = 0;
+
+        serializer.WriteU32(baseNodes.size());
 
-        // Now we serialize the street_name indecies
+        for(auto b : baseNodes)
         {
-            clock_t serialize_street_names_begin = clock();
+            const auto base_id = b.first;
+            const auto base_idx = nodes.Lookup(base_id);
+            assert(base_idx);
+            const auto base_node = nodes.GetNode(base_idx - 1);
+            serializer.WriteU64(base_id);
+            // writing out the number of relative nod
+            WriteCoordinates(serializer, base_node);
+
+            WriteTags(serializer, base_node.tags);
+            // number of children
+            serializer.WriteU8(b.second);
+            // child list
+            auto child_list = childNodes[idx];
+            for(int i = 0;
+                i < b.second;
+                i++)
             {
-                const auto street_name_position = serializer.CurrentPosition();
-                const auto oldP = serializer.SetPosition(index_p + 8);
-                {
-                    serializer.WriteU32(street_name_position);
-                }
-                serializer.SetPosition(oldP);
+                serializer.WriteU8(child_list[i]);
+                // id offset from base no
+                const auto child_idx = nodes.Lookup(base_id + child_list[i]);
+                assert(child_idx);
+                const auto child = nodes.GetNode(child_idx - 1);
 
-                serializer.WriteU32(street_name_indicies.size());
-                for(auto& e : street_name_indicies)
-                    serializer.WriteShortUint(e);
+                WriteCoordinates(serializer, child);
+
+                WriteTags(serializer, child.tags);
             }
-            clock_t serialize_street_names_end = clock();
-            printf("serialisation of street names took %f milliseconds\n",
-                ((serialize_street_names_end - serialize_street_names_begin) / (double)CLOCKS_PER_SEC) * 1000.0f);
+            idx++;
         }
+    }
 
-        // now we serialze the nodes.
-        // this will use base_nodes and delta coding
-        printf("number of base_nodes %u\n", (uint32_t) baseNodes.size());
-        printf("number of all nodes %u\n", (uint32_t) nodes.size());
+    void SerializeWayList(Serializer& serializer)
+    {
+        const auto n_ways = ways.size();
+        serializer.WriteU32(n_ways);
         {
-            const auto nodes_start = serializer.CurrentPosition();
-            const auto oldP = serializer.SetPosition(index_p + 12);
-            serializer.WriteU32(nodes_start);
-            serializer.SetPosition(oldP);
-        }
+            uint64_t lastOsmId = 0;
+            for(uint32_t widx = 0;
+                widx < n_ways;
+                widx++)
+            {
+                const auto& w = ways[widx];
 
+                serializer.WriteShortInt(w.osmid - lastOsmId);
+                lastOsmId = w.osmid;
+            }
+        }
 
-        // serializer.BeginField("vector<pair<uint64, relativeNodes>>"
-        clock_t serialize_bNodes_begin = clock();
+        for(uint32_t widx = 0;
+            widx < n_ways;
+            widx++)
         {
-            serializer.WriteU32(nodes.size());
-
-            int idx = 0;
+            const auto& w = ways[widx];
 
-            serializer.WriteU32(baseNodes.size());
+            WriteTags(serializer, w.tags);
 
-            for(auto b : baseNodes)
+            uint64_t base_ref;
+            const auto n_refs = w.refs.size();
+            serializer.WriteShortUint(n_refs);
+            if (n_refs)
             {
-                const auto base_id = b.first;
-                const auto & base_node = nodes[base_id];
-                serializer.WriteU64(base_id);
-                // writing out the number of relative nod
-                serializer.WriteF64(base_node.lat_m);
-                serializer.WriteF64(base_node.lon_m);
-
-                WriteTags(serializer, base_node.tags);
-                // number of children
-                serializer.WriteU8(b.second);
-                // child list
-                auto child_list = childNodes[idx];
-                for(int i = 0;
-                    i < b.second;
+                base_ref = w.refs[0];
+                serializer.WriteU64(base_ref);
+
+                for(uint32_t i = 1;
+                    i < n_refs;
                     i++)
                 {
-                    serializer.WriteU8(child_list[i]);
-                    // id offset from base no
-                    auto & child = nodes[base_id + child_list[i]];
-
-                    serializer.WriteF64(child.lat_m);
-                    serializer.WriteF64(child.lon_m);
-
-                    WriteTags(serializer, child.tags);
+                    int64_t diff = w.refs[i] - base_ref;
+                    if (diff != 0 && FitsInShortInt(diff))
+                    {
+                        // if there is a dupllicate node we have to use the long encoding
+                        // as a difference of 0 i reserved for the out of range
+                        // to switch to the long encoding
+                        serializer.WriteShortInt(w.refs[i] - base_ref);
+                    }
+                    else
+                    {
+                        serializer.WriteU8(0);
+                        // a 0 can't be a vaild ShortInt in this case.
+                        // therefore the deserializer knows that a raw U64 comes in
+                        serializer.WriteU64(w.refs[i]);
+                    }
                 }
-                idx++;
             }
         }
-        clock_t serialize_bNodes_end = clock();
-        printf("serialisation of baseNodes took %f milliseconds\n",
-            ((serialize_bNodes_end - serialize_bNodes_begin) / (double)CLOCKS_PER_SEC) * 1000.0f);
+    }
 
+    // the graphs between the intersections of the highways, one per profile,
+    // and the contraction hierarchy of the car graph, which has to wait for them
+    void SerializeGraphs(EncodedSection* graph_section, EncodedSection* hierarchy_section)
+    {
+        auto build_graphs_begin = chrono::steady_clock::now();
         {
-            const auto ways_start = serializer.CurrentPosition();
-            const auto oldP = serializer.SetPosition(index_p + 16);
-            {
-                serializer.WriteU32(ways_start);
-            }
-            serializer.SetPosition(oldP);
+            vector<Way> highways;
+            highways.reserve(highway_ways.size());
+            for(auto widx : highway_ways)
+                highways.push_back(ways[widx]);
+            RoadGraph::BuildProfiles(highways, nodes, profiles, graphs);
+            const auto n_unresolved = turn_restrictions.Build(graphs[PROFILE_CAR], highways, restrictions);
+            printf("%u of %u turn restrictions could not be resolved\n", n_unresolved, (uint32_t)restrictions.size());
+        }
+        printf("building the road graphs took %f milliseconds\n", MillisecondsSince(build_graphs_begin));
+        for(uint32_t p = 0; p < N_PROFILES; p++) {
+            printf("%s graph has %u nodes and %u edges\n", profile_names[p], graphs[p].NodeCount(), graphs[p].EdgeCount());
         }
 
-        clock_t serialize_ways_begin = clock();
+        // the graphs are encoded while the car graph is contracted
+        auto graph_encoder = EncodeSection(graph_section, SECTION_ROAD_GRAPH, [this] (Serializer& serializer) {
+            auto serialize_graph_begin = chrono::steady_clock::now();
+            serializer.WriteU32(N_PROFILES);
+            for(auto& graph : graphs)
+                graph.Serialize(serializer);
+            turn_restrictions.Serialize(serializer);
+            printf("serialisation of the road graphs took %f milliseconds\n", MillisecondsSince(serialize_graph_begin));
+        });
+
+        auto contract_begin = chrono::steady_clock::now();
         {
-            const auto n_ways = ways.size();
-            serializer.WriteU32(n_ways);
-            {
-                uint64_t lastOsmId = 0;
-                for(uint32_t widx = 0;
-                    widx < n_ways;
-                    widx++)
-                {
-                    const auto& w = ways[widx];
+            hierarchy.Build(graphs[PROFILE_CAR]);
+        }
+        printf("contraction of the car graph took %f milliseconds, %u edges with shortcuts\n",
+            MillisecondsSince(contract_begin), hierarchy.EdgeCount());
 
-                    serializer.WriteShortInt(w.osmid - lastOsmId);
-                    lastOsmId = w.osmid;
-                }
-            }
+        auto serialize_hierarchy_begin = chrono::steady_clock::now();
+        {
+            hierarchy_section->id = SECTION_HIERARCHY;
+            hierarchy_section->flags = 0;
+            Serializer serializer {hierarchy_section};
+            hierarchy.Serialize(serializer);
+        }
+        finished_sections.Push(hierarchy_section);
+        printf("serialisation of the contraction hierarchy took %f milliseconds\n",
+            MillisecondsSince(serialize_hierarchy_begin));
 
-            for(uint32_t widx = 0;
-                widx < n_ways;
-                widx++)
-            {
-                const auto& w = ways[widx];
+        graph_encoder.join();
+    }
 
-                WriteTags(serializer, w.tags);
+    void Serialize (Serializer& serializer)
+    {
+        // the last group of nodes is still open
+        if (currentBaseNode)
+            PushBaseNode();
+        nodes.Seal();
+        // the string tables are only read from here on
+        profiles.Compile(tag_names, tag_values);
 
-                uint64_t base_ref;
-                const auto n_refs = w.refs.size();
-                serializer.WriteShortUint(n_refs);
-                if (n_refs)
-                {
-                    base_ref = w.refs[0];
-                    serializer.WriteU64(base_ref);
+        printf("number of base_nodes %u\n", (uint32_t) baseNodes.size());
+        printf("number of all nodes %u\n", (uint32_t) nodes.size());
 
-                    for(uint32_t i = 1;
-                        i < n_refs;
-                        i++)
-                    {
-                        int64_t diff = w.refs[i] - base_ref;
-                        if (diff != 0 && FitsInShortInt(diff))
-                        {
-                            // if there is a dupllicate node we have to use the long encoding
-                            // as a difference of 0 i reserved for the out of range
-                            // to switch to the long encoding
-                            serializer.WriteShortInt(w.refs[i] - base_ref);
-                        }
-                        else
-                        {
-                            serializer.WriteU8(0);
-                            // a 0 can't be a vaild ShortInt in this case.
-                            // therefore the deserializer knows that a raw U64 comes in
-                            serializer.WriteU64(w.refs[i]);
-                        }
-                    }
-                }
-            }
+        // every part is encoded into a section of its own on a thread of its own,
+        // they only read what the import produced and write nothing the others read.
+        // Each section is appended with the crc32c it was encoded with as soon as it is
+        // finished and its memory goes right after, so the small sections do not wait
+        // for the contraction. The section directory at the end records where they are.
+        auto serialize_begin = chrono::steady_clock::now();
+        EncodedSection encoded[N_SECTIONS];
+        vector<thread> encoders;
+
+        encoders.push_back(EncodeSection(&encoded[SECTION_TAG_NAMES], SECTION_TAG_NAMES, [this] (Serializer& s) {
+            auto serialize_tags_begin = chrono::steady_clock::now();
+            tag_names.Serialize(s);
+            printf("serialisation of tag names took %f milliseconds\n", MillisecondsSince(serialize_tags_begin));
+        }));
+        encoders.push_back(EncodeSection(&encoded[SECTION_TAG_VALUES], SECTION_TAG_VALUES, [this] (Serializer& s) {
+            auto serialize_tags_begin = chrono::steady_clock::now();
+            tag_values.Serialize(s);
+            printf("serialisation of tag values took %f milliseconds\n", MillisecondsSince(serialize_tags_begin));
+        }));
+        encoders.push_back(EncodeSection(&encoded[SECTION_STREET_NAMES], SECTION_STREET_NAMES, [this] (Serializer& s) {
+            auto serialize_street_names_begin = chrono::steady_clock::now();
+            SerializeStreetNames(s);
+            printf("serialisation of street names took %f milliseconds\n", MillisecondsSince(serialize_street_names_begin));
+        }));
+        encoders.push_back(EncodeSection(&encoded[SECTION_NODES], SECTION_NODES, [this] (Serializer& s) {
+            auto serialize_nodes_begin = chrono::steady_clock::now();
+            SerializeNodes(s);
+            printf("serialisation of baseNodes took %f milliseconds\n", MillisecondsSince(serialize_nodes_begin));
+        }));
+        // the segments of the highways for snapping coordinates
+        encoders.push_back(EncodeSection(&encoded[SECTION_SEGMENT_INDEX], SECTION_SEGMENT_INDEX, [this] (Serializer& s) {
+            auto build_segment_index_begin = chrono::steady_clock::now();
+            segment_index.Build(ways, highway_ways, nodes);
+            printf("building the spatial index over %u segments took %f milliseconds\n", segment_index.size(),
+                MillisecondsSince(build_segment_index_begin));
+            segment_index.Serialize(s);
+        }));
+        encoders.push_back(EncodeSection(&encoded[SECTION_WAYS], SECTION_WAYS, [this] (Serializer& s) {
+            auto serialize_ways_begin = chrono::steady_clock::now();
+            SerializeWayList(s);
+            printf("serialisation of ways took %f milliseconds\n", MillisecondsSince(serialize_ways_begin));
+        }));
+        encoders.push_back(thread([this, &encoded] {
+            SerializeGraphs(&encoded[SECTION_ROAD_GRAPH], &encoded[SECTION_HIERARCHY]);
+        }));
+
+        double write_ms = 0;
+        for(uint32_t n_written = 0; n_written < N_SECTIONS; n_written++)
+        {
+            auto section = finished_sections.Pop();
+            auto write_begin = chrono::steady_clock::now();
+            serializer.WriteSection(*section);
+            vector<uint8_t>().swap(section->data);
+            write_ms += MillisecondsSince(write_begin);
         }
-        clock_t serialize_ways_end = clock();
 
-        printf("serialisation of ways took %f milliseconds\n",
-            ((serialize_ways_end - serialize_ways_begin) / (double)CLOCKS_PER_SEC) * 1000.0f);
+        for(auto& encoder : encoders)
+            encoder.join();
+        printf("encoding and writing all sections took %f milliseconds, %f of them writing\n",
+            MillisecondsSince(serialize_begin), write_ms);
     }
 };
 
 struct Routing {
-    // Map that stores all the nodes read
-    std::unordered_map<uint64_t, Node> nodes;
+    // Which objects the callbacks keep, see read_routing_graph
+    enum class Pass { All, Ways, ReferencedNodes };
+    Pass pass = Pass::All;
+
+    // Stores all the nodes read, sorted by id
+    NodeStore nodes;
+
+    // ids of the nodes used by the kept ways, collected during Pass::Ways
+    NodeIdSet referenced_nodes;
 
     // Stores all the nodes of all the ways that are part of the road network
     // ulong[][] ways;
     std::vector<Way> ways;
 
+    // restriction relations via a node, see parse_turn_restriction
+    std::vector<TurnRestriction> restrictions;
+
+    // backs the refs and tags of the ways
+    Pool pool {};
+
+    // the tags of the ways are interned so the profiles can be compiled against them
+    StringTable tag_names {
+#        include "prime_names.h"
+    };
+    StringTable tag_values {};
+
     // This method is called every time a Node is read
-    void node_callback(uint64_t osmid, double lon, double lat, const Tags &tags) {
-        this->nodes[osmid] = Node(osmid, lon, lat, {});
+    void node_callback(uint64_t osmid, LonLat coords, const TagsView &tags) {
+        if(pass == Pass::Ways)
+            return;
+        if(pass == Pass::ReferencedNodes && !referenced_nodes.Contains(osmid))
+            return;
+        this->nodes.Add(osmid, coords.lon, coords.lat);
     }
 
     // This method is called every time a Way is read
-    void way_callback(uint64_t osmid, const Tags &tags, const std::vector<uint64_t> &refs){
+    void way_callback(uint64_t osmid, const TagsView &tags, const std::vector<uint64_t> &refs){
         // If the way is part of the road network we keep it
-        // There are other tags that correspond to the street network, however for simplicity, we don't manage them
-        // Homework: read more properties like oneways, bicycle lanes…
-        if(tags.find("highway") != tags.end()) {
-            ways.push_back({osmid, refs, {}});
+        // Its tags are kept interned, the profiles decide about oneways, speeds and access
+        if(pass == Pass::ReferencedNodes)
+            return;
+        if(tags.find("highway")) {
+            short_tags_t short_tags = {};
+            short_tags.AllocFromPool(tags.size(), &pool);
+            uint32_t idx = 0;
+            for(const auto kv : tags)
+                short_tags[idx++] = {tag_names.AddString(kv.key), tag_values.AddString(kv.value)};
+            ways.push_back({osmid, {refs, &pool}, short_tags});
+            if(pass == Pass::Ways) {
+                for(uint64_t ref : refs)
+                    referenced_nodes.Insert(ref);
+            }
         }
     }
 
     // Once all the ways and nodes are read, we count how many times a node is used to detect intersections
+    // Nodes which are missing from the extract are skipped
     void count_nodes_uses() {
-        for(auto way : ways){
-            auto refs = way.refs;
+        nodes.Seal();
+        nodes.ResetUses();
+        for(const auto& way : ways){
+            const auto& refs = way.refs;
+            if(!refs.size())
+                continue;
             for(uint64_t ref : refs) {
-                nodes.at(ref).uses++;
+                const auto idx = nodes.Lookup(ref);
+                if(idx)
+                    nodes.uses[idx - 1]++;
             }
             // make sure that the last node is considered as an extremity
-            nodes.at(refs.back()).uses++;
+            const auto last = nodes.Lookup(refs[refs.size() - 1]);
+            if(last)
+                nodes.uses[last - 1]++;
         }
     }
 
@@ -410,7 +708,8 @@ struct Routing {
                 for(size_t i = 1; i < refs.size(); ++i) {
                     uint64_t current_ref = refs[i];
                     // If a node is used more than once, it is an intersection, hence it's a node of the road network graph
-                    if(nodes.at(current_ref).uses > 1) {
+                    const auto idx = nodes.Lookup(current_ref);
+                    if(idx && nodes.uses[idx - 1] > 1) {
                         // Homework: measure the length of the edge
                         uint64_t target = current_ref;
                         //auto src_node = nodes[source];
@@ -424,33 +723,466 @@ struct Routing {
         return result;
     }
 
-    // We don't care about relations
-    void relation_callback(uint64_t /*osmid*/, const Tags &/*tags*/, const References & /*refs*/){}
+    // Only turn restrictions are kept of the relations
+    void relation_callback(uint64_t /*osmid*/, const TagsView &tags, const References &refs){
+        if(pass == Pass::ReferencedNodes)
+            return;
+        TurnRestriction restriction;
+        if(parse_turn_restriction(tags, refs, restriction))
+            restrictions.push_back(restriction);
+    }
+};
+
+// Two pass import which only keeps what the routing graph needs:
+// first the highway ways, the turn restrictions and the ids of the way nodes, then only those nodes.
+// With the blob index the first pass only inflates way blobs and the second
+// only the node blobs whose id range contains a referenced node.
+void read_routing_graph(const std::string& filename, Routing& routing)
+{
+    BlobIndex index;
+    const bool have_index = index.load(filename);
+
+    routing.pass = Routing::Pass::Ways;
+    if (have_index)
+    {
+        read_osm_pbf_parallel(filename, routing, index.select(BlobWays | BlobRelations));
+    }
+    else
+    {
+        // the index comes for free with the first pass over the whole file
+        read_osm_pbf_and_index(filename, routing, index);
+        if (!index.save(filename))
+            printf("could not write the blob index %s.blobidx, the next import will scan the whole file again\n", filename.c_str());
+    }
+
+    vector<BlobIndexEntry> node_blobs;
+    for (const auto& b : index.select(BlobNodes))
+    {
+        if (routing.referenced_nodes.AnyInRange(b.min_id, b.max_id))
+            node_blobs.push_back(b);
+    }
+    printf("%u referenced nodes in %u of %u node blobs\n",
+        (uint32_t) routing.referenced_nodes.count,
+        (uint32_t) node_blobs.size(), (uint32_t) index.select(BlobNodes).size());
+
+    routing.pass = Routing::Pass::ReferencedNodes;
+    read_osm_pbf_parallel(filename, routing, node_blobs);
+    routing.pass = Routing::Pass::All;
+}
+
+// Synthetic road network of width x height intersections about 100 meters apart.
+// Every block between two neighbouring intersections is its own way, as ways are
+// split where a turn restriction refers to them. The benchmarks run on it
+// with --grid, so their numbers can be reproduced without an extract.
+struct GridNetwork {
+    uint32_t width;
+    uint32_t height;
+    NodeStore nodes;
+    /// the two refs of every way
+    std::vector<uint64_t> refs;
+    std::vector<Way> ways;
+    RoadGraph graph;
+    SegmentIndex segment_index;
+
+    GridNetwork(uint32_t width, uint32_t height) : width(width), height(height) {
+        const int32_t origin_lon = 134000000, origin_lat = 525000000;
+        const int32_t spacing_lon = 15000, spacing_lat = 9000;
+        srand(1);
+        for(uint32_t y = 0; y < height; y++) {
+            for(uint32_t x = 0; x < width; x++) {
+                // a few meters of jitter so the blocks are not all the same size
+                nodes.Add(NodeId(x, y), origin_lon + x * spacing_lon + rand() % 500,
+                                        origin_lat + y * spacing_lat + rand() % 500);
+            }
+        }
+
+        std::vector<uint64_t> way_ids;
+        for(uint32_t y = 0; y < height; y++) {
+            for(uint32_t x = 0; x < width; x++) {
+                if(x + 1 < width) {
+                    way_ids.push_back(WayId(x, y, false));
+                    refs.push_back(NodeId(x, y));
+                    refs.push_back(NodeId(x + 1, y));
+                }
+                if(y + 1 < height) {
+                    way_ids.push_back(WayId(x, y, true));
+                    refs.push_back(NodeId(x, y));
+                    refs.push_back(NodeId(x, y + 1));
+                }
+            }
+        }
+        // the refs are complete, the ways can point into them
+        std::vector<uint32_t> way_indices;
+        for(uint32_t w = 0; w < way_ids.size(); w++) {
+            way_indices.push_back(w);
+            ways.emplace_back(way_ids[w], qSpan<uint64_t>(&refs[2 * w], 2));
+        }
+
+        graph.Build(ways, nodes);
+        segment_index.Build(ways, way_indices, nodes);
+    }
+
+    uint64_t NodeId(uint32_t x, uint32_t y) const {
+        return (uint64_t)y * width + x + 1;
+    }
+
+    /// the way from (x, y) to the east or, if vertical, to the north
+    uint64_t WayId(uint32_t x, uint32_t y, bool vertical) const {
+        return 2 * NodeId(x, y) + vertical;
+    }
+
+    /// n restrictions at random inner intersections, a quarter of them only_* ones
+    std::vector<TurnRestriction> RandomRestrictions(uint32_t n) const {
+        srand(17);
+        std::vector<TurnRestriction> restrictions;
+        for(uint32_t i = 0; i < n; i++) {
+            const uint32_t x = 1 + rand() % (width - 2);
+            const uint32_t y = 1 + rand() % (height - 2);
+            // the ways west, east, south and north of (x, y)
+            const uint64_t around[4] = {WayId(x - 1, y, false), WayId(x, y, false),
+                                        WayId(x, y - 1, true), WayId(x, y, true)};
+            const uint32_t from = rand() % 4;
+            const uint32_t to = (from + 1 + rand() % 3) % 4;
+            restrictions.push_back({around[from], NodeId(x, y), around[to], rand() % 4 == 0});
+        }
+        return restrictions;
+    }
 };
 
+void contract_graph(const RoadGraph& graph, ContractionHierarchy& hierarchy)
+{
+    clock_t contract_begin = clock();
+    hierarchy.Build(graph);
+    clock_t contract_end = clock();
+    printf("contraction took %f milliseconds, %u edges with shortcuts\n",
+        ((contract_end - contract_begin) / (double)CLOCKS_PER_SEC) * 1000.0f, hierarchy.EdgeCount());
+}
+
+// Runs the same random queries with every algorithm and checks they agree,
+// returns false if any route differs from the one Dijkstra found
+bool benchmark_route_queries(const RoadGraph& graph, const ContractionHierarchy& hierarchy, uint32_t n_queries)
+{
+    RouteQuery query {graph};
+    srand(42);
+    std::vector< std::pair<uint32_t, uint32_t> > pairs;
+    for(uint32_t i = 0; i < n_queries; i++)
+        pairs.push_back({rand() % graph.NodeCount(), rand() % graph.NodeCount()});
+
+    const char* names[] = {"Dijkstra", "A*", "bidirectional Dijkstra", "contraction hierarchy"};
+    std::vector<uint32_t> distances[4];
+    for(int algorithm = 0; algorithm < 4; algorithm++) {
+        uint64_t settled = 0;
+        clock_t begin = clock();
+        for(const auto& p : pairs) {
+            RouteResult r = (algorithm == 0) ? query.Dijkstra(p.first, p.second)
+                          : (algorithm == 1) ? query.AStar(p.first, p.second)
+                          : (algorithm == 2) ? query.Bidirectional(p.first, p.second)
+                          : hierarchy.Query(p.first, p.second);
+            distances[algorithm].push_back(r.distance);
+            settled += r.settled;
+        }
+        clock_t end = clock();
+
+        printf("%u %s queries took %f milliseconds (%f per query, %u settled nodes on average)\n",
+            n_queries, names[algorithm],
+            ((end - begin) / (double)CLOCKS_PER_SEC) * 1000.0f,
+            ((end - begin) / (double)CLOCKS_PER_SEC) * 1000.0f / n_queries,
+            (uint32_t)(settled / n_queries));
+    }
+
+    bool agree = true;
+    for(int algorithm = 1; algorithm < 4; algorithm++) {
+        uint32_t differ = 0;
+        for(uint32_t i = 0; i < n_queries; i++)
+            differ += (distances[algorithm][i] != distances[0][i]);
+        if(differ) {
+            printf("%u %s routes differ from Dijkstra\n", differ, names[algorithm]);
+            agree = false;
+        }
+    }
+    return agree;
+}
+
+// Computes a n_sources x n_targets matrix between random nodes with the buckets
+// and the same pairs as single CH queries, returns false if any distance differs
+bool benchmark_distance_matrix(const ContractionHierarchy& hierarchy, uint32_t n_sources, uint32_t n_targets)
+{
+    srand(13);
+    std::vector<uint32_t> sources, targets;
+    for(uint32_t i = 0; i < n_sources; i++)
+        sources.push_back(rand() % hierarchy.NodeCount());
+    for(uint32_t i = 0; i < n_targets; i++)
+        targets.push_back(rand() % hierarchy.NodeCount());
+
+    clock_t begin = clock();
+    const auto matrix = ManyToMany(hierarchy).Compute(sources, targets);
+    clock_t end = clock();
+    printf("%ux%u distance matrix took %f milliseconds\n", n_sources, n_targets,
+        ((end - begin) / (double)CLOCKS_PER_SEC) * 1000.0f);
+
+    uint32_t differ = 0;
+    begin = clock();
+    for(uint32_t i = 0; i < n_sources; i++) {
+        for(uint32_t j = 0; j < n_targets; j++)
+            differ += (hierarchy.Query(sources[i], targets[j]).distance != matrix.at(i, j));
+    }
+    end = clock();
+    printf("the same %u pairs as single contraction hierarchy queries took %f milliseconds\n",
+        n_sources * n_targets, ((end - begin) / (double)CLOCKS_PER_SEC) * 1000.0f);
+
+    if(differ)
+        printf("%u matrix entries differ from the single queries\n", differ);
+    return !differ;
+}
+
+// Snaps random points within the extent of the segments to their 3 nearest segments,
+// once with the R-tree and once with a scan over every segment.
+// Returns false if the two disagree on any distance
+bool benchmark_snapping(const SegmentIndex& index, uint32_t n_queries)
+{
+    if(!index.size())
+        return true;
+    BoundingBox extent = index.segments[0].Box();
+    for(const auto& s : index.segments)
+        extent.Extend(s.Box());
+
+    srand(11);
+    std::vector<Coordinates> points;
+    for(uint32_t i = 0; i < n_queries; i++) {
+        points.push_back({extent.min_lon + (int32_t)(rand() % ((uint32_t)(extent.max_lon - extent.min_lon) + 1)),
+                          extent.min_lat + (int32_t)(rand() % ((uint32_t)(extent.max_lat - extent.min_lat) + 1))});
+    }
+
+    const char* names[] = {"R-tree", "linear scan"};
+    std::vector<double> distances[2];
+    std::vector<SegmentMatch> matches;
+    for(int scan = 0; scan < 2; scan++) {
+        clock_t begin = clock();
+        for(const auto& p : points) {
+            if(scan)
+                index.NearestByScan(p, 3, matches);
+            else
+                index.Nearest(p, 3, matches);
+            distances[scan].push_back(matches.back().distance);
+        }
+        clock_t end = clock();
+
+        printf("%u 3-nearest %s snaps over %u segments took %f milliseconds (%f microseconds per query)\n",
+            n_queries, names[scan], index.size(),
+            ((end - begin) / (double)CLOCKS_PER_SEC) * 1000.0f,
+            ((end - begin) / (double)CLOCKS_PER_SEC) * 1000000.0f / n_queries);
+    }
+
+    uint32_t differ = 0;
+    for(uint32_t i = 0; i < n_queries; i++)
+        differ += (distances[0][i] != distances[1][i]);
+    if(differ)
+        printf("%u R-tree snaps differ from the linear scan\n", differ);
+    return !differ;
+}
+
+// Compares turn aware queries with plain Dijkstra on the same random pairs.
+// Returns false if a turn aware route is shorter, takes a forbidden turn
+// or the turn aware queries take more than twice as long as the node based ones
+bool benchmark_turn_restrictions(const RoadGraph& graph, const TurnRestrictions& restrictions, uint32_t n_queries)
+{
+    RouteQuery query {graph};
+    srand(42);
+    std::vector< std::pair<uint32_t, uint32_t> > pairs;
+    for(uint32_t i = 0; i < n_queries; i++)
+        pairs.push_back({rand() % graph.NodeCount(), rand() % graph.NodeCount()});
+
+    std::vector<uint32_t> distances;
+    double milliseconds[2];
+    uint32_t longer = 0, shorter = 0, forbidden = 0;
+    for(int turn_aware = 0; turn_aware < 2; turn_aware++) {
+        uint64_t settled = 0;
+        clock_t begin = clock();
+        for(uint32_t i = 0; i < n_queries; i++) {
+            const auto& p = pairs[i];
+            RouteResult r = turn_aware ? query.TurnAware(p.first, p.second, restrictions)
+                                       : query.Dijkstra(p.first, p.second);
+            settled += r.settled;
+            if(!turn_aware) {
+                distances.push_back(r.distance);
+                continue;
+            }
+
+            shorter += (r.distance < distances[i]);
+            longer += (r.distance > distances[i]);
+            for(size_t k = 2; k < r.path.size(); k++) {
+                const auto arrival = restrictions.FindArrival(r.path[k - 2], r.path[k - 1]);
+                forbidden += (arrival && !restrictions.Allowed(arrival - 1, r.path[k]));
+            }
+        }
+        clock_t end = clock();
+        milliseconds[turn_aware] = ((end - begin) / (double)CLOCKS_PER_SEC) * 1000.0f;
+
+        printf("%u %s queries took %f milliseconds (%f per query, %u settled states on average)\n",
+            n_queries, turn_aware ? "turn aware" : "node based",
+            milliseconds[turn_aware], milliseconds[turn_aware] / n_queries,
+            (uint32_t)(settled / n_queries));
+    }
+
+    const double ratio = milliseconds[1] / max(milliseconds[0], 1e-3);
+    printf("%u routes got longer because of turn restrictions, turn aware queries cost %.2fx the node based ones\n",
+        longer, ratio);
+    if(shorter)
+        printf("%u turn aware routes are shorter than the node based ones\n", shorter);
+    if(forbidden)
+        printf("%u forbidden turns were taken\n", forbidden);
+    if(ratio > 2.0)
+        printf("turn aware queries exceed twice the cost of node based ones\n");
+    return !shorter && !forbidden && ratio <= 2.0;
+}
+
+// Compares isochrones bounded at max_seconds with unbounded sweeps over the whole graph.
+// Returns false if a bounded isochrone is not the start of the sweep from its source, or if
+// bounding does not save half of the time although it reaches at most a tenth of the nodes
+bool benchmark_isochrones(const RoadGraph& graph, uint32_t n_sources, double max_seconds)
+{
+    IsochroneQuery query {graph};
+    IsochroneResult result;
+    srand(7);
+    std::vector<uint32_t> sources;
+    for(uint32_t i = 0; i < n_sources; i++)
+        sources.push_back(rand() % graph.NodeCount());
+
+    const double limits[] = {max_seconds, INFINITY};
+    double milliseconds[2];
+    uint64_t reached[2];
+    for(uint32_t l = 0; l < 2; l++) {
+        uint64_t hull_points = 0;
+        reached[l] = 0;
+        clock_t begin = clock();
+        for(const auto source : sources) {
+            query.Compute(source, limits[l], result);
+            reached[l] += result.reached.size();
+        }
+        clock_t end = clock();
+        milliseconds[l] = ((end - begin) / (double)CLOCKS_PER_SEC) * 1000.0f;
+
+        clock_t hull_begin = clock();
+        for(const auto source : sources) {
+            query.Compute(source, limits[l], result, 50.0);
+            hull_points += result.hull.size();
+        }
+        clock_t hull_end = clock();
+
+        printf("%u isochrones of %f seconds took %f milliseconds, %f with hulls (%u nodes, %u hull points on average)\n",
+            n_sources, limits[l], milliseconds[l],
+            ((hull_end - hull_begin) / (double)CLOCKS_PER_SEC) * 1000.0f,
+            (uint32_t)(reached[l] / n_sources), (uint32_t)(hull_points / n_sources));
+    }
+
+    // the bounded search settles the nodes of the sweep in the same order until it stops,
+    // the first node it leaves out lies beyond the limit, up to the rounding to whole weights
+    uint32_t n_wrong = 0;
+    IsochroneResult bounded;
+    for(const auto source : sources) {
+        query.Compute(source, max_seconds, bounded);
+        query.Compute(source, INFINITY, result);
+        bool same = bounded.reached.size() <= result.reached.size();
+        for(size_t i = 0; same && i < bounded.reached.size(); i++)
+            same = bounded.reached[i].node == result.reached[i].node;
+        if(same && bounded.reached.size() < result.reached.size())
+            same = result.reached[bounded.reached.size()].seconds > max_seconds - 0.1;
+        n_wrong += !same;
+    }
+
+    const double speedup = milliseconds[1] / std::max(milliseconds[0], 0.001);
+    printf("bounded isochrones were %.1fx faster than sweeps, %u of %u differ from the sweep\n",
+        speedup, n_wrong, n_sources);
+    if(n_wrong)
+        return false;
+    if(reached[0] * 10 <= reached[1] && speedup < 2.0) {
+        printf("bounding the isochrones saved less than half of the time\n");
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char** argv) {
      if(argc != 2 && argc != 3) {
-        std::cout << "Usage: " << argv[0] << " file_to_read.osm.pbf" << std::endl;
+        std::cout << "Usage: " << argv[0] << " file_to_read.osm.pbf [--routing]" << std::endl;
+        std::cout << "       " << argv[0] << " --grid" << std::endl;
         return 1;
     }
 
+    // the benchmarks on a synthetic 100 x 100 grid, which needs no extract
+    if(argc == 2 && 0 == strcmp(argv[1], "--grid")) {
+        GridNetwork grid(100, 100);
+        std::cout << "The grid graph has " << grid.graph.NodeCount() << " nodes and "
+                  << grid.graph.EdgeCount() << " directed edges" << std::endl;
+        ContractionHierarchy hierarchy;
+        contract_graph(grid.graph, hierarchy);
+        bool ok = benchmark_route_queries(grid.graph, hierarchy, 100);
+        ok &= benchmark_snapping(grid.segment_index, 1000);
+        ok &= benchmark_distance_matrix(hierarchy, 200, 150);
+
+        TurnRestrictions turn_restrictions;
+        const auto restrictions = grid.RandomRestrictions(300);
+        const auto n_unresolved = turn_restrictions.Build(grid.graph, grid.ways, restrictions);
+        std::cout << restrictions.size() - n_unresolved << " of " << restrictions.size()
+                  << " turn restrictions apply to the grid" << std::endl;
+        ok &= benchmark_turn_restrictions(grid.graph, turn_restrictions, 1000);
+        ok &= benchmark_isochrones(grid.graph, 100, 60.0);
+        return ok ? 0 : 1;
+    }
+
     // Let's read that file !
-//    Routing routing;
-//    read_osm_pbf(argv[1], routing);
-//    std::cout << "We read " << routing.nodes.size() << " nodes and " << routing.ways.size() << " ways" << std::endl;
-//    routing.count_nodes_uses();
-//    std::cout << "The routing graph has " << routing.edges().size() << " edges" << std::endl;
+    if(argc == 3 && 0 == strcmp(argv[2], "--routing")) {
+        Routing routing;
+        read_routing_graph(argv[1], routing);
+        std::cout << "We read " << routing.nodes.size() << " nodes and " << routing.ways.size() << " ways" << std::endl;
+        routing.count_nodes_uses();
+        std::cout << "The routing graph has " << routing.edges().size() << " edges" << std::endl;
+
+        CompiledProfiles profiles;
+        profiles.Compile(routing.tag_names, routing.tag_values);
+        RoadGraph graphs[N_PROFILES];
+        RoadGraph::BuildProfiles(routing.ways, routing.nodes, profiles, graphs);
+        for(uint32_t p = 0; p < N_PROFILES; p++) {
+            std::cout << "The " << profile_names[p] << " graph has " << graphs[p].NodeCount() << " nodes and "
+                      << graphs[p].EdgeCount() << " directed edges" << std::endl;
+        }
+
+        const RoadGraph& graph = graphs[PROFILE_CAR];
+        TurnRestrictions turn_restrictions;
+        const auto n_unresolved = turn_restrictions.Build(graph, routing.ways, routing.restrictions);
+        std::cout << routing.restrictions.size() - n_unresolved << " of " << routing.restrictions.size()
+                  << " turn restrictions apply to the car graph" << std::endl;
+
+        bool ok = true;
+        if(graph.NodeCount()) {
+            ContractionHierarchy hierarchy;
+            contract_graph(graph, hierarchy);
+            ok &= benchmark_route_queries(graph, hierarchy, 100);
+            ok &= benchmark_turn_restrictions(graph, turn_restrictions, 100);
+            ok &= benchmark_isochrones(graph, 20, 60.0);
+        }
+        return ok ? 0 : 1;
+    }
 
     SerializeWays serializeWays;
     Pool pool {};
     serializeWays.pool = &pool;
-    read_osm_pbf(argv[1], serializeWays);
-
-    serializeWays.tag_values.SortUsageCounts();
-    serializeWays.tag_names.SortUsageCounts();
+    {
+        // of the relations only the turn restrictions are kept, with an index of the file
+        // we skip the blobs which only hold other objects
+        BlobIndex index;
+        if(index.load(argv[1])) {
+            read_osm_pbf_parallel(argv[1], serializeWays, index.select(BlobNodes | BlobWays | BlobRelations));
+        }
+        else {
+            read_osm_pbf_and_index(argv[1], serializeWays, index);
+            if(!index.save(argv[1]))
+                printf("could not write the blob index %s.blobidx, the next import will scan the whole file again\n", argv[1]);
+        }
+    }
 
-//    serializeWays.tag_values.ReorderByUsage();
-//    serializeWays.tag_names.ReorderByUsage();
+    // afterwards the usage counts are sorted by usage as well as by id
+    serializeWays.FinishTags();
 
 /*
     {
@@ -490,7 +1222,7 @@ int main(int argc, char** argv) {
         serializeWays.Serialize(s);
     }
     {
-        Serializer d {"tags.dat", Serializer::serialize_mode_t::Reading};
+        Serializer d {"tags.dat", Serializer::serialize_mode_t::MappedReading};
 
         DeSerializeWays ws;
         Pool pool {};
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <unordered_set>
+#include <unordered_map>
+#include <algorithm>
+
+#include "road_graph.cpp"
+#include "route_query.cpp"
+
+using namespace std;
+
+struct ReachedNode
+{
+    uint32_t node;
+    float seconds;
+};
+
+struct IsochroneResult
+{
+    /// in the order they were settled, so by increasing travel time
+    vector<ReachedNode> reached;
+    /// outline of the reached roads counter clockwise, empty if no hull was asked for
+    vector<Coordinates> hull;
+};
+
+// Everything reachable from a node within a time limit.
+// A one to all Dijkstra which stops at the limit instead of sweeping the whole graph.
+// The hull is traced around a grid of cells the reached roads pass through,
+// which follows the roads into the gaps a convex hull would cover.
+struct IsochroneQuery
+{
+    const RoadGraph& graph;
+    /// turns the edge lengths into travel times, unused if the graph is weighted by time
+    double meters_per_second = 50.0 / 3.6;
+
+    IsochroneQuery(const RoadGraph& graph) : graph(graph) {}
+
+    /// max_seconds = INFINITY sweeps the whole graph, hull_cell_meters = 0 skips the hull
+    void Compute(uint32_t source, double max_seconds, IsochroneResult& result,
+                 double hull_cell_meters = 0, QueryWorkspace& ws = ThreadQueryWorkspace()) const;
+
+private:
+    void TraceHull(uint32_t max_distance, double cell_meters, const QueryWorkspace& ws, IsochroneResult& result) const;
+};
+
+void IsochroneQuery::Compute(uint32_t source, double max_seconds, IsochroneResult& result,
+                             double hull_cell_meters, QueryWorkspace& ws) const
+{
+    // weights per second of travel
+    const double weight_per_second = graph.max_speed_kmh ? 10.0 : meters_per_second * 10.0;
+    const double limit = max_seconds * weight_per_second;
+    const uint32_t max_distance = (limit >= (double)INFINITE_DISTANCE) ? INFINITE_DISTANCE - 1 : (uint32_t)limit;
+
+    result.reached.clear();
+    result.hull.clear();
+
+    ws.Reset(graph.NodeCount());
+    ws.Set(source, 0, source);
+    ws.heap.Push(0, source);
+
+    while (!ws.heap.Empty())
+    {
+        const auto top = ws.heap.Pop();
+        const uint32_t u = top.node;
+        if (top.key != ws.distance[u])
+            continue;
+        // everything left in the heap is even further away
+        if (top.key > max_distance)
+            break;
+
+        result.reached.push_back({u, (float)(top.key / weight_per_second)});
+
+        for (uint32_t e = graph.first_out[u]; e < graph.first_out[u + 1]; e++)
+        {
+            const uint32_t v = graph.targets[e];
+            const uint32_t dist_v = top.key + graph.weights[e];
+            if (dist_v < ws.Distance(v))
+            {
+                ws.Set(v, dist_v, u);
+                ws.heap.Push(dist_v, v);
+            }
+        }
+    }
+
+    if (hull_cell_meters > 0 && !result.reached.empty())
+        TraceHull(max_distance, hull_cell_meters, ws, result);
+}
+
+void IsochroneQuery::TraceHull(uint32_t max_distance, double cell_meters,
+                               const QueryWorkspace& ws, IsochroneResult& result) const
+{
+    // grid on a plane around the source
+    const Coordinates origin = graph.coords[result.reached[0].node];
+    const double meters_per_unit = 6371008.8 * (M_PI / 180.0) * 1e-7;
+    const double x_scale = meters_per_unit * cos(origin.lat_e7 * (M_PI / 180.0) * 1e-7) / cell_meters;
+    const double y_scale = meters_per_unit / cell_meters;
+
+    auto ToCell = [&] (double lon_e7, double lat_e7) {
+        return make_pair((int32_t)floor((lon_e7 - origin.lon_e7) * x_scale),
+                         (int32_t)floor((lat_e7 - origin.lat_e7) * y_scale));
+    };
+    auto Key = [] (int32_t x, int32_t y) {
+        return ((uint64_t)(uint32_t)x << 32) | (uint32_t)y;
+    };
+
+    // mark the cells along every reached edge, the last one only as far as the limit
+    unordered_set<uint64_t> cells;
+    auto Occupied = [&] (int32_t x, int32_t y) {
+        return cells.count(Key(x, y)) != 0;
+    };
+    for (const auto& r : result.reached)
+    {
+        const uint32_t u = r.node;
+        const auto a = graph.coords[u];
+        const auto cell_a = ToCell(a.lon_e7, a.lat_e7);
+        cells.insert(Key(cell_a.first, cell_a.second));
+
+        for (uint32_t e = graph.first_out[u]; e < graph.first_out[u + 1]; e++)
+        {
+            const auto b = graph.coords[graph.targets[e]];
+            const double reach = min(1.0, (double)(max_distance - ws.distance[u]) / graph.weights[e]);
+
+            const auto cell_b = ToCell(a.lon_e7 + reach * ((double)b.lon_e7 - a.lon_e7),
+                                       a.lat_e7 + reach * ((double)b.lat_e7 - a.lat_e7));
+            const int32_t steps = 2 * max(abs(cell_b.first - cell_a.first), abs(cell_b.second - cell_a.second));
+            for (int32_t s = 1; s <= steps; s++)
+            {
+                const double t = reach * s / steps;
+                const auto c = ToCell(a.lon_e7 + t * ((double)b.lon_e7 - a.lon_e7),
+                                      a.lat_e7 + t * ((double)b.lat_e7 - a.lat_e7));
+                cells.insert(Key(c.first, c.second));
+            }
+        }
+    }
+
+    // boundary edges between occupied and free cells, directed so the occupied cell is on the left
+    unordered_multimap<uint64_t, pair<int32_t, int32_t> > boundary;
+    pair<int32_t, int32_t> start = {INT32_MAX, INT32_MAX};
+    for (const auto& c : cells)
+    {
+        const int32_t x = (int32_t)(c >> 32), y = (int32_t)(uint32_t)c;
+        if (!Occupied(x, y - 1))
+        {
+            boundary.insert({Key(x, y), {x + 1, y}});
+            // the lowest, then leftmost bottom edge is always on the outer boundary
+            if (make_pair(y, x) < make_pair(start.second, start.first))
+                start = {x, y};
+        }
+        if (!Occupied(x + 1, y))
+            boundary.insert({Key(x + 1, y), {x + 1, y + 1}});
+        if (!Occupied(x, y + 1))
+            boundary.insert({Key(x + 1, y + 1), {x, y + 1}});
+        if (!Occupied(x - 1, y))
+            boundary.insert({Key(x, y + 1), {x, y}});
+    }
+
+    // walk the outer boundary, where two cells only touch at a corner take the right turn so both stay inside
+    vector<pair<int32_t, int32_t> > ring;
+    // the only edge into the start comes down the left side of its cell
+    pair<int32_t, int32_t> at = start, from = {start.first, start.second + 1};
+    do
+    {
+        const int32_t dx_in = at.first - from.first, dy_in = at.second - from.second;
+        auto range = boundary.equal_range(Key(at.first, at.second));
+        auto next = range.first;
+        for (auto it = range.first; it != range.second; it++)
+        {
+            const int32_t dx = it->second.first - at.first, dy = it->second.second - at.second;
+            // negative cross product is a right turn
+            if (dx_in * dy - dy_in * dx < 0)
+                next = it;
+        }
+        assert(next != range.second);
+
+        const auto to = next->second;
+        boundary.erase(next);
+        // only corners are kept
+        const int32_t dx_out = to.first - at.first, dy_out = to.second - at.second;
+        if (dx_out != dx_in || dy_out != dy_in)
+            ring.push_back(at);
+        from = at;
+        at = to;
+    } while (at != start);
+
+    result.hull.reserve(ring.size());
+    for (const auto& p : ring)
+    {
+        result.hull.push_back({(int32_t)lround(origin.lon_e7 + p.first / x_scale),
+                               (int32_t)lround(origin.lat_e7 + p.second / y_scale)});
+    }
+}
@@ -4,6 +4,7 @@
 #include <unordered_map>
 #include "ways.h"
 #include "deserialize.cpp"
+#include "distance_matrix.cpp"
 #include <thread>
 #include "3rd_party/linenoise/linenoise.h"
 #include "3rd_party/linenoise/linenoise.c"
@@ -32,6 +33,8 @@ static const string_view commands[] {
   , ":dump_names"
   , ":dump_values"
   , ":pages"
+  , ":snap"
+  , ":matrix"
 };
 
 // lets do a crappy trie
@@ -147,6 +150,76 @@ void BuildStreetNameTrie(Pool* pool)
     }
 }
 
+// the graph node on the way of a matched segment which is nearest along the way,
+// INVALID_GRAPH_NODE if none of the refs of the way is in the car graph
+uint32_t SnapOnSegment(const DeSerializeWays& ws, const SegmentMatch& match)
+{
+    const auto& segment = ws.segment_index.segments[match.segment];
+    const auto& refs = ws.ways[segment.way].refs;
+    const bool a_first = match.fraction < 0.5;
+
+    // the ends of a car way are always graph nodes, so this stops at the latest there
+    for (uint32_t step = 0; step < refs.size(); step++)
+    {
+        const int64_t before = (int64_t)segment.index - step;
+        const int64_t after = (int64_t)segment.index + 1 + step;
+        const int64_t candidates[2] = {a_first ? before : after, a_first ? after : before};
+        for (const auto c : candidates)
+        {
+            if (c < 0 || c >= (int64_t)refs.size())
+                continue;
+            const auto node = ws.graphs[PROFILE_CAR].FindNode(refs[c]);
+            if (node != INVALID_GRAPH_NODE)
+                return node;
+        }
+    }
+    return INVALID_GRAPH_NODE;
+}
+
+// the graph node on the closest way the car graph reaches, footways and cycleways
+// are indexed as well, so further matches are walked until one of them snaps
+uint32_t SnapToGraphNode(const DeSerializeWays& ws, Coordinates p)
+{
+    static const uint32_t MAX_MATCHES = 256;
+
+    vector<SegmentMatch> matches;
+    uint32_t n_tried = 0;
+    for (uint32_t k = 4; k <= MAX_MATCHES; k *= 4)
+    {
+        ws.segment_index.Nearest(p, k, matches);
+        for (; n_tried < matches.size(); n_tried++)
+        {
+            const auto node = SnapOnSegment(ws, matches[n_tried]);
+            if (node != INVALID_GRAPH_NODE)
+                return node;
+        }
+        if (matches.size() < k)
+            break;
+    }
+    return INVALID_GRAPH_NODE;
+}
+
+// "<lat> <lon>; <lat> <lon>; ..." into graph nodes, false if a point does not parse or snap
+bool ParseSnappedPoints(const DeSerializeWays& ws, const char* text, vector<uint32_t>& nodes)
+{
+    while (*text)
+    {
+        double lat, lon;
+        int n_read = 0;
+        if (sscanf(text, " %lf %lf %n", &lat, &lon, &n_read) != 2)
+            return false;
+        text += n_read;
+        if (*text == ';')
+            text++;
+
+        const auto node = SnapToGraphNode(ws, {(int32_t)lround(lon * 1e7), (int32_t)lround(lat * 1e7)});
+        if (node == INVALID_GRAPH_NODE)
+            return false;
+        nodes.push_back(node);
+    }
+    return true;
+}
+
 MAIN
 {
     if (argc != 2)
@@ -155,12 +228,15 @@ MAIN
         return 1;
     }
 
-    Serializer dser (argv[1], Serializer::serialize_mode_t::Reading);
+    Serializer dser (argv[1], Serializer::serialize_mode_t::MappedReading);
 
     DeSerializeWays ws = {};
     Pool pool = {};
 
-    ws.DeSerialize(dser, &pool);
+    // the other sections are only read once a command needs them
+    ws.DeSerialize(dser, &pool, SECTION_BIT(SECTION_TAG_NAMES)
+                              | SECTION_BIT(SECTION_TAG_VALUES)
+                              | SECTION_BIT(SECTION_STREET_NAMES));
 
     const uint32_t n_street_names =
         ws.street_name_indicies.size();
@@ -261,6 +337,80 @@ MAIN
                         pool.n_allocated_extra_pages, pool.allocatedRecordPages);
                 })
 
+                // :snap <lat> <lon> prints the closest road segments
+                CMD(snap, {
+                    double lat, lon;
+                    if (!arg || sscanf(arg, "%lf %lf", &lat, &lon) != 2)
+                    {
+                        printf("usage: :snap <lat> <lon>\n");
+                        continue;
+                    }
+                    const Coordinates p = {(int32_t)lround(lon * 1e7), (int32_t)lround(lat * 1e7)};
+
+                    ws.DeSerialize(dser, &pool, SECTION_BIT(SECTION_WAYS) | SECTION_BIT(SECTION_SEGMENT_INDEX));
+
+                    vector<SegmentMatch> matches;
+                    clock_t snap_begin = clock();
+                    ws.segment_index.Nearest(p, 3, matches);
+                    clock_t snap_end = clock();
+
+                    for (const auto& m : matches)
+                    {
+                        const auto& segment = ws.segment_index.segments[m.segment];
+                        printf("way %lu segment %u at %f meters, snapped to %f %f\n",
+                            ws.ways[segment.way].osmid, segment.index, m.distance,
+                            m.projected.lat_e7 * 1e-7, m.projected.lon_e7 * 1e-7);
+                    }
+                    printf("snapping took %f milliseconds\n",
+                        ((snap_end - snap_begin) / (double)CLOCKS_PER_SEC) * 1000.0f);
+                })
+
+                // :matrix <sources> [| <targets>], both lists of "<lat> <lon>" separated by ';'
+                CMD(matrix, {
+                    ws.DeSerialize(dser, &pool, SECTION_BIT(SECTION_WAYS) | SECTION_BIT(SECTION_SEGMENT_INDEX)
+                                              | SECTION_BIT(SECTION_ROAD_GRAPH) | SECTION_BIT(SECTION_HIERARCHY));
+
+                    vector<uint32_t> sources, targets;
+                    bool ok = (arg != nullptr);
+                    if (ok)
+                    {
+                        vector<char> args(arg, arg + arg_len);
+                        args.push_back('\0');
+                        char* bar = strchr(args.data(), '|');
+                        if (bar)
+                            *bar = '\0';
+                        ok = ParseSnappedPoints(ws, args.data(), sources);
+                        if (ok && bar)
+                            ok = ParseSnappedPoints(ws, bar + 1, targets);
+                        else
+                            targets = sources;
+                    }
+                    if (!ok || sources.empty() || targets.empty() || !ws.hierarchy.NodeCount())
+                    {
+                        printf("usage: :matrix <lat> <lon>; <lat> <lon>; ... [| <lat> <lon>; ...]\n");
+                        continue;
+                    }
+
+                    clock_t matrix_begin = clock();
+                    const auto matrix = ManyToMany(ws.hierarchy).Compute(sources, targets);
+                    clock_t matrix_end = clock();
+
+                    for (uint32_t i = 0; i < matrix.n_sources; i++)
+                    {
+                        for (uint32_t j = 0; j < matrix.n_targets; j++)
+                        {
+                            if (matrix.at(i, j) == INFINITE_DISTANCE)
+                                printf("%10s", "-");
+                            else
+                                printf("%10.1f", matrix.at(i, j) / 10.0);
+                        }
+                        printf("\n");
+                    }
+                    // the car graph is weighted by travel time in deciseconds
+                    printf("%ux%u matrix in seconds took %f milliseconds\n", matrix.n_sources, matrix.n_targets,
+                        ((matrix_end - matrix_begin) / (double)CLOCKS_PER_SEC) * 1000.0f);
+                })
+
                 else {
                     printf("Command unknown\n");
                 }
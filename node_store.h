@@ -0,0 +1,244 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include "ways.h"
+
+// fixed-point coordinates in units of 1e-7 degrees, like Node
+struct Coordinates
+{
+    int32_t lon_e7;
+    int32_t lat_e7;
+};
+
+// Dense replacement for unordered_map<uint64_t, Node>.
+// Nodes are kept sorted by osmid in parallel arrays, lookups go through a
+// sparse index of the first id of every block of NODE_BLOCK_SIZE nodes.
+// For planet sized inputs a flat array indexed by the osmid itself can be
+// built on top, its untouched pages are never backed by memory.
+struct NodeStore
+{
+    static const uint32_t NODE_BLOCK_SIZE = 64;
+
+    std::vector<uint64_t> ids;
+    std::vector<Coordinates> coords;
+    /// only filled if keep_tags is set
+    std::vector<short_tags_t> tags;
+    /// only filled once ResetUses() was called
+    std::vector<int32_t> uses;
+
+    bool keep_tags = false;
+
+    NodeStore() = default;
+    NodeStore(const NodeStore&) = delete;
+    NodeStore& operator= (const NodeStore&) = delete;
+
+    ~NodeStore()
+    {
+        DropFlatIndex();
+    }
+
+    uint32_t size() const
+    {
+        return (uint32_t)ids.size();
+    }
+
+    void Add(uint64_t osmid, int32_t lon_e7, int32_t lat_e7, short_tags_t node_tags = {})
+    {
+        if (!ids.empty() && osmid <= ids.back())
+            sorted = false;
+        sealed = false;
+        DropFlatIndex();
+
+        ids.push_back(osmid);
+        coords.push_back({lon_e7, lat_e7});
+        if (keep_tags)
+            tags.push_back(node_tags);
+    }
+
+    /// Sorts the nodes by id if they did not arrive in order
+    /// and builds the block index. Has to be called before Lookup.
+    void Seal(void)
+    {
+        if (sealed)
+            return;
+
+        if (!sorted)
+        {
+            std::vector<uint32_t> order(ids.size());
+            for (uint32_t i = 0; i < order.size(); i++)
+                order[i] = i;
+            std::sort(order.begin(), order.end(),
+                [this] (uint32_t a, uint32_t b) { return ids[a] < ids[b]; });
+
+            Permute(ids, order);
+            Permute(coords, order);
+            if (keep_tags)
+                Permute(tags, order);
+            if (!uses.empty())
+                Permute(uses, order);
+            sorted = true;
+        }
+
+        block_first_ids.clear();
+        for (uint32_t i = 0; i < ids.size(); i += NODE_BLOCK_SIZE)
+            block_first_ids.push_back(ids[i]);
+
+        sealed = true;
+    }
+
+    /// Returns 0 if not found or the index of the node + 1 if found
+    uint32_t Lookup(uint64_t osmid) const
+    {
+        assert(sealed);
+
+        if (flat_index)
+            return (osmid < flat_index_size) ? flat_index[osmid] : 0;
+
+        // find the last block starting at or before osmid
+        auto block = std::upper_bound(block_first_ids.begin(), block_first_ids.end(), osmid);
+        if (block == block_first_ids.begin())
+            return 0;
+        const uint32_t begin = (uint32_t)((block - block_first_ids.begin()) - 1) * NODE_BLOCK_SIZE;
+        const uint32_t end = std::min(begin + NODE_BLOCK_SIZE, size());
+
+        auto it = std::lower_bound(ids.begin() + begin, ids.begin() + end, osmid);
+        if (it == ids.begin() + end || *it != osmid)
+            return 0;
+
+        return (uint32_t)(it - ids.begin()) + 1;
+    }
+
+    /// Builds an array indexed directly by osmid.
+    /// It is reserved for the highest id but only the pages which contain ids are touched.
+    bool BuildFlatIndex(void)
+    {
+        Seal();
+        if (ids.empty())
+            return false;
+
+        const uint64_t n_entries = ids.back() + 1;
+        void* mem = mmap(NULL, n_entries * sizeof(uint32_t),
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+            -1, 0);
+        if (mem == MAP_FAILED)
+        {
+            perror("NodeStore::BuildFlatIndex");
+            return false;
+        }
+
+        flat_index = (uint32_t*)mem;
+        flat_index_size = n_entries;
+        for (uint32_t i = 0; i < size(); i++)
+            flat_index[ids[i]] = i + 1;
+
+        return true;
+    }
+
+    void ResetUses(void)
+    {
+        uses.assign(ids.size(), 0);
+    }
+
+    Node GetNode(uint32_t index) const
+    {
+        return Node(ids[index], coords[index].lon_e7, coords[index].lat_e7,
+                    keep_tags ? tags[index] : short_tags_t {});
+    }
+
+private:
+    bool sorted = true;
+    bool sealed = false;
+
+    std::vector<uint64_t> block_first_ids;
+
+    uint32_t* flat_index = nullptr;
+    uint64_t flat_index_size = 0;
+
+    void DropFlatIndex(void)
+    {
+        if (flat_index)
+            munmap(flat_index, flat_index_size * sizeof(uint32_t));
+        flat_index = nullptr;
+        flat_index_size = 0;
+    }
+
+    template <typename T>
+    static void Permute(std::vector<T>& v, const std::vector<uint32_t>& order)
+    {
+        std::vector<T> result;
+        result.reserve(v.size());
+        for (auto i : order)
+            result.push_back(v[i]);
+        v.swap(result);
+    }
+};
+
+// Set of node ids, a bitset split into pages which are only allocated
+// once an id falls into them, so it stays small for sparse planet ids.
+struct NodeIdSet
+{
+    static const uint32_t PAGE_BITS = 1 << 16;
+    static const uint32_t WORDS_PER_PAGE = PAGE_BITS / 64;
+
+    std::vector<std::vector<uint64_t> > pages;
+    uint64_t count = 0;
+
+    void Insert(uint64_t osmid)
+    {
+        const uint64_t page = osmid / PAGE_BITS;
+        if (page >= pages.size())
+            pages.resize(page + 1);
+        if (pages[page].empty())
+            pages[page].resize(WORDS_PER_PAGE, 0);
+
+        const uint32_t bit = osmid % PAGE_BITS;
+        uint64_t& word = pages[page][bit / 64];
+        const uint64_t mask = (uint64_t)1 << (bit % 64);
+        count += !(word & mask);
+        word |= mask;
+    }
+
+    bool Contains(uint64_t osmid) const
+    {
+        const uint64_t page = osmid / PAGE_BITS;
+        if (page >= pages.size() || pages[page].empty())
+            return false;
+
+        const uint32_t bit = osmid % PAGE_BITS;
+        return (pages[page][bit / 64] >> (bit % 64)) & 1;
+    }
+
+    /// true if any id in [first, last] is in the set
+    bool AnyInRange(uint64_t first, uint64_t last) const
+    {
+        for (uint64_t id = first; id <= last; )
+        {
+            const uint64_t page = id / PAGE_BITS;
+            if (page >= pages.size())
+                return false;
+
+            if (pages[page].empty())
+            {
+                id = (page + 1) * PAGE_BITS;
+                continue;
+            }
+
+            const uint32_t bit = id % PAGE_BITS;
+            uint64_t word = pages[page][bit / 64] >> (bit % 64);
+            const uint64_t bits_in_word = 64 - (bit % 64);
+            if (last - id < bits_in_word - 1)
+                word &= ((uint64_t)2 << (last - id)) - 1;
+            if (word)
+                return true;
+
+            id += bits_in_word;
+        }
+        return false;
+    }
+};
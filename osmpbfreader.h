@@ -33,6 +33,19 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <string>
 #include <fstream>
 #include <iostream>
+#include <vector>
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <type_traits>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // this describes the low-level blob storage
 #include <osmpbf/fileformat.pb.h>
@@ -45,12 +58,148 @@ const int max_uncompressed_blob_size = 32 * 1024 * 1024; // 32 MB
 // resolution for longitude/latitude used for conversion
 // between representation as double and as int
 const int lonlat_resolution = 1000 * 1000 * 1000; 
+// resolution of the fixed-point LonLat coordinates (7 decimals, as in the OSM xml)
+const int lonlat_fixed_resolution = 10 * 1000 * 1000;
 
 namespace CanalTP {
 
 // Represents the key/values of an object
 typedef std::map<std::string, std::string> Tags;
 
+// Coordinates as int32 fixed-point values in units of 1e-7 degrees.
+// A visitor receives these instead of two doubles if it has a node_callback taking a LonLat.
+struct LonLat {
+    int32_t lon;
+    int32_t lat;
+
+    double lon_degrees() const { return lon / (double)lonlat_fixed_resolution; }
+    double lat_degrees() const { return lat / (double)lonlat_fixed_resolution; }
+};
+
+// converts nanodegrees into 1e-7 degrees, rounding to the nearest value
+inline int32_t nanodegrees_to_fixed(int64_t nano){
+    const int64_t factor = lonlat_resolution / lonlat_fixed_resolution;
+    return (int32_t)((nano + (nano < 0 ? -factor / 2 : factor / 2)) / factor);
+}
+
+// Key/values of an object as a view into the stringtable of its block.
+// Nothing is copied, the view (and the strings it returns) are only valid
+// during the callback it was passed to.
+// A visitor receives this instead of Tags if it has a callback overload taking a TagsView.
+struct TagsView {
+    const OSMPBF::StringTable* stringtable = nullptr;
+    const uint32_t* keys = nullptr;
+    const uint32_t* vals = nullptr;
+    // the ids the Interner of the visitor gave the strings of the block, by their index
+    // in the stringtable. nullptr unless the visitor has an Interner, see intern_tags
+    const uint32_t* string_ids = nullptr;
+    int stride = 1; // 2 for the interleaved keys_vals of dense nodes
+    int n = 0;
+
+    struct KeyValue {
+        const std::string & key;
+        const std::string & value;
+    };
+
+    struct iterator {
+        const TagsView* view;
+        int i;
+        KeyValue operator*() const { return {view->key(i), view->value(i)}; }
+        iterator & operator++() { ++i; return *this; }
+        bool operator!=(const iterator & o) const { return i != o.i; }
+    };
+
+    int size() const { return n; }
+    iterator begin() const { return {this, 0}; }
+    iterator end() const { return {this, n}; }
+
+    // raw indices into the stringtable of the block
+    uint32_t key_index(int i) const { return keys[i * stride]; }
+    uint32_t value_index(int i) const { return vals[i * stride]; }
+
+    const std::string & key(int i) const { return stringtable->s(key_index(i)); }
+    const std::string & value(int i) const { return stringtable->s(value_index(i)); }
+
+    // interned ids, only if string_ids is set
+    uint32_t key_id(int i) const { return string_ids[key_index(i)]; }
+    uint32_t value_id(int i) const { return string_ids[value_index(i)]; }
+
+    // Returns the position of key or -1 if the object has no such tag
+    int find_index(const char* key) const {
+        const size_t len = strlen(key);
+        for(int i = 0; i < n; ++i) {
+            const std::string & k = this->key(i);
+            if(k.size() == len && memcmp(k.data(), key, len) == 0)
+                return i;
+        }
+        return -1;
+    }
+
+    // Returns the value of key or nullptr if the object has no such tag
+    const std::string* find(const char* key) const {
+        const int i = find_index(key);
+        return i < 0 ? nullptr : &this->value(i);
+    }
+
+    Tags to_map() const {
+        Tags result;
+        for(int i = 0; i < n; ++i)
+            result[key(i)] = value(i);
+        return result;
+    }
+};
+
+template<typename T>
+TagsView tags_view(const T& object, const OSMPBF::PrimitiveBlock &primblock, const uint32_t* string_ids = nullptr){
+    TagsView result;
+    result.stringtable = &primblock.stringtable();
+    result.string_ids = string_ids;
+    result.keys = (const uint32_t*)object.keys().data();
+    result.vals = (const uint32_t*)object.vals().data();
+    result.n = object.keys_size();
+    return result;
+}
+
+// The callbacks are dispatched through these so a visitor can take either Tags or a TagsView
+// (and for nodes either a LonLat or two doubles).
+// Overloads with a higher rank are preferred if the visitor has a matching callback.
+template<int N> struct callback_rank : callback_rank<N - 1> {};
+template<> struct callback_rank<0> {};
+
+template<typename Visitor>
+auto call_node_callback(Visitor & visitor, uint64_t id, int64_t lon, int64_t lat, const TagsView & tags, callback_rank<3>)
+    -> decltype(visitor.node_callback(id, LonLat(), tags), void()) {
+    visitor.node_callback(id, LonLat {nanodegrees_to_fixed(lon), nanodegrees_to_fixed(lat)}, tags);
+}
+
+template<typename Visitor>
+auto call_node_callback(Visitor & visitor, uint64_t id, int64_t lon, int64_t lat, const TagsView & tags, callback_rank<2>)
+    -> decltype(visitor.node_callback(id, LonLat(), tags.to_map()), void()) {
+    visitor.node_callback(id, LonLat {nanodegrees_to_fixed(lon), nanodegrees_to_fixed(lat)}, tags.to_map());
+}
+
+template<typename Visitor>
+auto call_node_callback(Visitor & visitor, uint64_t id, int64_t lon, int64_t lat, const TagsView & tags, callback_rank<1>)
+    -> decltype(visitor.node_callback(id, 0.0, 0.0, tags), void()) {
+    visitor.node_callback(id, 0.000000001 * lon, 0.000000001 * lat, tags);
+}
+
+template<typename Visitor>
+void call_node_callback(Visitor & visitor, uint64_t id, int64_t lon, int64_t lat, const TagsView & tags, callback_rank<0>) {
+    visitor.node_callback(id, 0.000000001 * lon, 0.000000001 * lat, tags.to_map());
+}
+
+template<typename Visitor>
+auto call_way_callback(Visitor & visitor, uint64_t id, const TagsView & tags, const std::vector<uint64_t> & refs, callback_rank<1>)
+    -> decltype(visitor.way_callback(id, tags, refs), void()) {
+    visitor.way_callback(id, tags, refs);
+}
+
+template<typename Visitor>
+void call_way_callback(Visitor & visitor, uint64_t id, const TagsView & tags, const std::vector<uint64_t> & refs, callback_rank<0>) {
+    visitor.way_callback(id, tags.to_map(), refs);
+}
+
 // References of a relation
 struct Reference {
     OSMPBF::Relation::MemberType member_type; // type de la relation
@@ -65,10 +214,25 @@ struct Reference {
 
 typedef std::vector<Reference> References;
 
+template<typename Visitor>
+auto call_relation_callback(Visitor & visitor, uint64_t id, const TagsView & tags, const References & refs, callback_rank<1>)
+    -> decltype(visitor.relation_callback(id, tags, refs), void()) {
+    visitor.relation_callback(id, tags, refs);
+}
+
+template<typename Visitor>
+void call_relation_callback(Visitor & visitor, uint64_t id, const TagsView & tags, const References & refs, callback_rank<0>) {
+    visitor.relation_callback(id, tags.to_map(), refs);
+}
+
 // Main function
 template<typename Visitor>
 void read_osm_pbf(const std::string & filename, Visitor & visitor);
 
+// Multi-threaded variant of the main function
+template<typename Visitor>
+void read_osm_pbf_parallel(const std::string & filename, Visitor & visitor, unsigned n_workers = 0, bool ordered = true);
+
 struct warn {
     warn() {std::cout << "\033[33m[WARN] ";}
     template<typename T>warn & operator<<(const T & t){ std::cout << t; return *this;}
@@ -102,48 +266,316 @@ Tags get_tags(const T& object, const OSMPBF::PrimitiveBlock &primblock){
     return result;
 }
 
-template<typename Visitor>
-struct Parser {
+// What a blob contains, used to skip blobs a pass is not interested in
+enum BlobContent : uint8_t {
+    BlobNodes     = 1 << 0,
+    BlobWays      = 1 << 1,
+    BlobRelations = 1 << 2,
+};
 
-    void parse(){
-        while(!this->file.eof() && !finished) {
-            OSMPBF::BlobHeader header = this->read_header();
-            if(!this->finished){
-                int32_t sz = this->read_blob(header);
-                if(header.type() == "OSMData") {
-                    this->parse_primitiveblock(sz);
-                }
-                else if(header.type() == "OSMHeader"){
-                }
-                else {
-                    warn() << "  unknown blob type: " << header.type();
-                }
+struct BlobIndexEntry {
+    uint64_t offset;  // position of the blob-header size in the file
+    uint64_t min_id;  // smallest id of any object in the blob
+    uint64_t max_id;  // largest id of any object in the blob
+    uint8_t content;  // BlobContent bits, 0 for non-data blobs
+};
+
+// What tells two versions of a file apart. The size alone does not:
+// extracts of a region often keep their size from one day to the next.
+// The start of the file holds the OSMHeader blob with its replication
+// timestamp, so head_hash changes whenever the extract is regenerated.
+struct FileIdentity {
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+    uint64_t head_hash = 0;
+
+    bool operator==(const FileIdentity & o) const {
+        return size == o.size && mtime_ns == o.mtime_ns && head_hash == o.head_hash;
+    }
+};
+
+// Number of bytes at the start of the file covered by FileIdentity::head_hash
+const size_t identity_head_size = 64 * 1024;
+
+inline bool identify_file(int fd, FileIdentity & id){
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+        return false;
+    id.size = st.st_size;
+    id.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+    // FNV-1a
+    std::vector<unsigned char> head(std::min<uint64_t>(id.size, identity_head_size));
+    if(pread(fd, head.data(), head.size(), 0) != (ssize_t)head.size())
+        return false;
+    id.head_hash = 14695981039346656037ULL;
+    for(unsigned char c : head)
+        id.head_hash = (id.head_hash ^ c) * 1099511628211ULL;
+    return true;
+}
+
+// Side index of the blobs of a file so later passes can jump straight
+// to the blobs they need instead of inflating every one of them.
+// It is stored next to the file as <file>.blobidx
+struct BlobIndex {
+    FileIdentity file;
+    std::vector<BlobIndexEntry> blobs;
+
+    // Returns the blobs which contain any of the requested BlobContent bits
+    std::vector<BlobIndexEntry> select(uint8_t content) const {
+        std::vector<BlobIndexEntry> result;
+        for(const auto & b : blobs) {
+            if(b.content & content)
+                result.push_back(b);
+        }
+        return result;
+    }
+
+    // Loads the side index of filename; fails if it is missing or
+    // was written for a different version of the file
+    bool load(const std::string & filename) {
+        FileIdentity current;
+        int fd = open(filename.c_str(), O_RDONLY);
+        if(fd < 0)
+            return false;
+        const bool identified = identify_file(fd, current);
+        close(fd);
+        if(!identified)
+            return false;
+
+        std::ifstream in((filename + ".blobidx").c_str(), std::ios::binary);
+        char magic[4];
+        FileIdentity stored;
+        uint64_t n_blobs;
+        if(!in.read(magic, 4) || memcmp(magic, "OSMI", 4) != 0)
+            return false;
+        if(!in.read((char*)&stored.size, sizeof(stored.size))
+        || !in.read((char*)&stored.mtime_ns, sizeof(stored.mtime_ns))
+        || !in.read((char*)&stored.head_hash, sizeof(stored.head_hash)))
+            return false;
+        if(!(stored == current))
+            return false;
+        if(!in.read((char*)&n_blobs, sizeof(n_blobs)))
+            return false;
+        blobs.resize(n_blobs);
+        if(!in.read((char*)blobs.data(), n_blobs * sizeof(BlobIndexEntry))) {
+            blobs.clear();
+            return false;
+        }
+        file = stored;
+        return true;
+    }
+
+    bool save(const std::string & filename) const {
+        std::ofstream out((filename + ".blobidx").c_str(), std::ios::binary);
+        const uint64_t n_blobs = blobs.size();
+        out.write("OSMI", 4);
+        out.write((const char*)&file.size, sizeof(file.size));
+        out.write((const char*)&file.mtime_ns, sizeof(file.mtime_ns));
+        out.write((const char*)&file.head_hash, sizeof(file.head_hash));
+        out.write((const char*)&n_blobs, sizeof(n_blobs));
+        out.write((const char*)blobs.data(), n_blobs * sizeof(BlobIndexEntry));
+        return out.good();
+    }
+};
+
+// Fills in the content and id range of a decoded block
+inline void describe_block(const OSMPBF::PrimitiveBlock & primblock, BlobIndexEntry & entry){
+    entry.content = 0;
+    entry.min_id = UINT64_MAX;
+    entry.max_id = 0;
+
+    auto add_id = [&entry](uint64_t id) {
+        if(id < entry.min_id) entry.min_id = id;
+        if(id > entry.max_id) entry.max_id = id;
+    };
+
+    for(int i = 0, l = primblock.primitivegroup_size(); i < l; i++) {
+        const OSMPBF::PrimitiveGroup& pg = primblock.primitivegroup(i);
+
+        for(int i = 0; i < pg.nodes_size(); ++i)
+            add_id(pg.nodes(i).id());
+        if(pg.nodes_size())
+            entry.content |= BlobNodes;
+
+        if(pg.has_dense()) {
+            const OSMPBF::DenseNodes& dn = pg.dense();
+            uint64_t id = 0;
+            for(int i = 0; i < dn.id_size(); ++i) {
+                id += dn.id(i);
+                add_id(id);
             }
+            if(dn.id_size())
+                entry.content |= BlobNodes;
         }
+
+        for(int i = 0; i < pg.ways_size(); ++i)
+            add_id(pg.ways(i).id());
+        if(pg.ways_size())
+            entry.content |= BlobWays;
+
+        for(int i = 0; i < pg.relations_size(); ++i)
+            add_id(pg.relations(i).id());
+        if(pg.relations_size())
+            entry.content |= BlobRelations;
     }
 
-    Parser(const std::string & filename, Visitor & visitor)
-        : visitor(visitor), file(filename.c_str(), std::ios::binary ), finished(false)
+    if(!entry.content)
+        entry.min_id = 0;
+}
+
+// Slices the file into its (BlobHeader, Blob) pairs without inflating them.
+// The file is memory-mapped so headers and blobs are parsed in place;
+// if the file cannot be mapped we fall back to reading it into a buffer.
+// When given a selection only the listed blobs are returned.
+struct BlobSource {
+    BlobSource(const std::string & filename, const std::vector<BlobIndexEntry>* selection = nullptr)
+        : buffer(nullptr), map(nullptr), map_size(0), map_pos(0), last_offset(0),
+          selection(selection), selection_pos(0), finished(false)
     {
-        if(!file.is_open())
+        int fd = open(filename.c_str(), O_RDONLY);
+        if(fd < 0)
             fatal() << "Unable to open the file " << filename;
-        buffer = new char[max_uncompressed_blob_size];
-        unpack_buffer = new char[max_uncompressed_blob_size];
+
+        if(!identify_file(fd, file_id))
+            fatal() << "Unable to stat the file " << filename;
+        if(file_id.size > 0) {
+            void* p = mmap(nullptr, file_id.size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p != MAP_FAILED) {
+                map = (const char*)p;
+                map_size = file_id.size;
+                madvise(p, map_size, MADV_SEQUENTIAL);
+            }
+        }
+        close(fd);
+
+        if(!map) {
+            file.open(filename.c_str(), std::ios::binary);
+            if(!file.is_open())
+                fatal() << "Unable to open the file " << filename;
+            buffer = new char[max_uncompressed_blob_size];
+        }
         info() << "Reading the file " << filename;
     }
 
-    ~Parser(){
+    ~BlobSource(){
+        if(map)
+            munmap((void*)map, map_size);
         delete[] buffer;
-        delete[] unpack_buffer;
+    }
+
+    // true if the data returned by next() stays valid as long as the source lives
+    bool mapped() const {
+        return map != nullptr;
+    }
+
+    uint64_t file_size() const {
+        return file_id.size;
+    }
+
+    // size, modification time and head hash of the file, see FileIdentity
+    const FileIdentity & identity() const {
+        return file_id;
+    }
+
+    // file offset of the blob last returned by next()
+    uint64_t offset() const {
+        return last_offset;
+    }
+
+    // Reads the next header and its compressed blob.
+    // Unless the source is mapped data points into an internal buffer
+    // that is only valid until the next call.
+    // Returns false once the end of the file is reached
+    bool next(OSMPBF::BlobHeader & header, const char** data, int32_t* sz){
+        if(this->finished)
+            return false;
+        if(selection) {
+            if(selection_pos == selection->size()) {
+                this->finished = true;
+                return false;
+            }
+            this->seek((*selection)[selection_pos++].offset);
+        }
+        if(map) {
+            last_offset = map_pos;
+            return this->next_mapped(header, data, sz);
+        }
+        if(this->file.eof())
+            return false;
+        last_offset = this->file.tellg();
+        header = this->read_header();
+        if(this->finished)
+            return false;
+
+        // size of the following blob
+        *sz = header.datasize();
+
+        if(*sz > max_uncompressed_blob_size)
+            fatal() << "blob-size is bigger then allowed";
+
+        if(!this->file.read(buffer, *sz))
+            fatal() << "unable to read blob from file";
+        *data = buffer;
+        return true;
     }
 
 private:
-    Visitor & visitor;
     std::ifstream file;
     char* buffer;
-    char* unpack_buffer;
+    const char* map;
+    size_t map_size;
+    size_t map_pos;
+    FileIdentity file_id;
+    uint64_t last_offset;
+    const std::vector<BlobIndexEntry>* selection;
+    size_t selection_pos;
     bool finished;
 
+    void seek(uint64_t offset){
+        if(map) {
+            if(offset > map_size)
+                fatal() << "blob offset " << offset << " is past the end of the file";
+            map_pos = offset;
+        }
+        else {
+            this->file.clear();
+            this->file.seekg(offset);
+        }
+    }
+
+    bool next_mapped(OSMPBF::BlobHeader & header, const char** data, int32_t* sz){
+        int32_t header_sz;
+
+        if(map_size - map_pos < 4) {
+            info() << "We finished reading the file";
+            this->finished = true;
+            return false;
+        }
+        memcpy(&header_sz, map + map_pos, 4);
+        map_pos += 4;
+        header_sz = NTOHL(header_sz);// convert the size from network byte-order to host byte-order
+
+        if(header_sz > max_blob_header_size)
+            fatal() << "blob-header-size is bigger then allowed " << header_sz << " > " << max_blob_header_size;
+        if(header_sz < 0 || map_size - map_pos < (size_t)header_sz)
+            fatal() << "unable to read blob-header from file";
+
+        if(!header.ParseFromArray(map + map_pos, header_sz))
+            fatal() << "unable to parse blob header";
+        map_pos += header_sz;
+
+        *sz = header.datasize();
+        if(*sz > max_uncompressed_blob_size)
+            fatal() << "blob-size is bigger then allowed";
+        if(*sz < 0 || map_size - map_pos < (size_t)*sz)
+            fatal() << "unable to read blob from file";
+
+        *data = map + map_pos;
+        map_pos += *sz;
+        return true;
+    }
+
     OSMPBF::BlobHeader read_header(){
         int32_t sz;
         OSMPBF::BlobHeader result;
@@ -169,136 +601,515 @@ private:
             fatal() << "unable to parse blob header";
         return result;
     }
+};
 
-    int32_t read_blob(const OSMPBF::BlobHeader & header){
-        OSMPBF::Blob blob;
-        // size of the following blob
-        int32_t sz = header.datasize();
+// The fields of a serialized OSMPBF::Blob, pointing into the buffer it was parsed from.
+// Unlike OSMPBF::Blob::ParseFromArray this does not copy the (compressed) payload
+struct BlobView {
+    const char* raw = nullptr;
+    int32_t raw_len = 0;
+    int32_t raw_size = 0;
+    const char* zlib_data = nullptr;
+    int32_t zlib_len = 0;
+    bool has_lzma_data = false;
+};
+
+inline bool read_varint(const unsigned char*& p, const unsigned char* end, uint64_t & value){
+    value = 0;
+    for(int shift = 0; shift < 64 && p < end; shift += 7) {
+        unsigned char b = *p++;
+        value |= uint64_t(b & 0x7f) << shift;
+        if(!(b & 0x80))
+            return true;
+    }
+    return false;
+}
 
+inline bool parse_blob_view(const char* data, int32_t sz, BlobView & blob){
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + sz;
+    while(p < end) {
+        uint64_t key, value;
+        if(!read_varint(p, end, key))
+            return false;
+        const int field = key >> 3;
+        switch(key & 7) {
+        case 0: // varint
+            if(!read_varint(p, end, value))
+                return false;
+            if(field == 2)
+                blob.raw_size = (int32_t)value;
+            break;
+        case 1: // fixed64
+            if(end - p < 8)
+                return false;
+            p += 8;
+            break;
+        case 2: // length delimited
+            if(!read_varint(p, end, value) || value > (uint64_t)(end - p))
+                return false;
+            if(field == 1) {
+                blob.raw = (const char*)p;
+                blob.raw_len = (int32_t)value;
+            }
+            else if(field == 3) {
+                blob.zlib_data = (const char*)p;
+                blob.zlib_len = (int32_t)value;
+            }
+            else if(field == 4) {
+                blob.has_lzma_data = true;
+            }
+            p += value;
+            break;
+        case 5: // fixed32
+            if(end - p < 4)
+                return false;
+            p += 4;
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+// Inflates the serialized Blob in data into unpack_buffer
+// Returns the size of the uncompressed content
+inline int32_t inflate_blob(const char* data, int32_t sz, char* unpack_buffer){
+    BlobView blob;
+    if(!parse_blob_view(data, sz, blob))
+        fatal() << "unable to parse blob";
+
+    // if the blob has uncompressed data
+    if(blob.raw) {
+        // size of the blob-data
+        sz = blob.raw_len;
+
+        // check that raw_size is set correctly
+        if(sz != blob.raw_size)
+            warn() << "  reports wrong raw_size: " << blob.raw_size << " bytes";
         if(sz > max_uncompressed_blob_size)
             fatal() << "blob-size is bigger then allowed";
 
-        if(!this->file.read(buffer, sz))
-            fatal() << "unable to read blob from file";
-        if(!blob.ParseFromArray(this->buffer, sz))
-            fatal() << "unable to parse blob";
+        memcpy(unpack_buffer, blob.raw, sz);
+        return sz;
+    }
+
+
+    if(blob.zlib_data) {
+        if(blob.raw_size > max_uncompressed_blob_size)
+            fatal() << "blob-size is bigger then allowed";
+
+        z_stream z;
+        z.next_in   = (unsigned char*) blob.zlib_data;
+        z.avail_in  = blob.zlib_len;
+        z.next_out  = (unsigned char*) unpack_buffer;
+        z.avail_out = blob.raw_size;
+        z.zalloc    = Z_NULL;
+        z.zfree     = Z_NULL;
+        z.opaque    = Z_NULL;
+
+        if(inflateInit(&z) != Z_OK) {
+            fatal() << "failed to init zlib stream";
+        }
+        if(inflate(&z, Z_FINISH) != Z_STREAM_END) {
+            fatal() << "failed to inflate zlib stream";
+        }
+        if(inflateEnd(&z) != Z_OK) {
+            fatal() << "failed to deinit zlib stream";
+        }
+        return z.total_out;
+    }
+
+    if(blob.has_lzma_data) {
+        fatal() << "lzma-decompression is not supported";
+    }
+    return 0;
+}
+
+// A visitor which declares a nested Interner type gets the tag strings of every block
+// interned before its callbacks see them. The parsers construct one Visitor::Interner(visitor)
+// per decoding thread and call its intern(const std::string&), which has to return an id
+// other than 0 and may run concurrently to the callbacks and to the other Interners.
+// The TagsView of the callbacks then carries the ids in string_ids.
+struct NoInterner {
+    template<typename Visitor>
+    NoInterner(Visitor &) {}
+    uint32_t intern(const std::string &) { return 0; }
+};
+
+template<typename Visitor, typename = void>
+struct interner_of { typedef NoInterner type; };
+
+template<typename Visitor>
+struct interner_of<Visitor, std::void_t<typename Visitor::Interner> > { typedef typename Visitor::Interner type; };
+
+template<typename Visitor>
+constexpr bool has_interner = !std::is_same<typename interner_of<Visitor>::type, NoInterner>::value;
 
-        // if the blob has uncompressed data
-        if(blob.has_raw()) {
-            // size of the blob-data
-            sz = blob.raw().size();
+// Fills ids with the interned ids of the strings which are used as keys or values in the block,
+// by their index in its stringtable. The others, like roles and user names, are left at 0
+template<typename Interner>
+void intern_tags(const OSMPBF::PrimitiveBlock & primblock, Interner & interner, std::vector<uint32_t> & ids) {
+    const OSMPBF::StringTable & stringtable = primblock.stringtable();
+    ids.assign(stringtable.s_size(), 0);
+    auto intern = [&](uint32_t index) {
+        if(index < ids.size() && !ids[index])
+            ids[index] = interner.intern(stringtable.s(index));
+    };
+    auto intern_object = [&](const auto & object) {
+        for(int i = 0; i < object.keys_size(); ++i) {
+            intern(object.keys(i));
+            intern(object.vals(i));
+        }
+    };
 
-            // check that raw_size is set correctly
-            if(sz != blob.raw_size())
-                warn() << "  reports wrong raw_size: " << blob.raw_size() << " bytes";
+    for(int i = 0, l = primblock.primitivegroup_size(); i < l; i++) {
+        const OSMPBF::PrimitiveGroup& pg = primblock.primitivegroup(i);
+        for(int j = 0; j < pg.nodes_size(); ++j)
+            intern_object(pg.nodes(j));
+        if(pg.has_dense()) {
+            // 0 separates the nodes and is the empty string, which no tag uses
+            const OSMPBF::DenseNodes& dn = pg.dense();
+            for(int j = 0; j < dn.keys_vals_size(); ++j)
+                if(dn.keys_vals(j))
+                    intern(dn.keys_vals(j));
+        }
+        for(int j = 0; j < pg.ways_size(); ++j)
+            intern_object(pg.ways(j));
+        for(int j = 0; j < pg.relations_size(); ++j)
+            intern_object(pg.relations(j));
+    }
+}
 
-            memcpy(unpack_buffer, blob.raw().c_str(), sz);
-            return sz;
+// Calls the visitor for every object of an already decoded block,
+// string_ids are the ids intern_tags gave its strings, if the visitor has an Interner
+template<typename Visitor>
+void visit_primitiveblock(const OSMPBF::PrimitiveBlock & primblock, Visitor & visitor, const uint32_t* string_ids = nullptr) {
+    for(int i = 0, l = primblock.primitivegroup_size(); i < l; i++) {
+        const OSMPBF::PrimitiveGroup& pg = primblock.primitivegroup(i);
+
+        // Simple Nodes
+        for(int i = 0; i < pg.nodes_size(); ++i) {
+            const OSMPBF::Node& n = pg.nodes(i);
+
+            // in nanodegrees
+            int64_t lon = primblock.lon_offset() + (primblock.granularity() * n.lon());
+            int64_t lat = primblock.lat_offset() + (primblock.granularity() * n.lat());
+            call_node_callback(visitor, n.id(), lon, lat, tags_view(n, primblock, string_ids), callback_rank<3>());
         }
 
+        // Dense Nodes
+        if(pg.has_dense()) {
+            const OSMPBF::DenseNodes& dn = pg.dense();
+            uint64_t id = 0;
+            // the deltas are accumulated in granularity units, the offset is only applied once
+            int64_t raw_lon = 0;
+            int64_t raw_lat = 0;
+
+            int current_kv = 0;
+            const uint32_t* keys_vals = (const uint32_t*)dn.keys_vals().data();
 
-        if(blob.has_zlib_data()) {
-            sz = blob.zlib_data().size();
+            TagsView tags;
+            tags.stringtable = &primblock.stringtable();
+            tags.string_ids = string_ids;
+            tags.stride = 2;
 
-            z_stream z;
-            z.next_in   = (unsigned char*) blob.zlib_data().c_str();
-            z.avail_in  = sz;
-            z.next_out  = (unsigned char*) unpack_buffer;
-            z.avail_out = blob.raw_size();
-            z.zalloc    = Z_NULL;
-            z.zfree     = Z_NULL;
-            z.opaque    = Z_NULL;
+            for(int i = 0; i < dn.id_size(); ++i) {
+                id += dn.id(i);
+                raw_lon += dn.lon(i);
+                raw_lat += dn.lat(i);
+                // in nanodegrees
+                const int64_t lon = primblock.lon_offset() + (primblock.granularity() * raw_lon);
+                const int64_t lat = primblock.lat_offset() + (primblock.granularity() * raw_lat);
 
-            if(inflateInit(&z) != Z_OK) {
-                fatal() << "failed to init zlib stream";
+                tags.n = 0;
+                if(current_kv < dn.keys_vals_size()) {
+                    tags.keys = keys_vals + current_kv;
+                    tags.vals = keys_vals + current_kv + 1;
+                }
+                while (current_kv < dn.keys_vals_size() && dn.keys_vals(current_kv) != 0){
+                    current_kv += 2;
+                    tags.n++;
+                }
+                ++current_kv;
+                call_node_callback(visitor, id, lon, lat, tags, callback_rank<3>());
             }
-            if(inflate(&z, Z_FINISH) != Z_STREAM_END) {
-                fatal() << "failed to inflate zlib stream";
+        }
+
+        for(int i = 0; i < pg.ways_size(); ++i) {
+            const OSMPBF::Way& w = pg.ways(i);
+
+            uint64_t ref = 0;
+            std::vector<uint64_t> refs;
+            for(int j = 0; j < w.refs_size(); ++j){
+                ref += w.refs(j);
+                refs.push_back(ref);
             }
-            if(inflateEnd(&z) != Z_OK) {
-                fatal() << "failed to deinit zlib stream";
+            uint64_t id = w.id();
+            call_way_callback(visitor, id, tags_view(w, primblock, string_ids), refs, callback_rank<1>());
+        }
+
+
+        for(int i=0; i < pg.relations_size(); ++i){
+            const OSMPBF::Relation& rel = pg.relations(i);
+            uint64_t id = 0;
+            References refs;
+
+            for(int l = 0; l < rel.memids_size(); ++l){
+                id += rel.memids(l);
+                refs.push_back(Reference(rel.types(l), id, primblock.stringtable().s(rel.roles_sid(l))));
             }
-            return z.total_out;
+
+            call_relation_callback(visitor, rel.id(), tags_view(rel, primblock, string_ids), refs, callback_rank<1>());
         }
+    }
+}
 
-        if(blob.has_lzma_data()) {
-            fatal() << "lzma-decompression is not supported";
+template<typename Visitor>
+struct Parser {
+
+    void parse(){
+        OSMPBF::BlobHeader header;
+        const char* data;
+        int32_t sz;
+        if(record)
+            record->file = source.identity();
+        while(source.next(header, &data, &sz)) {
+            BlobIndexEntry entry = {source.offset(), 0, 0, 0};
+            if(header.type() == "OSMData") {
+                sz = inflate_blob(data, sz, unpack_buffer);
+                this->parse_primitiveblock(sz, entry);
+            }
+            else if(header.type() == "OSMHeader"){
+            }
+            else {
+                warn() << "  unknown blob type: " << header.type();
+            }
+            if(record)
+                record->blobs.push_back(entry);
         }
-        return 0;
     }
 
-    void parse_primitiveblock(int32_t sz) {
+    // selection restricts the pass to the listed blobs,
+    // record (if given) receives the index of every blob visited
+    Parser(const std::string & filename, Visitor & visitor,
+           const std::vector<BlobIndexEntry>* selection = nullptr, BlobIndex* record = nullptr)
+        : visitor(visitor), source(filename, selection), record(record), interner(visitor)
+    {
+        unpack_buffer = new char[max_uncompressed_blob_size];
+    }
+
+    ~Parser(){
+        delete[] unpack_buffer;
+    }
+
+private:
+    Visitor & visitor;
+    BlobSource source;
+    BlobIndex* record;
+    char* unpack_buffer;
+    typename interner_of<Visitor>::type interner;
+    std::vector<uint32_t> string_ids;
+
+    void parse_primitiveblock(int32_t sz, BlobIndexEntry & entry) {
         OSMPBF::PrimitiveBlock primblock;
         if(!primblock.ParseFromArray(this->unpack_buffer, sz))
             fatal() << "unable to parse primitive block";
 
-        for(int i = 0, l = primblock.primitivegroup_size(); i < l; i++) {
-            const OSMPBF::PrimitiveGroup& pg = primblock.primitivegroup(i);
+        if(record)
+            describe_block(primblock, entry);
+
+        if(has_interner<Visitor>)
+            intern_tags(primblock, interner, string_ids);
+        visit_primitiveblock(primblock, visitor, has_interner<Visitor> ? string_ids.data() : nullptr);
+    }
+};
+
+// Reads the file on one thread, inflates and decodes the blocks on a pool of workers
+// and hands the decoded blocks to the visitor on the calling thread.
+// The visitor is therefore never called concurrently, only its Interner runs on the workers.
+// When ordered is true the callbacks arrive in file order, otherwise in the
+// order in which the workers finish their blocks.
+template<typename Visitor>
+struct ParallelParser {
+
+    ParallelParser(const std::string & filename, Visitor & visitor, unsigned n_workers, bool ordered,
+                   const std::vector<BlobIndexEntry>* selection = nullptr, BlobIndex* record = nullptr)
+        : visitor(visitor), source(filename, selection), record(record), n_workers(n_workers), ordered(ordered)
+    {
+        if(this->n_workers == 0)
+            this->n_workers = std::max(1u, std::thread::hardware_concurrency());
+        // bounds the memory used by blocks which are read but not yet delivered
+        max_in_flight = 4 * this->n_workers;
+    }
+
+    void parse(){
+        if(record)
+            record->file = source.identity();
 
-            // Simple Nodes
-            for(int i = 0; i < pg.nodes_size(); ++i) {
-                const OSMPBF::Node& n = pg.nodes(i);
+        std::thread reader([this] { this->read_blobs(); });
+        std::vector<std::thread> workers;
+        for(unsigned i = 0; i < n_workers; ++i)
+            workers.emplace_back([this] { this->decode_blobs(); });
 
-                double lon = 0.000000001 * (primblock.lon_offset() + (primblock.granularity() * n.lon())) ;
-                double lat = 0.000000001 * (primblock.lat_offset() + (primblock.granularity() * n.lat())) ;
-                visitor.node_callback(n.id(), lon, lat, get_tags(n, primblock));
+        uint64_t next_seq = 0;
+        for(;;) {
+            DecodedBlock* block = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                done_cv.wait(lock, [&] {
+                    return (ordered ? done.count(next_seq) != 0 : !done.empty())
+                        || (reader_finished && next_seq == n_read);
+                });
+                if(done.empty() && reader_finished && next_seq == n_read)
+                    break;
+                auto it = ordered ? done.find(next_seq) : done.begin();
+                block = it->second;
+                done.erase(it);
             }
 
-            // Dense Nodes
-            if(pg.has_dense()) {
-                const OSMPBF::DenseNodes& dn = pg.dense();
-                uint64_t id = 0;
-                double lon = 0;
-                double lat = 0;
-
-                int current_kv = 0;
-
-                for(int i = 0; i < dn.id_size(); ++i) {
-                    id += dn.id(i);
-                    lon +=  0.000000001 * (primblock.lon_offset() + (primblock.granularity() * dn.lon(i)));
-                    lat +=  0.000000001 * (primblock.lat_offset() + (primblock.granularity() * dn.lat(i)));
-
-                    Tags tags;
-                    while (current_kv < dn.keys_vals_size() && dn.keys_vals(current_kv) != 0){
-                        uint64_t key = dn.keys_vals(current_kv);
-                        uint64_t val = dn.keys_vals(current_kv + 1);
-                        std::string key_string = primblock.stringtable().s(key);
-                        std::string val_string = primblock.stringtable().s(val);
-                        current_kv += 2;
-                        tags[key_string] = val_string;
-                    }
-                    ++current_kv;
-                    visitor.node_callback(id, lon, lat, tags);
-                }
+            if(block->is_data)
+                visit_primitiveblock(block->primblock, visitor,
+                                     has_interner<Visitor> ? block->string_ids.data() : nullptr);
+            if(record)
+                record->blobs.push_back(block->entry);
+            delete block;
+            ++next_seq;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                --in_flight;
             }
+            space_cv.notify_one();
+        }
 
-            for(int i = 0; i < pg.ways_size(); ++i) {
-                const OSMPBF::Way& w = pg.ways(i);
+        reader.join();
+        for(auto & w : workers)
+            w.join();
 
-                uint64_t ref = 0;
-                std::vector<uint64_t> refs;
-                for(int j = 0; j < w.refs_size(); ++j){
-                    ref += w.refs(j);
-                    refs.push_back(ref);
-                }
-                uint64_t id = w.id();
-                visitor.way_callback(id, get_tags(w, primblock), refs);
+        if(record && !ordered) {
+            std::sort(record->blobs.begin(), record->blobs.end(),
+                [](const BlobIndexEntry & a, const BlobIndexEntry & b) { return a.offset < b.offset; });
+        }
+    }
+
+private:
+    // A blob as sliced from the file by the reader.
+    // data points into the mapped file or, if the source is not mapped, into storage
+    struct RawBlob {
+        uint64_t seq;
+        uint64_t offset;
+        std::string type;
+        const char* data;
+        int32_t sz;
+        std::vector<char> storage;
+    };
+
+    // A decoded blob waiting for its delivery to the visitor
+    struct DecodedBlock {
+        bool is_data;
+        BlobIndexEntry entry;
+        OSMPBF::PrimitiveBlock primblock;
+        std::vector<uint32_t> string_ids;
+    };
+
+    Visitor & visitor;
+    BlobSource source;
+    BlobIndex* record;
+    unsigned n_workers;
+    bool ordered;
+
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    std::condition_variable space_cv;
+
+    std::deque<RawBlob*> work_queue;
+    std::map<uint64_t, DecodedBlock*> done;
+    uint64_t n_read = 0;
+    size_t in_flight = 0;
+    size_t max_in_flight;
+    bool reader_finished = false;
+
+    void read_blobs(){
+        OSMPBF::BlobHeader header;
+        const char* data;
+        int32_t sz;
+        for(;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                space_cv.wait(lock, [this] { return in_flight < max_in_flight; });
             }
+            if(!source.next(header, &data, &sz))
+                break;
 
+            RawBlob* raw = new RawBlob;
+            raw->type = header.type();
+            raw->offset = source.offset();
+            if(source.mapped()) {
+                raw->data = data;
+            }
+            else {
+                raw->storage.assign(data, data + sz);
+                raw->data = raw->storage.data();
+            }
+            raw->sz = sz;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                raw->seq = n_read++;
+                ++in_flight;
+                work_queue.push_back(raw);
+            }
+            work_cv.notify_one();
+        }
 
-            for(int i=0; i < pg.relations_size(); ++i){
-                const OSMPBF::Relation& rel = pg.relations(i);
-                uint64_t id = 0;
-                References refs;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            reader_finished = true;
+        }
+        work_cv.notify_all();
+        done_cv.notify_all();
+    }
 
-                for(int l = 0; l < rel.memids_size(); ++l){
-                    id += rel.memids(l);
-                    refs.push_back(Reference(rel.types(l), id, primblock.stringtable().s(rel.roles_sid(l))));
-                }
+    void decode_blobs(){
+        char* unpack_buffer = new char[max_uncompressed_blob_size];
+        typename interner_of<Visitor>::type interner(visitor);
+        for(;;) {
+            RawBlob* raw = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_cv.wait(lock, [this] { return !work_queue.empty() || reader_finished; });
+                if(work_queue.empty())
+                    break;
+                raw = work_queue.front();
+                work_queue.pop_front();
+            }
 
-                visitor.relation_callback(rel.id(), get_tags(rel, primblock), refs);
+            DecodedBlock* block = new DecodedBlock;
+            block->is_data = (raw->type == "OSMData");
+            block->entry = {raw->offset, 0, 0, 0};
+            if(block->is_data) {
+                int32_t sz = inflate_blob(raw->data, raw->sz, unpack_buffer);
+                if(!block->primblock.ParseFromArray(unpack_buffer, sz))
+                    fatal() << "unable to parse primitive block";
+                if(record)
+                    describe_block(block->primblock, block->entry);
+                if(has_interner<Visitor>)
+                    intern_tags(block->primblock, interner, block->string_ids);
+            }
+            else if(raw->type != "OSMHeader") {
+                warn() << "  unknown blob type: " << raw->type;
             }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                done[raw->seq] = block;
+            }
+            done_cv.notify_one();
+            delete raw;
         }
+        delete[] unpack_buffer;
     }
 };
 
@@ -308,4 +1119,62 @@ void read_osm_pbf(const std::string & filename, Visitor & visitor){
     p.parse();
 }
 
+// Same as read_osm_pbf but inflates and decodes the blocks on n_workers threads
+// (0 means one per hardware thread).
+// With ordered set to false blocks are delivered as soon as they are decoded.
+template<typename Visitor>
+void read_osm_pbf_parallel(const std::string & filename, Visitor & visitor, unsigned n_workers, bool ordered){
+    ParallelParser<Visitor> p(filename, visitor, n_workers, ordered);
+    p.parse();
+}
+
+// Only visits the given blobs, usually a BlobIndex::select() of the file
+template<typename Visitor>
+void read_osm_pbf(const std::string & filename, Visitor & visitor, const std::vector<BlobIndexEntry> & blobs){
+    Parser<Visitor> p(filename, visitor, &blobs);
+    p.parse();
+}
+
+template<typename Visitor>
+void read_osm_pbf_parallel(const std::string & filename, Visitor & visitor, const std::vector<BlobIndexEntry> & blobs,
+                           unsigned n_workers = 0, bool ordered = true){
+    ParallelParser<Visitor> p(filename, visitor, n_workers, ordered, &blobs);
+    p.parse();
+}
+
+// Visits the whole file and builds its blob index on the way,
+// so the first pass of an import gets the index for free
+template<typename Visitor>
+void read_osm_pbf_and_index(const std::string & filename, Visitor & visitor, BlobIndex & index, unsigned n_workers = 0){
+    index.blobs.clear();
+    ParallelParser<Visitor> p(filename, visitor, n_workers, true, nullptr, &index);
+    p.parse();
+}
+
+// One-time scan which only builds the blob index without visiting any object
+inline BlobIndex build_blob_index(const std::string & filename){
+    BlobIndex index;
+    BlobSource source(filename);
+    char* unpack_buffer = new char[max_uncompressed_blob_size];
+
+    OSMPBF::BlobHeader header;
+    const char* data;
+    int32_t sz;
+    index.file = source.identity();
+    while(source.next(header, &data, &sz)) {
+        BlobIndexEntry entry = {source.offset(), 0, 0, 0};
+        if(header.type() == "OSMData") {
+            OSMPBF::PrimitiveBlock primblock;
+            sz = inflate_blob(data, sz, unpack_buffer);
+            if(!primblock.ParseFromArray(unpack_buffer, sz))
+                fatal() << "unable to parse primitive block";
+            describe_block(primblock, entry);
+        }
+        index.blobs.push_back(entry);
+    }
+
+    delete[] unpack_buffer;
+    return index;
+}
+
 }
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#include "ways.h"
+#include "string_table.cpp"
+
+using namespace std;
+
+enum RoutingProfile : uint8_t
+{
+    PROFILE_CAR,
+    PROFILE_BIKE,
+    PROFILE_FOOT,
+
+    N_PROFILES
+};
+
+static const char* const profile_names[N_PROFILES] = {"car", "bike", "foot"};
+
+// how fast a way can be travelled in each direction, 0 if it can't be used that way
+struct WaySpeeds
+{
+    uint8_t forward_kmh;
+    uint8_t backward_kmh;
+};
+
+// Car, bike and foot profiles compiled against the interned tags.
+// Compile() looks at every tag value string once and fills tables indexed by
+// the value ids, after that evaluating a way only compares integer key ids
+// and indexes tables, no strings are touched.
+struct CompiledProfiles
+{
+    /// the fastest speed of each profile, for the lower bounds of A*
+    uint8_t max_speed_kmh[N_PROFILES] = {};
+
+    void Compile(StringTable& tag_names, StringTable& tag_values);
+
+    /// the speeds of a way in all profiles at once
+    void Evaluate(const short_tags_t& tags, WaySpeeds speeds[N_PROFILES]) const;
+
+private:
+    // the keys a profile looks at, a tag name id maps to its slot
+    enum KeySlot : uint8_t
+    {
+        SLOT_NONE,
+        SLOT_HIGHWAY,
+        SLOT_MAXSPEED,
+        SLOT_ONEWAY,
+        SLOT_ONEWAY_BICYCLE,
+        SLOT_JUNCTION,
+        SLOT_ACCESS,
+        SLOT_MOTOR_VEHICLE,
+        SLOT_BICYCLE,
+        SLOT_FOOT,
+
+        N_SLOTS
+    };
+
+    enum Access : int8_t
+    {
+        ACCESS_DENIED = -1,
+        ACCESS_UNKNOWN = 0,
+        ACCESS_ALLOWED = 1,
+    };
+
+    enum Direction : int8_t
+    {
+        DIRECTION_REVERSE = -1,
+        DIRECTION_BOTH = 0,
+        DIRECTION_FORWARD = 1,
+    };
+
+    /// indexed by tag name id
+    vector<uint8_t> key_slot;
+
+    // all indexed by tag value id
+    vector<uint8_t> highway_speed[N_PROFILES];
+    /// the highway class implies a oneway, like motorways do
+    vector<uint8_t> highway_oneway;
+    vector<uint8_t> maxspeed_kmh;
+    vector<int8_t> access;
+    vector<int8_t> oneway;
+    vector<uint8_t> roundabout;
+
+    /// speed if an access tag allows a way its highway class would not
+    static const uint8_t fallback_speed[N_PROFILES];
+
+    static uint8_t ParseMaxspeed(string_view value);
+};
+
+const uint8_t CompiledProfiles::fallback_speed[N_PROFILES] = {10, 12, 5};
+
+// km/h for car, bike and foot, 0 if the profile may not use the highway class
+static const struct
+{
+    const char* highway;
+    uint8_t speed[N_PROFILES];
+    bool oneway;
+} highway_classes[] = {
+    {"motorway",        {120,  0, 0}, true},
+    {"motorway_link",   { 60,  0, 0}, true},
+    {"trunk",           {100,  0, 0}, false},
+    {"trunk_link",      { 50,  0, 0}, false},
+    {"primary",         { 80, 18, 5}, false},
+    {"primary_link",    { 40, 18, 5}, false},
+    {"secondary",       { 70, 18, 5}, false},
+    {"secondary_link",  { 35, 18, 5}, false},
+    {"tertiary",        { 50, 18, 5}, false},
+    {"tertiary_link",   { 30, 18, 5}, false},
+    {"unclassified",    { 40, 18, 5}, false},
+    {"residential",     { 30, 18, 5}, false},
+    {"living_street",   { 10, 10, 5}, false},
+    {"service",         { 15, 15, 5}, false},
+    {"road",            { 30, 15, 5}, false},
+    {"track",           {  0, 12, 5}, false},
+    {"cycleway",        {  0, 20, 5}, false},
+    {"path",            {  0, 12, 5}, false},
+    {"bridleway",       {  0,  0, 5}, false},
+    {"footway",         {  0,  0, 5}, false},
+    {"pedestrian",      {  0,  0, 5}, false},
+    {"steps",           {  0,  0, 2}, false},
+};
+
+uint8_t CompiledProfiles::ParseMaxspeed(string_view value)
+{
+    if (value.empty() || value[0] < '0' || value[0] > '9')
+        return 0;
+
+    uint32_t speed = 0;
+    uint32_t i = 0;
+    for (; i < value.size() && value[i] >= '0' && value[i] <= '9'; i++)
+        speed = min(speed * 10 + (value[i] - '0'), 1000u);
+
+    // "30 mph" and "30mph"
+    while (i < value.size() && value[i] == ' ')
+        i++;
+    if (value.size() - i == 3 && 0 == strncmp(value.data() + i, "mph", 3))
+        speed = speed * 1609 / 1000;
+
+    return (uint8_t)min(speed, 255u);
+}
+
+void CompiledProfiles::Compile(StringTable& tag_names, StringTable& tag_values)
+{
+    const uint32_t n_names = (uint32_t)tag_names.strings.size() + 1;
+    const uint32_t n_values = (uint32_t)tag_values.strings.size() + 1;
+
+    key_slot.assign(n_names, SLOT_NONE);
+    static const struct { const char* key; KeySlot slot; } keys[] = {
+        {"highway", SLOT_HIGHWAY},
+        {"maxspeed", SLOT_MAXSPEED},
+        {"oneway", SLOT_ONEWAY},
+        {"oneway:bicycle", SLOT_ONEWAY_BICYCLE},
+        {"junction", SLOT_JUNCTION},
+        {"access", SLOT_ACCESS},
+        {"motor_vehicle", SLOT_MOTOR_VEHICLE},
+        {"motorcar", SLOT_MOTOR_VEHICLE},
+        {"bicycle", SLOT_BICYCLE},
+        {"foot", SLOT_FOOT},
+    };
+    for (const auto& k : keys)
+    {
+        const auto id = tag_names.LookupCString(k.key);
+        if (id)
+            key_slot[id] = k.slot;
+    }
+
+    for (auto& table : highway_speed)
+        table.assign(n_values, 0);
+    highway_oneway.assign(n_values, 0);
+    for (uint32_t p = 0; p < N_PROFILES; p++)
+        max_speed_kmh[p] = fallback_speed[p];
+    for (const auto& h : highway_classes)
+    {
+        const auto id = tag_values.LookupCString(h.highway);
+        for (uint32_t p = 0; p < N_PROFILES; p++)
+        {
+            if (id)
+                highway_speed[p][id] = h.speed[p];
+            max_speed_kmh[p] = max(max_speed_kmh[p], h.speed[p]);
+        }
+        if (id)
+            highway_oneway[id] = h.oneway;
+    }
+
+    // every value string is looked at once here and never again
+    maxspeed_kmh.assign(n_values, 0);
+    access.assign(n_values, ACCESS_UNKNOWN);
+    oneway.assign(n_values, DIRECTION_BOTH);
+    roundabout.assign(n_values, 0);
+    for (uint32_t id = 1; id < n_values; id++)
+    {
+        const auto value = tag_values.LookupId(id);
+
+        maxspeed_kmh[id] = ParseMaxspeed(value);
+
+        if (value == "no" || value == "private" || value == "agricultural" || value == "forestry" || value == "dismount")
+            access[id] = ACCESS_DENIED;
+        else if (value == "yes" || value == "permissive" || value == "designated" || value == "destination" || value == "customers")
+            access[id] = ACCESS_ALLOWED;
+
+        if (value == "yes" || value == "true" || value == "1")
+            oneway[id] = DIRECTION_FORWARD;
+        else if (value == "-1" || value == "reverse")
+            oneway[id] = DIRECTION_REVERSE;
+
+        roundabout[id] = (value == "roundabout" || value == "circular");
+    }
+    // a maxspeed tag never makes a car faster than the fastest highway class
+    for (auto& speed : maxspeed_kmh)
+        speed = min(speed, max_speed_kmh[PROFILE_CAR]);
+}
+
+void CompiledProfiles::Evaluate(const short_tags_t& tags, WaySpeeds speeds[N_PROFILES]) const
+{
+    // the value id of every slot, 0 if the way doesn't have the key
+    uint32_t values[N_SLOTS] = {};
+    for (const auto& tag : tags)
+    {
+        if (tag.first < key_slot.size() && tag.second < maxspeed_kmh.size())
+            values[key_slot[tag.first]] = tag.second;
+    }
+
+    const uint32_t highway = values[SLOT_HIGHWAY];
+    const int8_t general_access = access[values[SLOT_ACCESS]];
+    const int8_t profile_access[N_PROFILES] = {
+        access[values[SLOT_MOTOR_VEHICLE]],
+        access[values[SLOT_BICYCLE]],
+        access[values[SLOT_FOOT]],
+    };
+
+    // explicit oneway tags beat the implied ones, "oneway=no" on a motorway link is common
+    int8_t direction = oneway[values[SLOT_ONEWAY]];
+    if (!values[SLOT_ONEWAY] && (highway_oneway[highway] || roundabout[values[SLOT_JUNCTION]]))
+        direction = DIRECTION_FORWARD;
+
+    for (uint32_t p = 0; p < N_PROFILES; p++)
+    {
+        uint32_t speed = highway_speed[p][highway];
+
+        // the most specific access tag wins
+        const int8_t a = profile_access[p] ? profile_access[p] : general_access;
+        if (a == ACCESS_DENIED || !highway)
+            speed = 0;
+        else if (a == ACCESS_ALLOWED && !speed)
+            speed = fallback_speed[p];
+
+        const uint8_t limit = maxspeed_kmh[values[SLOT_MAXSPEED]];
+        if (limit && speed)
+            speed = (p == PROFILE_CAR) ? limit : min<uint32_t>(speed, limit);
+
+        int8_t d = direction;
+        if (p == PROFILE_FOOT)
+            d = DIRECTION_BOTH;
+        else if (p == PROFILE_BIKE && values[SLOT_ONEWAY_BICYCLE])
+            d = oneway[values[SLOT_ONEWAY_BICYCLE]];
+
+        speeds[p].forward_kmh = (d == DIRECTION_REVERSE) ? 0 : (uint8_t)speed;
+        speeds[p].backward_kmh = (d == DIRECTION_FORWARD) ? 0 : (uint8_t)speed;
+    }
+}
@@ -0,0 +1,443 @@
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <thread>
+#include <algorithm>
+
+#include "ways.h"
+#include "node_store.h"
+#include "serializer.cpp"
+#include "profile.cpp"
+
+using namespace std;
+
+static const uint32_t INVALID_GRAPH_NODE = UINT32_MAX;
+
+/// great circle distance in meters
+inline double HaversineMeters(Coordinates a, Coordinates b)
+{
+    const double earth_radius = 6371008.8;
+    const double to_radians = (M_PI / 180.0) * 1e-7;
+
+    const double lat1 = a.lat_e7 * to_radians;
+    const double lat2 = b.lat_e7 * to_radians;
+    const double dlat = lat2 - lat1;
+    const double dlon = ((double)b.lon_e7 - (double)a.lon_e7) * to_radians;
+
+    const double sin_dlat = sin(dlat * 0.5);
+    const double sin_dlon = sin(dlon * 0.5);
+    const double h = sin_dlat * sin_dlat + cos(lat1) * cos(lat2) * sin_dlon * sin_dlon;
+
+    return 2.0 * earth_radius * asin(sqrt(h));
+}
+
+/// Splits [0, n) into one chunk per thread and calls f(thread_index, begin, end) for each
+template <typename F>
+void ParallelFor(uint32_t n, unsigned n_threads, F f)
+{
+    if (!n_threads)
+        n_threads = max(1u, thread::hardware_concurrency());
+    if (n_threads > n)
+        n_threads = max(1u, n);
+
+    const uint32_t chunk = (n + n_threads - 1) / n_threads;
+    vector<thread> threads;
+    for (unsigned t = 1; t < n_threads; t++)
+    {
+        const uint32_t begin = min(n, t * chunk);
+        const uint32_t end = min(n, begin + chunk);
+        threads.emplace_back([=, &f] { f(t, begin, end); });
+    }
+    f(0, 0, min(n, chunk));
+
+    for (auto& t : threads)
+        t.join();
+}
+
+struct GraphEdge
+{
+    uint32_t from;
+    uint32_t to;
+    uint32_t weight;
+};
+
+// Road network between intersections as a compressed sparse row graph.
+// Graph nodes are the way nodes used by more than one way (or ending a way),
+// renumbered to dense ids in osmid order.
+// Edge weights are the length along the way in decimeters, or for the graph
+// of a profile the travel time in deciseconds.
+struct RoadGraph
+{
+    /// 0 if the weights are lengths, otherwise the fastest speed the travel times assume
+    uint32_t max_speed_kmh = 0;
+
+    vector<uint64_t> osmids;
+    vector<Coordinates> coords;
+
+    // forward adjacency: the edges leaving u are [first_out[u], first_out[u + 1])
+    vector<uint32_t> first_out;
+    vector<uint32_t> targets;
+    vector<uint32_t> weights;
+
+    // reverse adjacency: the edges entering v are [first_in[v], first_in[v + 1])
+    vector<uint32_t> first_in;
+    vector<uint32_t> sources;
+    vector<uint32_t> in_weights;
+
+    uint32_t NodeCount() const
+    {
+        return (uint32_t)osmids.size();
+    }
+
+    uint32_t EdgeCount() const
+    {
+        return (uint32_t)targets.size();
+    }
+
+    /// Returns INVALID_GRAPH_NODE if osmid is not a node of the graph
+    uint32_t FindNode(uint64_t osmid) const
+    {
+        auto it = lower_bound(osmids.begin(), osmids.end(), osmid);
+        if (it == osmids.end() || *it != osmid)
+            return INVALID_GRAPH_NODE;
+        return (uint32_t)(it - osmids.begin());
+    }
+
+    /// length weighted graph over all the ways
+    void Build(const vector<Way>& ways, NodeStore& nodes, unsigned n_threads = 0);
+
+    /// travel time weighted graphs for all profiles in one pass over the ways,
+    /// they share the node ids so a node can be looked up once for all of them
+    static void BuildProfiles(const vector<Way>& ways, NodeStore& nodes, const CompiledProfiles& profiles,
+                              RoadGraph graphs[N_PROFILES], unsigned n_threads = 0);
+
+    /// the time of travelling length_meters at speed_kmh in deciseconds,
+    /// rounded up so the A* lower bound never exceeds the weight of a path
+    static uint32_t TravelTime(double length_meters, uint32_t speed_kmh)
+    {
+        return max(1u, (uint32_t)ceil(length_meters * 36.0 / speed_kmh));
+    }
+
+    /// length_meters in decimeters, rounded up like TravelTime
+    static uint32_t LengthWeight(double length_meters)
+    {
+        return max(1u, (uint32_t)ceil(length_meters * 10.0));
+    }
+
+    /// builds the forward and reverse adjacency from an unordered edge list
+    void BuildFromEdges(const vector<GraphEdge>& edges);
+
+    void Serialize(Serializer& serializer);
+
+    /// Returns false, with the graph left empty, if the stored counts do not fit
+    /// the section or an edge leads outside of the graph
+    bool DeSerialize(Serializer& serializer);
+
+private:
+    void BuildReverse(void);
+
+    /// way_speeds(w, speeds) fills the speeds of way w for each of the n_graphs graphs,
+    /// a speed of UINT8_MAX weights by length
+    template <typename F>
+    static void BuildGraphs(const vector<Way>& ways, NodeStore& nodes, RoadGraph* graphs, uint32_t n_graphs,
+                            F way_speeds, unsigned n_threads);
+};
+
+void RoadGraph::Build(const vector<Way>& ways, NodeStore& nodes, unsigned n_threads)
+{
+    BuildGraphs(ways, nodes, this, 1, [] (uint32_t, WaySpeeds* speeds) {
+        speeds[0] = {UINT8_MAX, UINT8_MAX};
+    }, n_threads);
+}
+
+void RoadGraph::BuildProfiles(const vector<Way>& ways, NodeStore& nodes, const CompiledProfiles& profiles,
+                              RoadGraph graphs[N_PROFILES], unsigned n_threads)
+{
+    BuildGraphs(ways, nodes, graphs, N_PROFILES, [&] (uint32_t w, WaySpeeds* speeds) {
+        profiles.Evaluate(ways[w].tags, speeds);
+    }, n_threads);
+
+    for (uint32_t p = 0; p < N_PROFILES; p++)
+        graphs[p].max_speed_kmh = profiles.max_speed_kmh[p];
+}
+
+template <typename F>
+void RoadGraph::BuildGraphs(const vector<Way>& ways, NodeStore& nodes, RoadGraph* graphs, uint32_t n_graphs,
+                            F way_speeds, unsigned n_threads)
+{
+    assert(n_graphs <= N_PROFILES);
+    nodes.Seal();
+    const uint32_t n_ways = (uint32_t)ways.size();
+    if (!n_threads)
+        n_threads = max(1u, thread::hardware_concurrency());
+
+    // the speeds of every way in every graph, ways no graph can use are dropped
+    vector<WaySpeeds> speeds((size_t)n_ways * n_graphs);
+
+    // resolve every ref to its index in the node store once
+    vector<vector<uint32_t> > way_nodes(n_ways);
+    vector<int32_t> uses(nodes.size(), 0);
+
+    ParallelFor(n_ways, n_threads, [&] (unsigned, uint32_t begin, uint32_t end) {
+        for (uint32_t w = begin; w < end; w++)
+        {
+            WaySpeeds* way_speed = &speeds[(size_t)w * n_graphs];
+            way_speeds(w, way_speed);
+            bool usable = false;
+            for (uint32_t g = 0; g < n_graphs; g++)
+                usable |= (way_speed[g].forward_kmh || way_speed[g].backward_kmh);
+            if (!usable)
+                continue;
+
+            auto& refs = way_nodes[w];
+            // refs which are missing from the extract are skipped
+            for (const auto ref : ways[w].refs)
+            {
+                const auto idx = nodes.Lookup(ref);
+                if (idx)
+                    refs.push_back(idx - 1);
+            }
+            if (refs.size() < 2)
+            {
+                refs.clear();
+                continue;
+            }
+
+            for (const auto idx : refs)
+                __atomic_fetch_add(&uses[idx], 1, __ATOMIC_RELAXED);
+            // both ends of a way are always graph nodes
+            __atomic_fetch_add(&uses[refs.front()], 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&uses[refs.back()], 1, __ATOMIC_RELAXED);
+        }
+    });
+
+    // dense renumbering in osmid order, the same for every graph
+    vector<uint32_t> graph_node(nodes.size(), INVALID_GRAPH_NODE);
+    RoadGraph& first = graphs[0];
+    first.osmids.clear();
+    first.coords.clear();
+    for (uint32_t i = 0; i < nodes.size(); i++)
+    {
+        if (uses[i] > 1)
+        {
+            graph_node[i] = (uint32_t)first.osmids.size();
+            first.osmids.push_back(nodes.ids[i]);
+            first.coords.push_back(nodes.coords[i]);
+        }
+    }
+    for (uint32_t g = 1; g < n_graphs; g++)
+    {
+        graphs[g].osmids = first.osmids;
+        graphs[g].coords = first.coords;
+    }
+
+    // every thread collects the edges of its ways
+    vector<vector<GraphEdge> > thread_edges((size_t)n_threads * n_graphs);
+    ParallelFor(n_ways, n_threads, [&] (unsigned t, uint32_t begin, uint32_t end) {
+        for (uint32_t w = begin; w < end; w++)
+        {
+            const auto& refs = way_nodes[w];
+            if (refs.empty())
+                continue;
+            const WaySpeeds* way_speed = &speeds[(size_t)w * n_graphs];
+
+            uint32_t source = graph_node[refs[0]];
+            double length = 0;
+            for (uint32_t i = 1; i < refs.size(); i++)
+            {
+                length += HaversineMeters(nodes.coords[refs[i - 1]], nodes.coords[refs[i]]);
+
+                const uint32_t target = graph_node[refs[i]];
+                if (target == INVALID_GRAPH_NODE)
+                    continue;
+
+                if (target != source)
+                {
+                    for (uint32_t g = 0; g < n_graphs; g++)
+                    {
+                        auto& edges = thread_edges[(size_t)t * n_graphs + g];
+                        const auto forward = way_speed[g].forward_kmh;
+                        const auto backward = way_speed[g].backward_kmh;
+                        if (forward == UINT8_MAX)
+                        {
+                            const uint32_t weight = LengthWeight(length);
+                            edges.push_back({source, target, weight});
+                            edges.push_back({target, source, weight});
+                            continue;
+                        }
+                        if (forward)
+                            edges.push_back({source, target, TravelTime(length, forward)});
+                        if (backward)
+                            edges.push_back({target, source, TravelTime(length, backward)});
+                    }
+                }
+                source = target;
+                length = 0;
+            }
+        }
+    });
+
+    for (uint32_t g = 0; g < n_graphs; g++)
+    {
+        vector<GraphEdge> edges;
+        for (uint32_t t = 0; t < n_threads; t++)
+        {
+            auto& e = thread_edges[(size_t)t * n_graphs + g];
+            edges.insert(edges.end(), e.begin(), e.end());
+            vector<GraphEdge>().swap(e);
+        }
+        graphs[g].BuildFromEdges(edges);
+    }
+}
+
+void RoadGraph::BuildFromEdges(const vector<GraphEdge>& edges)
+{
+    const uint32_t n_nodes = NodeCount();
+
+    // counting sort by source
+    first_out.assign(n_nodes + 1, 0);
+    for (const auto& e : edges)
+        first_out[e.from + 1]++;
+    for (uint32_t u = 0; u < n_nodes; u++)
+        first_out[u + 1] += first_out[u];
+
+    targets.resize(edges.size());
+    weights.resize(edges.size());
+    {
+        vector<uint32_t> fill(first_out.begin(), first_out.end() - 1);
+        for (const auto& e : edges)
+        {
+            const auto pos = fill[e.from]++;
+            targets[pos] = e.to;
+            weights[pos] = e.weight;
+        }
+    }
+
+    BuildReverse();
+}
+
+void RoadGraph::BuildReverse(void)
+{
+    const uint32_t n_nodes = NodeCount();
+
+    first_in.assign(n_nodes + 1, 0);
+    for (const auto v : targets)
+        first_in[v + 1]++;
+    for (uint32_t v = 0; v < n_nodes; v++)
+        first_in[v + 1] += first_in[v];
+
+    sources.resize(targets.size());
+    in_weights.resize(targets.size());
+
+    vector<uint32_t> fill(first_in.begin(), first_in.end() - 1);
+    for (uint32_t u = 0; u < n_nodes; u++)
+    {
+        for (uint32_t e = first_out[u]; e < first_out[u + 1]; e++)
+        {
+            const auto pos = fill[targets[e]]++;
+            sources[pos] = u;
+            in_weights[pos] = weights[e];
+        }
+    }
+}
+
+void RoadGraph::Serialize(Serializer& serializer)
+{
+    const uint32_t n_nodes = NodeCount();
+
+    serializer.WriteU32(max_speed_kmh);
+    serializer.WriteU32(n_nodes);
+    serializer.WriteU32(EdgeCount());
+
+    // ids ascend and neighbouring nodes are close, so everything is delta coded
+    {
+        uint64_t last_osmid = 0;
+        Coordinates last = {0, 0};
+        for (uint32_t u = 0; u < n_nodes; u++)
+        {
+            serializer.WriteVarInt((int64_t)(osmids[u] - last_osmid));
+            serializer.WriteVarInt((int64_t)coords[u].lat_e7 - last.lat_e7);
+            serializer.WriteVarInt((int64_t)coords[u].lon_e7 - last.lon_e7);
+            last_osmid = osmids[u];
+            last = coords[u];
+        }
+    }
+
+    // only the forward adjacency is stored, the reverse one is rebuilt on load
+    for (uint32_t u = 0; u < n_nodes; u++)
+    {
+        serializer.WriteVarInt(first_out[u + 1] - first_out[u]);
+        for (uint32_t e = first_out[u]; e < first_out[u + 1]; e++)
+        {
+            serializer.WriteVarInt((int64_t)targets[e] - u);
+            serializer.WriteVarInt(weights[e]);
+        }
+    }
+}
+
+bool RoadGraph::DeSerialize(Serializer& serializer)
+{
+    auto Fail = [this] {
+        *this = RoadGraph {};
+        return false;
+    };
+
+    max_speed_kmh = serializer.ReadU32();
+    const uint32_t n_nodes = serializer.ReadU32();
+    const uint32_t n_edges = serializer.ReadU32();
+    // a node takes at least four bytes and an edge two, nothing is allocated for more
+    if ((uint64_t)n_nodes * 4 + (uint64_t)n_edges * 2 > serializer.BytesLeft())
+        return Fail();
+
+    osmids.resize(n_nodes);
+    coords.resize(n_nodes);
+    {
+        uint64_t last_osmid = 0;
+        Coordinates last = {0, 0};
+        for (uint32_t u = 0; u < n_nodes; u++)
+        {
+            int64_t delta;
+            serializer.ReadVarInt(&delta);
+            last_osmid += delta;
+            serializer.ReadVarInt(&delta);
+            last.lat_e7 += (int32_t)delta;
+            serializer.ReadVarInt(&delta);
+            last.lon_e7 += (int32_t)delta;
+            osmids[u] = last_osmid;
+            coords[u] = last;
+        }
+    }
+
+    first_out.resize(n_nodes + 1);
+    targets.resize(n_edges);
+    weights.resize(n_edges);
+
+    uint32_t e = 0;
+    first_out[0] = 0;
+    for (uint32_t u = 0; u < n_nodes; u++)
+    {
+        int64_t degree;
+        serializer.ReadVarInt(&degree);
+        if (degree < 0 || degree > n_edges - e)
+            return Fail();
+        for (int64_t i = 0; i < degree; i++, e++)
+        {
+            int64_t value;
+            serializer.ReadVarInt(&value);
+            const int64_t target = u + value;
+            if (target < 0 || target >= n_nodes)
+                return Fail();
+            targets[e] = (uint32_t)target;
+            serializer.ReadVarInt(&value);
+            weights[e] = (uint32_t)value;
+        }
+        first_out[u + 1] = e;
+    }
+    if (e != n_edges)
+        return Fail();
+
+    BuildReverse();
+    return true;
+}
@@ -0,0 +1,416 @@
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include "road_graph.cpp"
+#include "turn_restrictions.cpp"
+
+using namespace std;
+
+static const uint32_t INFINITE_DISTANCE = UINT32_MAX;
+
+// Min heap with 4 children per node, entries are never decreased in place.
+// A node is pushed again whenever its distance improves and the stale entries
+// are skipped when they are popped, which is cheaper than tracking positions.
+struct QueryHeap
+{
+    static const uint32_t ARITY = 4;
+
+    struct Entry
+    {
+        uint32_t key;
+        uint32_t node;
+    };
+
+    vector<Entry> entries;
+
+    bool Empty() const
+    {
+        return entries.empty();
+    }
+
+    uint32_t MinKey() const
+    {
+        return entries.empty() ? INFINITE_DISTANCE : entries[0].key;
+    }
+
+    void Clear(void)
+    {
+        entries.clear();
+    }
+
+    void Push(uint32_t key, uint32_t node)
+    {
+        uint32_t i = (uint32_t)entries.size();
+        entries.push_back({key, node});
+
+        while (i > 0)
+        {
+            const uint32_t parent = (i - 1) / ARITY;
+            if (entries[parent].key <= key)
+                break;
+            entries[i] = entries[parent];
+            i = parent;
+        }
+        entries[i] = {key, node};
+    }
+
+    Entry Pop(void)
+    {
+        const Entry top = entries[0];
+        const Entry last = entries.back();
+        entries.pop_back();
+
+        const uint32_t n = (uint32_t)entries.size();
+        if (n)
+        {
+            uint32_t i = 0;
+            for (;;)
+            {
+                const uint32_t first_child = i * ARITY + 1;
+                if (first_child >= n)
+                    break;
+
+                uint32_t best = first_child;
+                const uint32_t end_child = min(first_child + ARITY, n);
+                for (uint32_t c = first_child + 1; c < end_child; c++)
+                {
+                    if (entries[c].key < entries[best].key)
+                        best = c;
+                }
+
+                if (last.key <= entries[best].key)
+                    break;
+                entries[i] = entries[best];
+                i = best;
+            }
+            entries[i] = last;
+        }
+
+        return top;
+    }
+};
+
+// Per node search state which is reused from query to query.
+// Instead of clearing the arrays every query bumps the stamp, an entry is
+// only valid if its stamp matches, so a query only touches what it reaches.
+struct QueryWorkspace
+{
+    vector<uint32_t> distance;
+    vector<uint32_t> parent;
+    vector<uint32_t> stamp;
+    /// A* lower bound to the target, computed once per query and node
+    vector<uint32_t> heuristic;
+    vector<uint32_t> heuristic_stamp;
+
+    QueryHeap heap;
+    uint32_t current_stamp = 0;
+
+    /// prepares the workspace for a new query on a graph with n_nodes nodes.
+    /// The arrays only grow, so node based and turn aware queries, which have
+    /// more states than nodes, can take turns on one workspace.
+    void Reset(uint32_t n_nodes)
+    {
+        if (stamp.size() < n_nodes)
+        {
+            distance.resize(n_nodes);
+            parent.resize(n_nodes);
+            stamp.assign(n_nodes, 0);
+            heuristic.resize(n_nodes);
+            heuristic_stamp.assign(n_nodes, 0);
+            current_stamp = 0;
+        }
+
+        // after a wrap around old stamps could match again
+        if (++current_stamp == 0)
+        {
+            fill(stamp.begin(), stamp.end(), 0);
+            fill(heuristic_stamp.begin(), heuristic_stamp.end(), 0);
+            current_stamp = 1;
+        }
+
+        heap.Clear();
+    }
+
+    bool Reached(uint32_t node) const
+    {
+        return stamp[node] == current_stamp;
+    }
+
+    uint32_t Distance(uint32_t node) const
+    {
+        return Reached(node) ? distance[node] : INFINITE_DISTANCE;
+    }
+
+    void Set(uint32_t node, uint32_t dist, uint32_t from)
+    {
+        stamp[node] = current_stamp;
+        distance[node] = dist;
+        parent[node] = from;
+    }
+};
+
+/// The workspace of the calling thread, so concurrent queries never share state
+inline QueryWorkspace& ThreadQueryWorkspace(int which = 0)
+{
+    static thread_local QueryWorkspace workspaces[2];
+    return workspaces[which];
+}
+
+struct RouteResult
+{
+    /// in the unit of the edge weights, INFINITE_DISTANCE if unreachable
+    uint32_t distance = INFINITE_DISTANCE;
+    /// graph nodes from source to target
+    vector<uint32_t> path;
+    /// number of nodes taken from the heap, to compare the algorithms
+    uint32_t settled = 0;
+
+    bool Found() const
+    {
+        return distance != INFINITE_DISTANCE;
+    }
+};
+
+// Point to point shortest paths on a RoadGraph.
+// Sources and targets are graph node ids, see RoadGraph::FindNode.
+struct RouteQuery
+{
+    const RoadGraph& graph;
+
+    RouteQuery(const RoadGraph& graph) : graph(graph) {}
+
+    RouteResult Dijkstra(uint32_t source, uint32_t target,
+                         QueryWorkspace& ws = ThreadQueryWorkspace()) const
+    {
+        return Search<false>(source, target, ws);
+    }
+
+    /// Dijkstra guided by the great circle distance to the target,
+    /// which is never longer than the road distance nor faster to travel.
+    RouteResult AStar(uint32_t source, uint32_t target,
+                      QueryWorkspace& ws = ThreadQueryWorkspace()) const
+    {
+        return Search<true>(source, target, ws);
+    }
+
+    /// Searches forward from the source and backward from the target at the same time
+    RouteResult Bidirectional(uint32_t source, uint32_t target,
+                              QueryWorkspace& forward = ThreadQueryWorkspace(0),
+                              QueryWorkspace& backward = ThreadQueryWorkspace(1)) const;
+
+    /// Dijkstra which only takes the turns the restrictions allow.
+    /// The graph is only turn expanded where it has to be: next to the plain node states
+    /// there is one state per arrival, which is the via node entered over the edge a
+    /// restriction starts with. Every other node keeps a single state, so the search
+    /// settles barely more states than a node based one.
+    RouteResult TurnAware(uint32_t source, uint32_t target, const TurnRestrictions& restrictions,
+                          QueryWorkspace& ws = ThreadQueryWorkspace()) const;
+
+private:
+    uint32_t LowerBound(uint32_t node, uint32_t target, QueryWorkspace& ws) const
+    {
+        if (ws.heuristic_stamp[node] != ws.current_stamp)
+        {
+            // rounded down while the edge weights are rounded up (see RoadGraph::TravelTime),
+            // so the bound never exceeds the weight of any path to the target.
+            // Travel times are bounded by going straight at the fastest speed
+            const double meters = HaversineMeters(graph.coords[node], graph.coords[target]);
+            ws.heuristic[node] = graph.max_speed_kmh ? (uint32_t)(meters * 36.0 / graph.max_speed_kmh)
+                                                     : (uint32_t)(meters * 10.0);
+            ws.heuristic_stamp[node] = ws.current_stamp;
+        }
+        return ws.heuristic[node];
+    }
+
+    template <bool guided>
+    RouteResult Search(uint32_t source, uint32_t target, QueryWorkspace& ws) const;
+
+    static void UnpackPath(const QueryWorkspace& ws, uint32_t source, uint32_t node, vector<uint32_t>& path)
+    {
+        for (; node != source; node = ws.parent[node])
+            path.push_back(node);
+        path.push_back(source);
+    }
+};
+
+template <bool guided>
+RouteResult RouteQuery::Search(uint32_t source, uint32_t target, QueryWorkspace& ws) const
+{
+    RouteResult result;
+    ws.Reset(graph.NodeCount());
+
+    ws.Set(source, 0, source);
+    ws.heap.Push(guided ? LowerBound(source, target, ws) : 0, source);
+
+    while (!ws.heap.Empty())
+    {
+        const auto top = ws.heap.Pop();
+        const uint32_t u = top.node;
+        const uint32_t dist_u = ws.distance[u];
+
+        // stale entry, u was pushed again with a shorter distance
+        if (top.key != dist_u + (guided ? LowerBound(u, target, ws) : 0))
+            continue;
+
+        result.settled++;
+        if (u == target)
+        {
+            result.distance = dist_u;
+            UnpackPath(ws, source, target, result.path);
+            reverse(result.path.begin(), result.path.end());
+            break;
+        }
+
+        for (uint32_t e = graph.first_out[u]; e < graph.first_out[u + 1]; e++)
+        {
+            const uint32_t v = graph.targets[e];
+            const uint32_t dist_v = dist_u + graph.weights[e];
+            if (dist_v < ws.Distance(v))
+            {
+                ws.Set(v, dist_v, u);
+                ws.heap.Push(dist_v + (guided ? LowerBound(v, target, ws) : 0), v);
+            }
+        }
+    }
+
+    return result;
+}
+
+RouteResult RouteQuery::Bidirectional(uint32_t source, uint32_t target,
+                                      QueryWorkspace& forward, QueryWorkspace& backward) const
+{
+    assert(&forward != &backward);
+
+    RouteResult result;
+    forward.Reset(graph.NodeCount());
+    backward.Reset(graph.NodeCount());
+
+    forward.Set(source, 0, source);
+    forward.heap.Push(0, source);
+    backward.Set(target, 0, target);
+    backward.heap.Push(0, target);
+
+    uint32_t best = (source == target) ? 0 : INFINITE_DISTANCE;
+    uint32_t meeting = source;
+
+    // once the two smallest keys add up to the best connection nothing shorter can be found
+    while (!forward.heap.Empty() || !backward.heap.Empty())
+    {
+        const uint64_t min_f = forward.heap.MinKey();
+        const uint64_t min_b = backward.heap.MinKey();
+        if (min_f + min_b >= best)
+            break;
+
+        // expand the side with the smaller frontier key
+        const bool is_forward = min_f <= min_b;
+        QueryWorkspace& ws = is_forward ? forward : backward;
+        const QueryWorkspace& other = is_forward ? backward : forward;
+
+        const auto top = ws.heap.Pop();
+        const uint32_t u = top.node;
+        if (top.key != ws.distance[u])
+            continue;
+        result.settled++;
+
+        const auto& first = is_forward ? graph.first_out : graph.first_in;
+        const auto& heads = is_forward ? graph.targets : graph.sources;
+        const auto& edge_weights = is_forward ? graph.weights : graph.in_weights;
+
+        for (uint32_t e = first[u]; e < first[u + 1]; e++)
+        {
+            const uint32_t v = heads[e];
+            const uint32_t dist_v = top.key + edge_weights[e];
+            if (dist_v < ws.Distance(v))
+            {
+                ws.Set(v, dist_v, u);
+                ws.heap.Push(dist_v, v);
+            }
+
+            if (other.Reached(v))
+            {
+                const uint64_t through = (uint64_t)ws.distance[v] + other.distance[v];
+                if (through < best)
+                {
+                    best = (uint32_t)through;
+                    meeting = v;
+                }
+            }
+        }
+    }
+
+    if (best == INFINITE_DISTANCE)
+        return result;
+
+    result.distance = best;
+    UnpackPath(forward, source, meeting, result.path);
+    reverse(result.path.begin(), result.path.end());
+    // the backward parents lead from the meeting node on to the target
+    for (uint32_t node = meeting; node != target; )
+    {
+        node = backward.parent[node];
+        result.path.push_back(node);
+    }
+
+    return result;
+}
+
+RouteResult RouteQuery::TurnAware(uint32_t source, uint32_t target, const TurnRestrictions& restrictions,
+                                  QueryWorkspace& ws) const
+{
+    const uint32_t n_nodes = graph.NodeCount();
+    assert(restrictions.first_arrival.size() == n_nodes + 1);
+
+    // states below n_nodes are nodes, n_nodes + a is arrival a
+    auto NodeOf = [&] (uint32_t state) {
+        return (state < n_nodes) ? state : restrictions.arrival_via[state - n_nodes];
+    };
+
+    RouteResult result;
+    ws.Reset(n_nodes + restrictions.ArrivalCount());
+
+    ws.Set(source, 0, source);
+    ws.heap.Push(0, source);
+
+    while (!ws.heap.Empty())
+    {
+        const auto top = ws.heap.Pop();
+        const uint32_t s = top.node;
+        if (top.key != ws.distance[s])
+            continue;
+
+        result.settled++;
+        const uint32_t u = NodeOf(s);
+        if (u == target)
+        {
+            result.distance = top.key;
+            for (uint32_t state = s; state != source; state = ws.parent[state])
+                result.path.push_back(NodeOf(state));
+            result.path.push_back(source);
+            reverse(result.path.begin(), result.path.end());
+            break;
+        }
+
+        const uint32_t arrival = (s < n_nodes) ? 0 : s - n_nodes + 1;
+        for (uint32_t e = graph.first_out[u]; e < graph.first_out[u + 1]; e++)
+        {
+            const uint32_t v = graph.targets[e];
+            if (arrival && !restrictions.Allowed(arrival - 1, v))
+                continue;
+
+            const uint32_t next_arrival = restrictions.FindArrival(u, v);
+            const uint32_t state_v = next_arrival ? n_nodes + next_arrival - 1 : v;
+            const uint32_t dist_v = top.key + graph.weights[e];
+            if (dist_v < ws.Distance(state_v))
+            {
+                ws.Set(state_v, dist_v, s);
+                ws.heap.Push(dist_v, state_v);
+            }
+        }
+    }
+
+    return result;
+}
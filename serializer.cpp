@@ -3,8 +3,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <vector>
 
-#define FLAG_NO_CRC32 (1 << 2);
+#define FLAG_NO_CRC32 (1 << 2)
+/// the file ends in a section directory, the crc in the header only covers the directory
+#define FLAG_SECTIONS (1 << 3)
 
 static const uint16_t g_flags = 0
 #ifdef NO_CRC32
@@ -24,14 +28,62 @@ static const uint16_t g_flags = 0
 #include "crc32.c"
 
 #endif
+#ifndef NO_CRC32
+/// crc32c takes a 32 bit length, sections and mappings may be larger
+static inline uint32_t crc32c_64(uint32_t crc, const uint8_t* data, uint64_t length)
+{
+    const uint64_t CHUNK = (1u << 30);
+    for (; length > CHUNK; data += CHUNK, length -= CHUNK)
+        crc = crc32c(crc, data, CHUNK);
+    return crc32c(crc, data, (uint32_t)length);
+}
+#endif
+
 #ifdef HAD_TEST_MAIN_SERIALIZER
 # pragma message("Runninng tests")
 # define TEST_MAIN
 #endif
 
+/// the crc32c of the section was not computed
+#define SECTION_FLAG_NO_CRC32 (1 << 0)
+
+static const uint32_t SECTION_DIRECTORY_VERSION = 1;
+
+// An entry of the section directory at the end of a sectioned file.
+// The directory is "OSMs", its version, the number of entries, 4 reserved bytes
+// and the entries, followed by its U64 offset as the last 8 bytes of the file.
+struct SectionEntry
+{
+    uint32_t id;
+    /// SECTION_FLAG_*
+    uint32_t flags;
+    uint64_t offset;
+    uint64_t length;
+    /// like the crc in the file header, without the final inversion
+    uint32_t crc32c;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(SectionEntry) == 32, "SectionEntry is stored as it is");
+
+// A section encoded into memory instead of the file, so the sections of a file can be
+// encoded on threads of their own. Serializer::WriteSection appends it to the file as it is,
+// its crc32c is computed while it is encoded and never again.
+struct EncodedSection
+{
+    uint32_t id;
+    /// SECTION_FLAG_*
+    uint32_t flags;
+    /// like the crc in the file header, without the final inversion
+    uint32_t crc32c;
+    std::vector<uint8_t> data;
+};
+
 struct Serializer
 {
-    enum class serialize_mode_t { Reading, Writing };
+    /// MappedReading maps the whole file, reads are pointer bumps over the mapping
+    /// and never call into the kernel. If the file cannot be mapped it reads like Reading.
+    enum class serialize_mode_t { Reading, Writing, MappedReading };
 
     FILE* fd;
     const char* m_filename;
@@ -43,30 +95,60 @@ struct Serializer
     uint64_t bytes_in_file      = 0;
     uint64_t position_in_file   = 0;
 
-    uint32_t position_in_buffer = 0;
-    uint32_t buffer_used        = 0;
+    uint64_t position_in_buffer = 0;
+    uint64_t buffer_used        = 0;
 
     static const int FLUSH_GRANULARITY = 4096;
     static const int BUFFER_SIZE       = (FLUSH_GRANULARITY * 2);
 
     uint8_t buffer[BUFFER_SIZE];
 
+    /// what the readers decode from, buffer or the whole mapped file
+    const uint8_t* read_buffer = buffer;
+    const uint8_t* map = nullptr;
+
     uint32_t r_invCrc; // reader only
 
+    /// empty unless the file is sectioned, see BeginSection
+    std::vector<SectionEntry> sections;
+    /// index in sections of the one being written or read, -1 for none
+    int32_t current_section = -1;
+    /// the reader never buffers beyond this, the end of the current section or of the file
+    uint64_t read_limit = 0;
+
+    /// where a Serializer constructed for a section flushes to instead of fd
+    EncodedSection* encoded_section = nullptr;
+
+    /// set once a ReadU8/U32/U64/F64 ran past the end of the mapping, that read returned 0
+    bool read_past_end = false;
+
 private:
     uint32_t ReadFlush(void);
     uint32_t WriteFlush(void);
+    bool EnsureReadable(uint32_t size);
+
+    SectionEntry& AddSection(uint32_t id, uint32_t flags);
+    void ReadSectionDirectory(uint16_t flags, uint32_t header_crc);
+    void WriteSectionDirectory(void);
+    void CheckSectionCrc(const SectionEntry& entry, uint32_t section_crc);
 
 public:
     Serializer(const char* filename, serialize_mode_t mode);
+    /// writes into section->data, positions start at 0 and there is no header.
+    /// The crc32c of the section is set once the Serializer is destroyed.
+    Serializer(EncodedSection* section);
     ~Serializer();
 
     /// returns the current virtual cursor in the file.
-    uint32_t CurrentPosition(void);
+    uint64_t CurrentPosition(void);
 
     /// sets the serializer to a virtual cursor in the file
     /// Returns: the position it came from
-    uint32_t SetPosition(uint32_t position);
+    uint64_t SetPosition(uint64_t position);
+
+    /// the bytes from the cursor to the end of the section being read, or of the file.
+    /// Loaders bound the counts they read by it before they allocate for them
+    uint64_t BytesLeft(void);
 
     /// Returns number of bytes read. 0 means error.
     uint8_t ReadShortUint(uint32_t* value);
@@ -80,6 +162,13 @@ public:
     /// Returns number of bytes written. 0 means error.
     uint8_t WriteShortInt(int32_t value);
 
+    /// zigzag + LEB128 encoding of the full 64bit range
+    /// Returns number of bytes read. 0 means error.
+    uint8_t ReadVarInt(int64_t* value);
+
+    /// Returns number of bytes written.
+    uint8_t WriteVarInt(int64_t value);
+
 
     /// May not write all the data in one go
     /// use in a loop or via the WRITE_ARRAY_DATA_SIZE macro
@@ -91,6 +180,31 @@ public:
     /// Returns the number of bytes read
     uint32_t ReadRawData(void* data, uint32_t size);
 
+    /// MappedReading only: skips over the next size bytes and returns them in place.
+    /// They stay valid as long as the Serializer lives.
+    /// Returns nullptr, without moving on, if fewer than size bytes are left.
+    const void* ReadRawSpan(uint64_t size);
+
+    bool IsMapped(void) const { return map != nullptr; }
+
+    /// Everything written between BeginSection and EndSection becomes a section with its
+    /// own offset, length and crc32c in the directory written at the end of the file.
+    /// Sections follow each other from the header on, a sectioned file is never patched
+    /// with SetPosition, so its crcs are always computed on the way out.
+    void BeginSection(uint32_t id, uint32_t flags = 0);
+    void EndSection(void);
+
+    /// appends a section which was encoded separately, with the crc32c it came with
+    void WriteSection(const EncodedSection& section);
+
+    /// Returns nullptr if there is no such section
+    const SectionEntry* FindSection(uint32_t id) const;
+
+    /// Jumps to the beginning of the section and checks its crc32c,
+    /// the mapped reader right away, the buffered one once it has read the whole section.
+    /// Returns false if there is no such section.
+    bool ReadSection(uint32_t id);
+
     uint32_t ReadU32(void);
     void WriteU32(uint32_t value);
 
@@ -138,48 +252,93 @@ public:
         assert(bytes_left == 0); \
     }
 
-uint32_t Serializer::CurrentPosition(void)
+uint64_t Serializer::CurrentPosition(void)
 {
     return position_in_file - (buffer_used - position_in_buffer);
     //(position_in_file - buffer_used) + position_in_buffer;
 }
 
+uint64_t Serializer::BytesLeft(void)
+{
+    const uint64_t end = current_section != -1
+        ? sections[current_section].offset + sections[current_section].length
+        : bytes_in_file;
+    const uint64_t position = CurrentPosition();
+    return position < end ? end - position : 0;
+}
+
 //TODO patching a file using SetPosition invalidates incremental crc
 // therefore once it is used we disable incremental crc and do
 // a full crc at the end
-uint32_t Serializer::SetPosition(uint32_t p) {
+// A reader keeps its crc as long as it stays within what it has buffered,
+// the crc covers the file up to position_in_file either way.
+// Jumping anywhere else disables it, the mapped reader checks the whole mapping anyhow.
+uint64_t Serializer::SetPosition(uint64_t p) {
+    const auto oldP = CurrentPosition();
+
+    if (m_mode != serialize_mode_t::Writing) {
+        assert(p >= 16 && p <= bytes_in_file);
+
+        if (current_section != -1)
+        {
+            const auto& entry = sections[current_section];
+            if (p < entry.offset || p > entry.offset + entry.length)
+            {
+                // the buffer only ever holds bytes of the section, so p is not in there
+                current_section = -1;
+                read_limit = bytes_in_file;
+            }
+        }
+
+        const auto buffer_begin = position_in_file - buffer_used;
+        if (p >= buffer_begin && p <= position_in_file)
+        {
+            position_in_buffer = p - buffer_begin;
+        }
+        else
+        {
+            // disable crc
+            crc = invCrc = 0;
+
+            fseeko(fd, p, SEEK_SET);
+            position_in_file = p;
+            position_in_buffer = buffer_used = 0;
+        }
+        assert(CurrentPosition() == p);
+
+        return oldP;
+    }
+
+    // the crcs of the sections are final
+    assert(sections.empty() && !encoded_section);
+
     // disable crc
     crc = invCrc = 0;
 
-    const auto oldP = CurrentPosition();
     // flush out the whole buffer if writing
+    while(WriteFlush()) {}
 
-    if (m_mode == serialize_mode_t::Writing) {
-        while(WriteFlush()) {}
-
-        assert(position_in_buffer == 0);
-        assert(buffer_used == 0);
-        // after flushing the whole buffer the cursor should be at the start
-        assert(position_in_file == oldP);
-        // and the position in the file sould be equal to our previous virtual position
-        fseek(fd, p, SEEK_SET);
-        position_in_file = p;
-    } else {
-        assert(!"TODO");
-    }
+    assert(position_in_buffer == 0);
+    assert(buffer_used == 0);
+    // after flushing the whole buffer the cursor should be at the start
+    assert(position_in_file == oldP);
+    // and the position in the file sould be equal to our previous virtual position
+    fseeko(fd, p, SEEK_SET);
+    position_in_file = p;
 
     return oldP;
 }
 
 uint32_t Serializer::ReadFlush (void) {
+    assert(!map); // the mapping is never refilled
     assert(buffer_used >= position_in_buffer); // general invariant
 
-    const uint64_t bytes_available = bytes_in_file - position_in_file;
+    const uint64_t bytes_available = read_limit - position_in_file;
     const auto old_bytes_in_buffer = buffer_used - position_in_buffer;
 
     // assert(bytes_available > 0);
 
-    uint32_t size_to_read = BUFFER_SIZE - buffer_used;
+    uint32_t size_to_read = BUFFER_SIZE - old_bytes_in_buffer;
     if (bytes_available < size_to_read)
         size_to_read = bytes_available;
 
@@ -200,9 +359,33 @@ uint32_t Serializer::ReadFlush (void) {
 
     position_in_file += size_to_read;
 
+#ifndef NO_CRC32
+    // all of the section went through the crc
+    if (current_section != -1 && position_in_file == read_limit && crc != invCrc)
+    {
+        CheckSectionCrc(sections[current_section], crc);
+        crc = invCrc = 0;
+    }
+#endif
+
     return size_to_read;
 }
 
+// Makes size bytes available to a fixed size read. The mapping is never refilled,
+// a read past its end is refused instead of reaching ReadFlush
+bool Serializer::EnsureReadable (uint32_t size) {
+    if (buffer_used - position_in_buffer >= size)
+        return true;
+
+    if (map)
+    {
+        read_past_end = true;
+        return false;
+    }
+    ReadFlush();
+    return true;
+}
+
 uint32_t Serializer::WriteFlush (void) {
     assert(m_mode == serialize_mode_t::Writing);
 
@@ -216,7 +399,10 @@ uint32_t Serializer::WriteFlush (void) {
         invCrc = ~crc;
     }
 #endif
-    fwrite(buffer, 1, bytes_to_flush, fd);
+    if (encoded_section)
+        encoded_section->data.insert(encoded_section->data.end(), buffer, buffer + bytes_to_flush);
+    else
+        fwrite(buffer, 1, bytes_to_flush, fd);
 
     position_in_file += bytes_to_flush;
     position_in_buffer -= bytes_to_flush;
@@ -255,50 +441,111 @@ Serializer::Serializer(const char* filename, serialize_mode_t mode) :
             // NOTE: crc is not valid yet we just write it as a place_holder
             fwrite(&crc, sizeof(crc), 1, fd);
             fwrite(&invCrc, sizeof(invCrc), 1, fd);
-            assert(ftell(fd) == 16);
+            assert(ftello(fd) == 16);
 
             position_in_file = 16;
         }
         else
         {
-            fseek(fd, 0, SEEK_END);
-            bytes_in_file = ftell(fd);
-            fseek(fd, 0, SEEK_SET);
+            fseeko(fd, 0, SEEK_END);
+            bytes_in_file = ftello(fd);
+            fseeko(fd, 0, SEEK_SET);
+
+            if (mode == serialize_mode_t::MappedReading && bytes_in_file >= 16)
+            {
+                void* p = mmap(nullptr, bytes_in_file, PROT_READ, MAP_PRIVATE, fileno(fd), 0);
+                if (p != MAP_FAILED)
+                {
+                    map = (const uint8_t*)p;
+                    madvise(p, bytes_in_file, MADV_SEQUENTIAL);
+                }
+                else
+                {
+                    perror("Serializer() mmap");
+                    m_mode = serialize_mode_t::Reading;
+                }
+            }
 
-            int bytes_read = 0;
+            uint8_t header[16];
+            if (map)
+                memcpy(header, map, sizeof(header));
+            else if (fread(header, 1, sizeof(header), fd) != sizeof(header))
+                memset(header, 0, sizeof(header));
 
             char magic[4];
-            bytes_read += fread(&magic, 1, sizeof(magic), fd);
+            memcpy(&magic, header + 0, sizeof(magic));
 
             uint16_t versionNumber;
-            bytes_read += fread(&versionNumber, 1, sizeof(versionNumber), fd);
+            memcpy(&versionNumber, header + 4, sizeof(versionNumber));
 
             uint16_t flags;
-            bytes_read += fread(&versionNumber, 1, sizeof(flags), fd);
+            memcpy(&flags, header + 6, sizeof(flags));
 
             uint32_t r_crc;
-            bytes_read += fread(&r_crc, 1, sizeof(r_crc), fd);
+            memcpy(&r_crc, header + 8, sizeof(r_crc));
 
-            bytes_read += fread(&r_invCrc, 1, sizeof(r_invCrc), fd);
+            memcpy(&r_invCrc, header + 12, sizeof(r_invCrc));
             if(r_crc != ~r_invCrc)
             {
                 printf("read crc %x and invCrc %x \n", r_crc, r_invCrc);
                 fprintf(stderr, "initial CRC check failed ... file '%s' is corrupted\n", m_filename);
                 abort();
             }
-
-            position_in_file = bytes_read;
-            assert(ftell(fd) == 16 && position_in_file == 16);
             assert(0 == memcmp(&magic, "OSMb", 4));
+
+            read_limit = bytes_in_file;
+            if (flags & FLAG_SECTIONS)
+            {
+                ReadSectionDirectory(flags, r_crc);
+                // the bytes outside of the sections are covered by nothing
+                crc = invCrc = 0;
+            }
+
+            if (map)
+            {
+                // the whole file is the buffer, nothing is left to flush
+                read_buffer = map;
+                buffer_used = bytes_in_file;
+                position_in_buffer = 16;
+                position_in_file = bytes_in_file;
+            }
+            else
+            {
+                position_in_file = 16;
+                assert(ftello(fd) == 16);
+            }
         }
     }
 }
 
+Serializer::Serializer(EncodedSection* section) :
+    fd(nullptr), m_filename("<section>"), m_mode(serialize_mode_t::Writing),
+    crc(~0), invCrc(0), encoded_section(section) {
+    section->data.clear();
+}
+
 Serializer::~Serializer() {
+    if (encoded_section)
+    {
+        while(WriteFlush()) {}
+        encoded_section->crc32c = crc;
+#ifdef NO_CRC32
+        encoded_section->flags |= SECTION_FLAG_NO_CRC32;
+#endif
+        return;
+    }
+
     // TODO maybe pad the file to a multiple of 4?
-    if (m_mode == serialize_mode_t::Writing)
+    if (m_mode == serialize_mode_t::Writing && !sections.empty())
     {
-        WriteFlush();
+        assert(current_section == -1);
+        while(WriteFlush()) {}
+
+        WriteSectionDirectory();
+    }
+    else if (m_mode == serialize_mode_t::Writing)
+    {
+        while(WriteFlush()) {}
 
 #ifndef NO_CRC32
         if (crc == invCrc)
@@ -308,7 +555,7 @@ Serializer::~Serializer() {
 
             // incremental crc was disabled
             // we have to do the whole thing now
-            if (fseek(fd, 16, SEEK_SET))
+            if (fseeko(fd, 16, SEEK_SET))
                 if (ferror(fd))
                     perror("seeking");
 
@@ -329,42 +576,259 @@ Serializer::~Serializer() {
         }
 
         {
-            fseek(fd, 8, SEEK_SET);
+            fseeko(fd, 8, SEEK_SET);
             fwrite(&crc, 1, sizeof(crc), fd);
             uint32_t invCrc_ = ~crc;
             fwrite(&invCrc_, 1, sizeof(invCrc_), fd);
         }
 #endif
     }
-    if (m_mode == serialize_mode_t::Reading)
+    if (m_mode == serialize_mode_t::Reading && sections.empty())
     {
-        assert(position_in_file == bytes_in_file);
-#ifndef NO_CRC32
         if (crc == invCrc)
         {
-            //TODO recalc crc
+            // SetPosition skipped over parts of the file, they never were checked
         }
         else
         {
+            assert(position_in_file == bytes_in_file);
+#ifndef NO_CRC32
+            assert(~crc == r_invCrc);
+#endif
+        }
+    }
+    if (map)
+    {
+#ifndef NO_CRC32
+        // the whole file is at hand, no matter how much of it was read
+        if (sections.empty())
+        {
+            crc = crc32c_64(~0, map + 16, bytes_in_file - 16);
             assert(~crc == r_invCrc);
         }
 #endif
+        munmap((void*)map, bytes_in_file);
     }
     fclose(fd);
 }
 
+SectionEntry& Serializer::AddSection(uint32_t id, uint32_t flags) {
+    assert(m_mode == serialize_mode_t::Writing && !encoded_section);
+    assert(current_section == -1);
+    assert(!FindSection(id));
+
+    // starting on an empty buffer the crc covers exactly the bytes of the section
+    while(WriteFlush()) {}
+
+    const uint64_t offset = CurrentPosition();
+    // no gaps, the directory covers every byte through the crcs of the sections
+    assert(offset == (sections.empty() ? 16 : sections.back().offset + sections.back().length));
+#ifdef NO_CRC32
+    flags |= SECTION_FLAG_NO_CRC32;
+#endif
+    sections.push_back({id, flags, offset, 0, 0, 0});
+    return sections.back();
+}
+
+void Serializer::BeginSection(uint32_t id, uint32_t flags) {
+    AddSection(id, flags);
+    current_section = (int32_t)sections.size() - 1;
+
+    crc = ~0;
+    invCrc = 0;
+}
+
+void Serializer::WriteSection(const EncodedSection& section) {
+    auto& entry = AddSection(section.id, section.flags);
+    entry.length = section.data.size();
+    entry.crc32c = section.crc32c;
+
+    fwrite(section.data.data(), 1, section.data.size(), fd);
+    position_in_file += section.data.size();
+
+    // nothing outside of the sections is covered
+    crc = invCrc = 0;
+}
+
+void Serializer::EndSection(void) {
+    assert(m_mode == serialize_mode_t::Writing);
+    assert(current_section != -1);
+
+    while(WriteFlush()) {}
+
+    auto& entry = sections[current_section];
+    entry.length = CurrentPosition() - entry.offset;
+    entry.crc32c = crc;
+
+    crc = invCrc = 0;
+    current_section = -1;
+}
+
+const SectionEntry* Serializer::FindSection(uint32_t id) const {
+    for (const auto& entry : sections)
+    {
+        if (entry.id == id)
+            return &entry;
+    }
+    return nullptr;
+}
+
+bool Serializer::ReadSection(uint32_t id) {
+    assert(m_mode != serialize_mode_t::Writing);
+
+    const auto entry = FindSection(id);
+    if (!entry)
+        return false;
+
+    if (map)
+    {
+#ifndef NO_CRC32
+        CheckSectionCrc(*entry, crc32c_64(~0, map + entry->offset, entry->length));
+#endif
+        SetPosition(entry->offset);
+    }
+    else
+    {
+        // starting on an empty buffer the crc covers exactly the bytes of the section
+        fseeko(fd, entry->offset, SEEK_SET);
+        position_in_file = entry->offset;
+        position_in_buffer = buffer_used = 0;
+        read_limit = entry->offset + entry->length;
+
+        crc = ~0;
+        invCrc = 0;
+    }
+    current_section = (int32_t)(entry - sections.data());
+
+    return true;
+}
+
+void Serializer::CheckSectionCrc(const SectionEntry& entry, uint32_t section_crc) {
+    if (entry.flags & SECTION_FLAG_NO_CRC32)
+        return;
+
+    if (section_crc != entry.crc32c)
+    {
+        printf("read crc %x expected %x \n", section_crc, entry.crc32c);
+        fprintf(stderr, "CRC check of section %u failed ... file '%s' is corrupted\n", entry.id, m_filename);
+        abort();
+    }
+}
+
+void Serializer::WriteSectionDirectory(void) {
+    const uint64_t directory_offset = position_in_file;
+
+    std::vector<uint8_t> directory(16 + sections.size() * sizeof(SectionEntry));
+    const uint32_t n_sections = sections.size();
+    memcpy(directory.data() + 0, "OSMs", 4);
+    memcpy(directory.data() + 4, &SECTION_DIRECTORY_VERSION, 4);
+    memcpy(directory.data() + 8, &n_sections, 4);
+    memset(directory.data() + 12, 0, 4);
+    memcpy(directory.data() + 16, sections.data(), sections.size() * sizeof(SectionEntry));
+
+    fwrite(directory.data(), 1, directory.size(), fd);
+    fwrite(&directory_offset, 1, sizeof(directory_offset), fd);
+    position_in_file += directory.size() + sizeof(directory_offset);
+
+    {
+        fseeko(fd, 6, SEEK_SET);
+        const uint16_t flags = g_flags | FLAG_SECTIONS;
+        fwrite(&flags, 1, sizeof(flags), fd);
+    }
+#ifndef NO_CRC32
+    {
+        crc = crc32c(~0, directory.data(), directory.size());
+        fwrite(&crc, 1, sizeof(crc), fd);
+        uint32_t invCrc_ = ~crc;
+        fwrite(&invCrc_, 1, sizeof(invCrc_), fd);
+    }
+#endif
+}
+
+void Serializer::ReadSectionDirectory(uint16_t flags, uint32_t header_crc) {
+    uint64_t directory_offset = 0;
+    if (bytes_in_file >= 16 + 16 + sizeof(directory_offset))
+    {
+        if (map)
+            memcpy(&directory_offset, map + bytes_in_file - sizeof(directory_offset), sizeof(directory_offset));
+        else if (fseeko(fd, bytes_in_file - sizeof(directory_offset), SEEK_SET)
+            || fread(&directory_offset, 1, sizeof(directory_offset), fd) != sizeof(directory_offset))
+            directory_offset = 0;
+    }
+
+    std::vector<uint8_t> directory;
+    if (directory_offset >= 16 && directory_offset + 16 + sizeof(directory_offset) <= bytes_in_file)
+    {
+        directory.resize(bytes_in_file - sizeof(directory_offset) - directory_offset);
+        if (map)
+            memcpy(directory.data(), map + directory_offset, directory.size());
+        else if (fseeko(fd, directory_offset, SEEK_SET)
+            || fread(directory.data(), 1, directory.size(), fd) != directory.size())
+            directory.clear();
+    }
+
+    uint32_t version = 0, n_sections = 0;
+    if (directory.size() >= 16)
+    {
+        memcpy(&version, directory.data() + 4, 4);
+        memcpy(&n_sections, directory.data() + 8, 4);
+    }
+
+    if (directory.size() < 16
+        || 0 != memcmp(directory.data(), "OSMs", 4)
+        || version != SECTION_DIRECTORY_VERSION
+        || directory.size() != 16 + (uint64_t)n_sections * sizeof(SectionEntry))
+    {
+        fprintf(stderr, "no valid section directory ... file '%s' is corrupted\n", m_filename);
+        abort();
+    }
+#ifndef NO_CRC32
+    // a writer without crcs left the placeholder in the header
+    if (!(flags & FLAG_NO_CRC32)
+        && crc32c(~0, directory.data(), directory.size()) != header_crc)
+    {
+        fprintf(stderr, "CRC check of the section directory failed ... file '%s' is corrupted\n", m_filename);
+        abort();
+    }
+#else
+    (void)flags;
+    (void)header_crc;
+#endif
+
+    sections.resize(n_sections);
+    memcpy(sections.data(), directory.data() + 16, n_sections * sizeof(SectionEntry));
+
+    // without the crc nothing else vouches for the entries, a section has to lie
+    // between the header and the directory or reading it would leave the file
+    for (const auto& entry : sections)
+    {
+        if (entry.offset < 16 || entry.offset > directory_offset
+            || entry.length > directory_offset - entry.offset)
+        {
+            fprintf(stderr, "section %u at %llu with %llu bytes is outside of the file ... file '%s' is corrupted\n",
+                entry.id, (unsigned long long)entry.offset, (unsigned long long)entry.length, m_filename);
+            abort();
+        }
+    }
+
+    if (!map)
+        fseeko(fd, 16, SEEK_SET);
+}
+
 uint8_t Serializer::ReadShortUint(uint32_t* ptr) {
     assert(position_in_buffer <= buffer_used);
 
     if ((buffer_used - position_in_buffer) < 4
-        && bytes_in_file - position_in_file > 0)
+        && read_limit - position_in_file > 0)
     {
         ReadFlush();
     }
 
+    const auto old_position_in_buffer = position_in_buffer;
+
     assert(buffer_used >= 1);
 
-    auto mem = buffer + position_in_buffer;
+    auto mem = read_buffer + position_in_buffer;
     const auto first_byte = *mem++;
     position_in_buffer++;
 
@@ -387,7 +851,7 @@ uint8_t Serializer::ReadShortUint(uint32_t* ptr) {
     }
 
     *ptr = value;
-    return (uint8_t)(buffer - mem);
+    return (uint8_t)(position_in_buffer - old_position_in_buffer);
 }
 
 uint8_t Serializer::WriteShortUint(uint32_t value) {
@@ -476,7 +940,7 @@ uint8_t Serializer::ReadShortInt(int32_t* ptr) {
     assert(position_in_buffer <= buffer_used);
 
     if ((buffer_used - position_in_buffer) < 4
-        && bytes_in_file - position_in_file > 0)
+        && read_limit - position_in_file > 0)
     {
         ReadFlush();
     }
@@ -485,7 +949,7 @@ uint8_t Serializer::ReadShortInt(int32_t* ptr) {
 
     assert(buffer_used >= 1);
 
-    auto mem = buffer + position_in_buffer;
+    auto mem = read_buffer + position_in_buffer;
     const auto first_byte = *mem++;
     position_in_buffer++;
 
@@ -518,6 +982,58 @@ uint8_t Serializer::ReadShortInt(int32_t* ptr) {
 }
 #undef ABS
 
+uint8_t Serializer::WriteVarInt(int64_t value) {
+    assert(m_mode == serialize_mode_t::Writing);
+
+    if (position_in_buffer >= FLUSH_GRANULARITY)
+    {
+        // try to flush in 4092 chunks
+        WriteFlush();
+    }
+
+    // zigzag: the sign goes into the lowest bit so small negative values stay short
+    uint64_t transformed_value = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+    uint8_t result = 0;
+
+    while (transformed_value >= 0x80)
+    {
+        buffer[position_in_buffer++] = (uint8_t)(transformed_value | 0x80);
+        transformed_value >>= 7;
+        result++;
+    }
+    buffer[position_in_buffer++] = (uint8_t)transformed_value;
+
+    return result + 1;
+}
+
+uint8_t Serializer::ReadVarInt(int64_t* ptr) {
+    assert(position_in_buffer <= buffer_used);
+
+    if ((buffer_used - position_in_buffer) < 10
+        && read_limit - position_in_file > 0)
+    {
+        ReadFlush();
+    }
+
+    const auto old_position_in_buffer = position_in_buffer;
+    uint64_t transformed_value = 0;
+
+    for (uint32_t shift = 0; shift < 64; shift += 7)
+    {
+        if (position_in_buffer >= buffer_used)
+            return 0;
+
+        const auto byte = read_buffer[position_in_buffer++];
+        transformed_value |= ((uint64_t)(byte & 0x7f) << shift);
+        if (!(byte & 0x80))
+            break;
+    }
+
+    *ptr = (int64_t)((transformed_value >> 1) ^ (~(transformed_value & 1) + 1));
+
+    return (uint8_t)(position_in_buffer - old_position_in_buffer);
+}
+
 uint32_t Serializer::WriteRawData(const void* data, uint32_t size) {
     assert(m_mode == serialize_mode_t::Writing);
 
@@ -535,7 +1051,18 @@ uint32_t Serializer::WriteRawData(const void* data, uint32_t size) {
 }
 
 uint32_t Serializer::ReadRawData(void* data, uint32_t size) {
-    assert(m_mode == serialize_mode_t::Reading);
+    assert(m_mode != serialize_mode_t::Writing);
+
+    if (map)
+    {
+        // everything is at hand, copy it in one go
+        if (size > buffer_used - position_in_buffer)
+            size = buffer_used - position_in_buffer;
+
+        memcpy(data, read_buffer + position_in_buffer, size);
+        position_in_buffer += size;
+        return size;
+    }
 
     if ((buffer_used - position_in_buffer) < FLUSH_GRANULARITY)
         ReadFlush();
@@ -549,23 +1076,31 @@ uint32_t Serializer::ReadRawData(void* data, uint32_t size) {
         size = bytes_avialable;
 
     // printf("position in buffer");
-    memcpy(data, buffer + position_in_buffer, size);
+    memcpy(data, read_buffer + position_in_buffer, size);
     position_in_buffer += size;
 
-    assert(position_in_buffer < BUFFER_SIZE);
+    assert(position_in_buffer <= BUFFER_SIZE);
 
     return size;
 }
 
+const void* Serializer::ReadRawSpan(uint64_t size) {
+    assert(map);
+    if (buffer_used - position_in_buffer < size)
+        return nullptr;
+
+    const void* result = read_buffer + position_in_buffer;
+    position_in_buffer += size;
+    return result;
+}
+
 uint32_t Serializer::ReadU32(void) {
-    assert(m_mode == serialize_mode_t::Reading);
+    assert(m_mode != serialize_mode_t::Writing);
 
-    if (buffer_used - position_in_buffer < 4)
-    {
-        ReadFlush();
-    }
+    if (!EnsureReadable(4))
+        return 0;
     assert(buffer_used - position_in_buffer >= 4);
-    uint32_t result =  (*(uint32_t*)(buffer + position_in_buffer));
+    uint32_t result =  (*(uint32_t*)(read_buffer + position_in_buffer));
     position_in_buffer += 4;
     return result;
 }
@@ -583,14 +1118,12 @@ void Serializer::WriteU32(uint32_t value) {
 }
 
 uint8_t Serializer::ReadU8(void) {
-    assert(m_mode == serialize_mode_t::Reading);
+    assert(m_mode != serialize_mode_t::Writing);
 
-    if (buffer_used - position_in_buffer < 1)
-    {
-        ReadFlush();
-    }
+    if (!EnsureReadable(1))
+        return 0;
     assert(buffer_used - position_in_buffer >= 1);
-    uint8_t result =  (*(uint8_t*)(buffer + position_in_buffer));
+    uint8_t result =  (*(uint8_t*)(read_buffer + position_in_buffer));
     position_in_buffer += 1;
     return result;
 }
@@ -608,15 +1141,13 @@ void Serializer::WriteU8(uint8_t value) {
 }
 
 uint64_t Serializer::ReadU64(void) {
-    assert(m_mode == serialize_mode_t::Reading);
+    assert(m_mode != serialize_mode_t::Writing);
 
-    if ((buffer_used - position_in_buffer) < 8)
-    {
-        ReadFlush();
-    }
+    if (!EnsureReadable(8))
+        return 0;
 
     assert(buffer_used - position_in_buffer >= 8);
-    uint64_t result =  (*(uint64_t*)(buffer + position_in_buffer));
+    uint64_t result =  (*(uint64_t*)(read_buffer + position_in_buffer));
     position_in_buffer += sizeof(result);
     return result;
 }
@@ -634,14 +1165,12 @@ void Serializer::WriteU64(uint64_t value) {
 }
 
 double Serializer::ReadF64(void) {
-    assert(m_mode == serialize_mode_t::Reading);
+    assert(m_mode != serialize_mode_t::Writing);
 
-    if (buffer_used - position_in_buffer < sizeof(double))
-    {
-        ReadFlush();
-    }
+    if (!EnsureReadable(sizeof(double)))
+        return 0;
     assert(buffer_used - position_in_buffer >= sizeof(double));
-    double result =  (*(double*)(buffer + position_in_buffer));
+    double result =  (*(double*)(read_buffer + position_in_buffer));
     position_in_buffer += sizeof(double);
     return result;
 }
@@ -659,7 +1188,11 @@ void Serializer::WriteF64(double value) {
 }
 
 #ifdef TEST_MAIN
-
+#include <time.h>
+#include <thread>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 static void test_serializer(void) {
     using serialize_mode_t = Serializer::serialize_mode_t;
@@ -724,9 +1257,19 @@ static void test_serializer(void) {
         {
             writer.WriteShortInt(v);
         }
+
+        const int64_t var_ints[] = { 0, 1, -1, 63, -64, 64, 1800000000, -1800000000,
+                                     INT64_MAX, INT64_MIN };
+        for (auto v : var_ints)
+        {
+            writer.WriteVarInt(v);
+        }
     }
+    // the same file read through the buffer and through the mapping
+    const serialize_mode_t read_modes[] = { serialize_mode_t::Reading, serialize_mode_t::MappedReading };
+    for (auto mode : read_modes)
     {
-        Serializer reader { "test_s.dat", serialize_mode_t::Reading };
+        Serializer reader { "test_s.dat", mode };
 
         auto CurrentPosition = [&reader] (void) {
             return reader.CurrentPosition();
@@ -739,12 +1282,20 @@ static void test_serializer(void) {
         assert(CurrentPosition() == 21);
         assert(result == 29);
 
+        // going back within the buffer keeps the crc going
+        reader.SetPosition(16);
+        assert(reader.ReadU32() == 19);
+        reader.SetPosition(21);
+
         reader.ReadShortUint(&result);
         assert(result == 300);
         assert(CurrentPosition() == 23);
         uint8_t x[Serializer::BUFFER_SIZE * 2];
 
-        READ_ARRAY_DATA(reader, x);
+        if (reader.IsMapped())
+            memcpy(x, reader.ReadRawSpan(sizeof(x)), sizeof(x));
+        else
+            READ_ARRAY_DATA(reader, x);
         assert(CurrentPosition() == 23 + sizeof(x));
 
         result = reader.ReadU32();
@@ -756,6 +1307,19 @@ static void test_serializer(void) {
             assert(x[i] == (uint8_t)(i + 1));
         }
         assert(result == 1993 << 13);
+        // a span running past the end of the mapping is refused
+        if (reader.IsMapped())
+            assert(!reader.ReadRawSpan((uint64_t)1 << 40));
+
+        // and so is a fixed size read
+        if (reader.IsMapped())
+        {
+            const auto position = reader.SetPosition(reader.bytes_in_file - 2);
+            assert(reader.ReadU32() == 0 && reader.read_past_end);
+            assert(reader.CurrentPosition() == reader.bytes_in_file - 2);
+            reader.read_past_end = false;
+            reader.SetPosition(position);
+        }
 
         int32_t should_be_zero;
         reader.ReadShortInt(&should_be_zero);
@@ -797,7 +1361,254 @@ static void test_serializer(void) {
             reader.ReadShortInt(&read_value);
             assert (read_value == v);
         }
+
+        const int64_t var_ints[] = { 0, 1, -1, 63, -64, 64, 1800000000, -1800000000,
+                                     INT64_MAX, INT64_MIN };
+        for (auto v : var_ints)
+        {
+            int64_t read_value;
+            const auto bytes_read = reader.ReadVarInt(&read_value);
+            assert (read_value == v);
+            if (v >= -64 && v < 64)
+                assert (bytes_read == 1);
+        }
+
+        // jump back to the patched short uint and over the array to the u32 behind it
+        reader.SetPosition(21);
+        reader.ReadShortUint(&result);
+        assert(result == 300);
+        reader.SetPosition(23 + sizeof(x));
+        assert(reader.ReadU32() == 1993 << 13);
+    }
+}
+
+// five sections read back out of order, the middle one spans several flushes,
+// the last two were encoded on threads of their own
+static void test_sections(void) {
+    using serialize_mode_t = Serializer::serialize_mode_t;
+    const uint32_t n_values = Serializer::BUFFER_SIZE;
+
+    EncodedSection encoded[2];
+    {
+        std::thread threads[2];
+        for (uint32_t t = 0; t < 2; t++)
+        {
+            threads[t] = std::thread([&encoded, t, n_values] {
+                encoded[t].id = 10 + t;
+                encoded[t].flags = 0;
+                Serializer serializer { &encoded[t] };
+                for (uint32_t i = 0; i < n_values; i++)
+                    serializer.WriteVarInt((int64_t)i * (t ? -1 : 1));
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+    {
+        Serializer writer { "test_sections.dat", serialize_mode_t::Writing };
+
+        writer.BeginSection(7);
+        writer.WriteU32(7);
+        writer.EndSection();
+
+        writer.BeginSection(3);
+        for (uint32_t i = 0; i < n_values; i++)
+            writer.WriteShortUint(i);
+        writer.EndSection();
+
+        writer.BeginSection(5);
+        writer.WriteU64(5);
+        writer.EndSection();
+
+        writer.WriteSection(encoded[0]);
+        writer.WriteSection(encoded[1]);
+    }
+
+    const serialize_mode_t read_modes[] = { serialize_mode_t::Reading, serialize_mode_t::MappedReading };
+    for (auto mode : read_modes)
+    {
+        Serializer reader { "test_sections.dat", mode };
+
+        assert(reader.sections.size() == 5);
+        assert(reader.FindSection(7)->offset == 16 && reader.FindSection(7)->length == 4);
+        assert(reader.FindSection(5)->length == 8);
+        assert(!reader.FindSection(1) && !reader.ReadSection(1));
+
+        assert(reader.ReadSection(5));
+        assert(reader.ReadU64() == 5);
+
+        assert(reader.ReadSection(3));
+        for (uint32_t i = 0; i < n_values; i++)
+        {
+            uint32_t value;
+            reader.ReadShortUint(&value);
+            assert(value == i);
+        }
+        assert(reader.CurrentPosition() == reader.FindSection(5)->offset);
+
+        assert(reader.ReadSection(7));
+        assert(reader.ReadU32() == 7);
+
+        for (uint32_t t = 0; t < 2; t++)
+        {
+            assert(reader.FindSection(10 + t)->length == encoded[t].data.size());
+            assert(reader.ReadSection(10 + t));
+            for (uint32_t i = 0; i < n_values; i++)
+            {
+                int64_t value;
+                reader.ReadVarInt(&value);
+                assert(value == (int64_t)i * (t ? -1 : 1));
+            }
+        }
+    }
+}
+
+// A section beyond 4 GiB in a sparse file, written by hand since the writer would crc all of it
+static void test_large_offsets(void) {
+    using serialize_mode_t = Serializer::serialize_mode_t;
+    const uint64_t offset = (5ull << 30) + 3;
+
+    {
+        FILE* f = fopen("test_large.dat", "wb");
+        assert(f);
+        const uint16_t version = 1;
+        const uint16_t flags = FLAG_NO_CRC32 | FLAG_SECTIONS;
+        const uint32_t crc = ~0u, inv_crc = 0;
+        fwrite("OSMb", 1, 4, f);
+        fwrite(&version, 1, sizeof(version), f);
+        fwrite(&flags, 1, sizeof(flags), f);
+        fwrite(&crc, 1, sizeof(crc), f);
+        fwrite(&inv_crc, 1, sizeof(inv_crc), f);
+
+        fseeko(f, offset, SEEK_SET);
+        const uint64_t value = 42;
+        fwrite(&value, 1, sizeof(value), f);
+
+        const uint64_t directory_offset = offset + sizeof(value);
+        const uint32_t directory_header[4] = { 0, SECTION_DIRECTORY_VERSION, 1, 0 };
+        const SectionEntry entry = { 1, SECTION_FLAG_NO_CRC32, offset, sizeof(value), 0, 0 };
+        fwrite(directory_header, 1, sizeof(directory_header), f);
+        fseeko(f, directory_offset, SEEK_SET);
+        fwrite("OSMs", 1, 4, f);
+        fseeko(f, directory_offset + sizeof(directory_header), SEEK_SET);
+        fwrite(&entry, 1, sizeof(entry), f);
+        fwrite(&directory_offset, 1, sizeof(directory_offset), f);
+        fclose(f);
+    }
+
+    const serialize_mode_t read_modes[] = { serialize_mode_t::Reading, serialize_mode_t::MappedReading };
+    for (auto mode : read_modes)
+    {
+        Serializer reader { "test_large.dat", mode };
+        assert(reader.ReadSection(1));
+        assert(reader.CurrentPosition() == offset);
+        assert(reader.ReadU64() == 42);
+        assert(reader.CurrentPosition() == offset + 8);
+
+        reader.SetPosition(16);
+        assert(reader.SetPosition(offset) == 16);
+        assert(reader.ReadU64() == 42);
+    }
+    remove("test_large.dat");
+}
+
+// A directory entry which reaches past the directory, in a file without crcs which would
+// have caught it. Opening the file has to abort instead of reading outside of it
+static void test_bad_section_entry(void) {
+    using serialize_mode_t = Serializer::serialize_mode_t;
+
+    {
+        FILE* f = fopen("test_bad_entry.dat", "wb");
+        assert(f);
+        const uint16_t version = 1;
+        const uint16_t flags = FLAG_NO_CRC32 | FLAG_SECTIONS;
+        const uint32_t crc = ~0u, inv_crc = 0;
+        fwrite("OSMb", 1, 4, f);
+        fwrite(&version, 1, sizeof(version), f);
+        fwrite(&flags, 1, sizeof(flags), f);
+        fwrite(&crc, 1, sizeof(crc), f);
+        fwrite(&inv_crc, 1, sizeof(inv_crc), f);
+
+        const uint64_t value = 42;
+        fwrite(&value, 1, sizeof(value), f);
+
+        const uint64_t directory_offset = 16 + sizeof(value);
+        const uint32_t n_sections = 1, reserved = 0;
+        const SectionEntry entry = { 1, SECTION_FLAG_NO_CRC32, 16, 1 << 20, 0, 0 };
+        fwrite("OSMs", 1, 4, f);
+        fwrite(&SECTION_DIRECTORY_VERSION, 1, 4, f);
+        fwrite(&n_sections, 1, 4, f);
+        fwrite(&reserved, 1, 4, f);
+        fwrite(&entry, 1, sizeof(entry), f);
+        fwrite(&directory_offset, 1, sizeof(directory_offset), f);
+        fclose(f);
+    }
+
+    const serialize_mode_t read_modes[] = { serialize_mode_t::Reading, serialize_mode_t::MappedReading };
+    for (auto mode : read_modes)
+    {
+        fflush(stdout);
+        const pid_t child = fork();
+        assert(child >= 0);
+        if (!child)
+        {
+            Serializer reader { "test_bad_entry.dat", mode };
+            reader.ReadSection(1);
+            _exit(0);
+        }
+        int status;
+        waitpid(child, &status, 0);
+        assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+    }
+    remove("test_bad_entry.dat");
+}
+
+// A tags.dat sized for a small extract, the cost of the 64 bit positions has to stay in the noise
+static void bench_small_file(void) {
+    using serialize_mode_t = Serializer::serialize_mode_t;
+    const uint32_t n_values = 4 * 1000 * 1000;
+
+    auto ms_since = [] (clock_t begin) {
+        return ((clock() - begin) / (double)CLOCKS_PER_SEC) * 1000.0;
+    };
+
+    clock_t begin = clock();
+    {
+        Serializer writer { "bench_s.dat", serialize_mode_t::Writing };
+        uint64_t positions = 0;
+        for (uint32_t i = 0; i < n_values; i++)
+        {
+            writer.WriteShortUint(i & 0xffff);
+            writer.WriteVarInt((int64_t)i - n_values / 2);
+            positions += writer.CurrentPosition();
+        }
+        assert(positions);
+    }
+    printf("writing %u values took %f milliseconds\n", n_values * 2, ms_since(begin));
+
+    const serialize_mode_t read_modes[] = { serialize_mode_t::Reading, serialize_mode_t::MappedReading };
+    for (auto mode : read_modes)
+    {
+        begin = clock();
+        {
+            Serializer reader { "bench_s.dat", mode };
+            uint64_t positions = 0;
+            for (uint32_t i = 0; i < n_values; i++)
+            {
+                uint32_t value;
+                int64_t var_value;
+                reader.ReadShortUint(&value);
+                reader.ReadVarInt(&var_value);
+                assert(value == (i & 0xffff) && var_value == (int64_t)i - n_values / 2);
+                positions += reader.CurrentPosition();
+            }
+            assert(positions);
+        }
+        printf("reading %u values %s took %f milliseconds\n", n_values * 2,
+            mode == serialize_mode_t::Reading ? "buffered" : "mapped  ", ms_since(begin));
     }
+    remove("bench_s.dat");
 }
 
 #ifdef __cplusplus
@@ -809,6 +1620,10 @@ static void test_serializer(void) {
 int main(int argc, char* argv[])
 {
     test_serializer();
+    test_sections();
+    test_large_offsets();
+    test_bad_section_entry();
+    bench_small_file();
 
     puts("test succseeded");
 }
@@ -0,0 +1,406 @@
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <queue>
+#include <algorithm>
+
+#include "ways.h"
+#include "node_store.h"
+#include "serializer.cpp"
+
+using namespace std;
+
+struct BoundingBox
+{
+    int32_t min_lon;
+    int32_t min_lat;
+    int32_t max_lon;
+    int32_t max_lat;
+
+    void Extend(const BoundingBox& other)
+    {
+        min_lon = min(min_lon, other.min_lon);
+        min_lat = min(min_lat, other.min_lat);
+        max_lon = max(max_lon, other.max_lon);
+        max_lat = max(max_lat, other.max_lat);
+    }
+};
+
+// one straight piece of a way, between the nodes index and index + 1 of its refs
+struct WaySegment
+{
+    Coordinates a;
+    Coordinates b;
+    /// index into the ways as they are serialized
+    uint32_t way;
+    uint32_t index;
+
+    BoundingBox Box() const
+    {
+        return {min(a.lon_e7, b.lon_e7), min(a.lat_e7, b.lat_e7),
+                max(a.lon_e7, b.lon_e7), max(a.lat_e7, b.lat_e7)};
+    }
+};
+
+struct SegmentMatch
+{
+    uint32_t segment;
+    /// in meters
+    double distance;
+    /// the closest point on the segment
+    Coordinates projected;
+    /// position of the projected point, 0 at a and 1 at b
+    double fraction;
+};
+
+// Static R-tree over way segments for snapping coordinates to the road network.
+// The segments are sorted along a Hilbert curve and packed NODE_SIZE at a time
+// into the boxes of the lowest level, every level above packs NODE_SIZE boxes of
+// the one below. Nothing but the segments is stored, the boxes are rebuilt on load.
+// Distances are measured on a plane tangent at the query point, which is exact
+// enough for the few hundred meters a snap looks at.
+struct SegmentIndex
+{
+    static const uint32_t NODE_SIZE = 16;
+
+    vector<WaySegment> segments;
+
+    /// boxes of all levels, the lowest level first and the root last
+    vector<BoundingBox> boxes;
+    /// the boxes of level l are [level_begin[l], level_begin[l + 1])
+    vector<uint32_t> level_begin;
+
+    uint32_t size() const
+    {
+        return (uint32_t)segments.size();
+    }
+
+    /// indexes the segments of ways[way_indices[i]], refs missing from nodes are skipped
+    void Build(const vector<Way>& ways, const vector<uint32_t>& way_indices, const NodeStore& nodes);
+
+    /// the k closest segments ordered by distance
+    void Nearest(Coordinates p, uint32_t k, vector<SegmentMatch>& result) const;
+
+    /// all segments closer than radius meters, ordered by distance
+    void WithinRadius(Coordinates p, double radius, vector<SegmentMatch>& result) const;
+
+    /// the k closest segments found by projecting onto every segment,
+    /// the reference Nearest is benchmarked and checked against
+    void NearestByScan(Coordinates p, uint32_t k, vector<SegmentMatch>& result) const;
+
+    void Serialize(Serializer& serializer);
+
+    void DeSerialize(Serializer& serializer);
+
+private:
+    void SortByHilbert(void);
+    void BuildBoxes(void);
+
+    // plane around the query point in meters
+    struct LocalPlane
+    {
+        double x_scale;
+        double y_scale;
+        Coordinates origin;
+
+        LocalPlane(Coordinates p) : origin(p)
+        {
+            const double meters_per_unit = 6371008.8 * (M_PI / 180.0) * 1e-7;
+            y_scale = meters_per_unit;
+            x_scale = meters_per_unit * cos(p.lat_e7 * (M_PI / 180.0) * 1e-7);
+        }
+
+        double BoxDistance(const BoundingBox& box) const
+        {
+            const double dx = max(0.0, max((double)box.min_lon - origin.lon_e7, (double)origin.lon_e7 - box.max_lon)) * x_scale;
+            const double dy = max(0.0, max((double)box.min_lat - origin.lat_e7, (double)origin.lat_e7 - box.max_lat)) * y_scale;
+            return sqrt(dx * dx + dy * dy);
+        }
+
+        SegmentMatch Project(const WaySegment& s, uint32_t segment) const
+        {
+            const double ax = ((double)s.a.lon_e7 - origin.lon_e7) * x_scale;
+            const double ay = ((double)s.a.lat_e7 - origin.lat_e7) * y_scale;
+            const double bx = ((double)s.b.lon_e7 - origin.lon_e7) * x_scale;
+            const double by = ((double)s.b.lat_e7 - origin.lat_e7) * y_scale;
+
+            const double dx = bx - ax, dy = by - ay;
+            const double length_sq = dx * dx + dy * dy;
+            double t = (length_sq > 0) ? -(ax * dx + ay * dy) / length_sq : 0;
+            t = min(1.0, max(0.0, t));
+
+            const double px = ax + t * dx, py = ay + t * dy;
+            SegmentMatch match;
+            match.segment = segment;
+            match.distance = sqrt(px * px + py * py);
+            match.fraction = t;
+            match.projected.lon_e7 = (int32_t)lround(s.a.lon_e7 + t * ((double)s.b.lon_e7 - s.a.lon_e7));
+            match.projected.lat_e7 = (int32_t)lround(s.a.lat_e7 + t * ((double)s.b.lat_e7 - s.a.lat_e7));
+            return match;
+        }
+    };
+
+    /// the children of box i of level l, segments if l is 0
+    void Children(uint32_t level, uint32_t i, uint32_t* begin, uint32_t* end) const
+    {
+        const uint32_t n_children = level ? (level_begin[level] - level_begin[level - 1]) : size();
+        const uint32_t first = (i - level_begin[level]) * NODE_SIZE;
+        *begin = (level ? level_begin[level - 1] : 0) + first;
+        *end = (level ? level_begin[level - 1] : 0) + min(first + NODE_SIZE, n_children);
+    }
+};
+
+/// position of (x, y) on a Hilbert curve filling a 2^16 x 2^16 grid
+inline uint32_t HilbertIndex(uint32_t x, uint32_t y)
+{
+    uint32_t d = 0;
+    for (uint32_t s = 1 << 15; s > 0; s >>= 1)
+    {
+        const uint32_t rx = (x & s) > 0;
+        const uint32_t ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = 0xFFFF - x;
+                y = 0xFFFF - y;
+            }
+            swap(x, y);
+        }
+    }
+    return d;
+}
+
+void SegmentIndex::Build(const vector<Way>& ways, const vector<uint32_t>& way_indices, const NodeStore& nodes)
+{
+    segments.clear();
+    for (const auto widx : way_indices)
+    {
+        const auto& refs = ways[widx].refs;
+        uint32_t last = 0;
+        for (uint32_t i = 0; i < refs.size(); i++)
+        {
+            const auto idx = nodes.Lookup(refs[i]);
+            if (!idx)
+            {
+                last = 0;
+                continue;
+            }
+            if (last)
+                segments.push_back({nodes.coords[last - 1], nodes.coords[idx - 1], widx, i - 1});
+            last = idx;
+        }
+    }
+
+    SortByHilbert();
+    BuildBoxes();
+}
+
+void SegmentIndex::SortByHilbert(void)
+{
+    if (segments.empty())
+        return;
+
+    BoundingBox extent = segments[0].Box();
+    for (const auto& s : segments)
+        extent.Extend(s.Box());
+
+    const double width = max(1.0, (double)extent.max_lon - extent.min_lon);
+    const double height = max(1.0, (double)extent.max_lat - extent.min_lat);
+
+    vector<pair<uint32_t, uint32_t> > order(segments.size());
+    for (uint32_t i = 0; i < segments.size(); i++)
+    {
+        const auto& s = segments[i];
+        const double cx = ((double)s.a.lon_e7 + s.b.lon_e7) * 0.5 - extent.min_lon;
+        const double cy = ((double)s.a.lat_e7 + s.b.lat_e7) * 0.5 - extent.min_lat;
+        order[i] = {HilbertIndex((uint32_t)(cx / width * 65535.0), (uint32_t)(cy / height * 65535.0)), i};
+    }
+    sort(order.begin(), order.end());
+
+    vector<WaySegment> sorted;
+    sorted.reserve(segments.size());
+    for (const auto& o : order)
+        sorted.push_back(segments[o.second]);
+    segments.swap(sorted);
+}
+
+void SegmentIndex::BuildBoxes(void)
+{
+    boxes.clear();
+    level_begin.clear();
+
+    // lowest level over the segments
+    level_begin.push_back(0);
+    for (uint32_t i = 0; i < size(); i += NODE_SIZE)
+    {
+        BoundingBox box = segments[i].Box();
+        for (uint32_t j = i + 1; j < min(i + NODE_SIZE, size()); j++)
+            box.Extend(segments[j].Box());
+        boxes.push_back(box);
+    }
+    level_begin.push_back((uint32_t)boxes.size());
+
+    // pack until a single root is left
+    while (level_begin.back() - level_begin[level_begin.size() - 2] > 1)
+    {
+        const uint32_t begin = level_begin[level_begin.size() - 2];
+        const uint32_t end = level_begin.back();
+        for (uint32_t i = begin; i < end; i += NODE_SIZE)
+        {
+            BoundingBox box = boxes[i];
+            for (uint32_t j = i + 1; j < min(i + NODE_SIZE, end); j++)
+                box.Extend(boxes[j]);
+            boxes.push_back(box);
+        }
+        level_begin.push_back((uint32_t)boxes.size());
+    }
+}
+
+void SegmentIndex::Nearest(Coordinates p, uint32_t k, vector<SegmentMatch>& result) const
+{
+    result.clear();
+    if (boxes.empty() || !k)
+        return;
+
+    const LocalPlane plane(p);
+
+    // best first search, boxes and segments share the queue so
+    // a segment is only reported once nothing closer can be left
+    struct Entry
+    {
+        double distance;
+        // level + 1 of a box, 0 for a segment
+        uint32_t level;
+        uint32_t index;
+        bool operator< (const Entry& other) const { return distance > other.distance; }
+    };
+    priority_queue<Entry> queue;
+
+    const uint32_t root_level = (uint32_t)level_begin.size() - 2;
+    queue.push({plane.BoxDistance(boxes.back()), root_level + 1, (uint32_t)boxes.size() - 1});
+
+    while (!queue.empty() && result.size() < k)
+    {
+        const Entry e = queue.top();
+        queue.pop();
+
+        if (!e.level)
+        {
+            result.push_back(plane.Project(segments[e.index], e.index));
+            continue;
+        }
+
+        uint32_t begin, end;
+        Children(e.level - 1, e.index, &begin, &end);
+        for (uint32_t c = begin; c < end; c++)
+        {
+            if (e.level == 1)
+                queue.push({plane.Project(segments[c], c).distance, 0, c});
+            else
+                queue.push({plane.BoxDistance(boxes[c]), e.level - 1, c});
+        }
+    }
+}
+
+void SegmentIndex::WithinRadius(Coordinates p, double radius, vector<SegmentMatch>& result) const
+{
+    result.clear();
+    if (boxes.empty())
+        return;
+
+    const LocalPlane plane(p);
+
+    vector<pair<uint32_t, uint32_t> > stack;
+    const uint32_t root_level = (uint32_t)level_begin.size() - 2;
+    stack.push_back({root_level, (uint32_t)boxes.size() - 1});
+
+    while (!stack.empty())
+    {
+        const auto top = stack.back();
+        stack.pop_back();
+        if (plane.BoxDistance(boxes[top.second]) > radius)
+            continue;
+
+        uint32_t begin, end;
+        Children(top.first, top.second, &begin, &end);
+        for (uint32_t c = begin; c < end; c++)
+        {
+            if (top.first)
+            {
+                stack.push_back({top.first - 1, c});
+                continue;
+            }
+            const auto match = plane.Project(segments[c], c);
+            if (match.distance <= radius)
+                result.push_back(match);
+        }
+    }
+
+    sort(result.begin(), result.end(),
+        [] (const SegmentMatch& a, const SegmentMatch& b) { return a.distance < b.distance; });
+}
+
+void SegmentIndex::NearestByScan(Coordinates p, uint32_t k, vector<SegmentMatch>& result) const
+{
+    result.clear();
+    const LocalPlane plane(p);
+    for (uint32_t i = 0; i < size(); i++)
+        result.push_back(plane.Project(segments[i], i));
+
+    k = min(k, size());
+    partial_sort(result.begin(), result.begin() + k, result.end(),
+        [] (const SegmentMatch& a, const SegmentMatch& b) { return a.distance < b.distance; });
+    result.resize(k);
+}
+
+void SegmentIndex::Serialize(Serializer& serializer)
+{
+    serializer.WriteU32(size());
+
+    // neighbours on the Hilbert curve are close, so everything is delta coded
+    Coordinates last = {0, 0};
+    uint32_t last_way = 0;
+    for (const auto& s : segments)
+    {
+        serializer.WriteVarInt((int64_t)s.a.lat_e7 - last.lat_e7);
+        serializer.WriteVarInt((int64_t)s.a.lon_e7 - last.lon_e7);
+        serializer.WriteVarInt((int64_t)s.b.lat_e7 - s.a.lat_e7);
+        serializer.WriteVarInt((int64_t)s.b.lon_e7 - s.a.lon_e7);
+        serializer.WriteVarInt((int64_t)s.way - last_way);
+        serializer.WriteVarInt(s.index);
+        last = s.a;
+        last_way = s.way;
+    }
+}
+
+void SegmentIndex::DeSerialize(Serializer& serializer)
+{
+    segments.resize(serializer.ReadU32());
+
+    Coordinates last = {0, 0};
+    uint32_t last_way = 0;
+    for (auto& s : segments)
+    {
+        int64_t value;
+        serializer.ReadVarInt(&value);
+        s.a.lat_e7 = (int32_t)(last.lat_e7 + value);
+        serializer.ReadVarInt(&value);
+        s.a.lon_e7 = (int32_t)(last.lon_e7 + value);
+        serializer.ReadVarInt(&value);
+        s.b.lat_e7 = (int32_t)(s.a.lat_e7 + value);
+        serializer.ReadVarInt(&value);
+        s.b.lon_e7 = (int32_t)(s.a.lon_e7 + value);
+        serializer.ReadVarInt(&value);
+        s.way = (uint32_t)(last_way + value);
+        serializer.ReadVarInt(&value);
+        s.index = (uint32_t)value;
+        last = s.a;
+        last_way = s.way;
+    }
+
+    BuildBoxes();
+}
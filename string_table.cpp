@@ -1,10 +1,24 @@
+#pragma once
+
 #include <vector>
-#include <map>
 #include <utility>
+#include <algorithm>
+#include <mutex>
 #include "stdlib.h"
+#include "string.h"
+
+#ifdef TEST_MAIN
+#  define HAD_TEST_MAIN_STRING_TABLE
+#  undef TEST_MAIN
+#endif
+
 #include "crc32.c"
 #include "serializer.cpp"
 
+#ifdef HAD_TEST_MAIN_STRING_TABLE
+#  define TEST_MAIN
+#endif
+
 #if (__cplusplus <= 201500)
 #    include "3rd_party/llvm_string_view.hpp"
      using string_view = StringView;
@@ -24,6 +38,17 @@ struct StringEntry
     uint32_t offset;
 };
 
+// A slot of the hash index, the crc32 is kept next to the index
+// so a probe only touches the strings when the crc32 matches.
+// Strings with different crc32s never get compared, a collision chain
+// is only ever as long as the number of strings sharing the crc32.
+struct StringIndexSlot
+{
+    uint32_t crc32;
+    /// index of the string_entry + 1, 0 for an empty slot
+    uint32_t index;
+};
+
 struct StringTable
 {
     StringTable() = default;
@@ -32,7 +57,10 @@ struct StringTable
 
     std::vector<char> string_data;
     std::vector<StringEntry> strings;
-    map<uint32_t, uint32_t> crc32_to_indecies;
+    /// open addressing with linear probing, the size is a power of two and at least twice the number of strings
+    std::vector<StringIndexSlot> hash_index;
+    /// log2 of the size of hash_index
+    uint32_t index_bits = 0;
     std::vector<std::pair<uint32_t, uint32_t> > usage_counts;
     // public :
 
@@ -40,6 +68,9 @@ struct StringTable
 
     uint32_t AddString(const string_view & str);
 
+    /// the crc32c of the string has to be computed already
+    uint32_t AddString(const char* str_data, uint32_t str_size, uint32_t crc);
+
     /// Returns 0 if not found or the index of the string_entry + 1 if found
     uint32_t LookupCString(const char* str);
 
@@ -60,6 +91,16 @@ struct StringTable
 
     void DeSerialize (Serializer& serializer);
 
+    /// bulk builds the hash index for all the strings, the strings are known to be distinct
+    void RebuildIndex(void);
+
+    /// recomputes the entries from the terminated strings in string_data
+    void RebuildEntries(void);
+
+    /// Gives the most used strings the smallest ids, so they get the shortest encodings.
+    /// Returns the new id of every old id, 0 stays 0
+    vector<uint32_t> ReorderByUsage(void);
+
     void SortUsageCounts(void) {
         qsort(SORT_VEC(usage_counts),
         [] (const void* ap, const void* bp) -> int {
@@ -71,48 +112,223 @@ struct StringTable
             return result;
         });
     }
+
+private:
+    /// the slot a probe for crc starts at
+    uint32_t HomeSlot(uint32_t crc) const
+    {
+        // the high bits of the product depend on all bits of the crc32,
+        // so crc32s which only differ in their high bits do not pile up in one cluster
+        return (crc * 2654435761u) >> (32 - index_bits);
+    }
+
+    /// Returns the slot of the string or the empty slot it would go into
+    uint32_t FindSlot(const char* str_data, uint32_t str_size, uint32_t crc) const;
+
+    /// n_slots has to be a power of two
+    void ResizeIndex(size_t n_slots);
+
+    /// reads the n elements of a stored array, false if the file ends before them
+    template <typename T>
+    static bool ReadArray(Serializer& serializer, std::vector<T>& array, uint64_t n);
+
+    /// true if every entry is a terminated string inside string_data
+    bool EntriesValid(void) const;
+
+    /// true if an index of 2^bits slots could have been built for the strings:
+    /// every string is in exactly one slot, with its crc32, where a probe finds it
+    bool IndexValid(void) const;
 };
 
 
-StringTable::StringTable (vector<const char*> primer) : string_data(), strings(), crc32_to_indecies() {
+StringTable::StringTable (vector<const char*> primer) : string_data(), strings(), hash_index() {
     for(auto &e : primer)
     {
         AddString(string_view {e, strlen(e)} );
     }
 }
 
-uint32_t StringTable::AddString (const string_view & str) {
-    // cerr << "called " << __FUNCTION__ << " (" << str << ")" << endl;
+uint32_t StringTable::FindSlot (const char* str_data, uint32_t str_size, uint32_t crc) const {
+    const uint32_t mask = (uint32_t)hash_index.size() - 1;
+    for (uint32_t slot = HomeSlot(crc);; slot = (slot + 1) & mask)
+    {
+        const auto s = hash_index[slot];
+        if (!s.index)
+            return slot;
 
-    const auto crc =
-        FINALIZE_CRC32C(crc32c(INITIAL_CRC32C, str.data(), str.size()));
-    uint32_t idx = 0;
+        if (s.crc32 == crc)
+        {
+            const auto entry = strings[s.index - 1];
+            if (str_size == entry.length
+                && 0 == memcmp(&string_data[entry.offset], str_data, str_size))
+            {
+                return slot;
+            }
+        }
+    }
+}
+
+void StringTable::ResizeIndex (size_t n_slots) {
+    hash_index.assign(n_slots, {0, 0});
+    index_bits = 0;
+    while (((size_t)1 << index_bits) < n_slots)
+        index_bits++;
+    const uint32_t mask = (uint32_t)hash_index.size() - 1;
+
+    // all strings are distinct, so only the empty slots have to be found
+    uint32_t idx = 1;
+    for (const auto& e : strings)
+    {
+        uint32_t slot = HomeSlot(e.crc32);
+        while (hash_index[slot].index)
+            slot = (slot + 1) & mask;
+        hash_index[slot] = {e.crc32, idx++};
+    }
+}
+
+void StringTable::RebuildIndex (void) {
+    size_t n_slots = 64;
+    while (n_slots < strings.size() * 2)
+        n_slots *= 2;
+    ResizeIndex(n_slots);
+}
+
+void StringTable::RebuildEntries (void) {
+    strings.clear();
+    for (uint32_t offset = 0; offset < string_data.size(); )
+    {
+        const char* str = &string_data[offset];
+        const uint32_t length = strnlen(str, string_data.size() - offset);
+        const uint32_t crc = FINALIZE_CRC32C(crc32c(INITIAL_CRC32C, str, length));
+        strings.push_back({crc, length, offset});
+        offset += length + 1;
+    }
+}
+
+template <typename T>
+bool StringTable::ReadArray (Serializer& serializer, std::vector<T>& array, uint64_t n) {
+    uint64_t bytes_left = n * sizeof(T);
+
+    if (serializer.IsMapped())
+    {
+        // the array is in the mapping in one piece, a corrupt length
+        // is caught before anything gets allocated for it
+        const void* span = serializer.ReadRawSpan(bytes_left);
+        if (!span)
+            return false;
+        array.resize(n);
+        memcpy(array.data(), span, bytes_left);
+        return true;
+    }
+
+    array.resize(n);
+    char* dest = (char*)array.data();
+    while (bytes_left)
+    {
+        const uint32_t bytes_read = serializer.ReadRawData(dest, (uint32_t)std::min<uint64_t>(bytes_left, UINT32_MAX));
+        if (!bytes_read)
+        {
+            array.clear();
+            return false;
+        }
+        dest += bytes_read;
+        bytes_left -= bytes_read;
+    }
+    return true;
+}
+
+bool StringTable::EntriesValid (void) const {
+    for (const auto& e : strings)
+    {
+        if ((uint64_t)e.offset + e.length >= string_data.size() || string_data[e.offset + e.length])
+            return false;
+    }
+    return true;
+}
+
+bool StringTable::IndexValid (void) const {
+    // RebuildIndex and the growth in AddString keep the index
+    // between twice and four times the number of strings, and at least 64
+    const size_t n_slots = hash_index.size();
+    if (index_bits < 6 || index_bits > 31 || n_slots != ((size_t)1 << index_bits)
+        || n_slots < strings.size() * 2 || n_slots > max((size_t)64, strings.size() * 4))
+    {
+        return false;
+    }
 
-    for (auto it = crc32_to_indecies.find(crc);
-        it != crc32_to_indecies.end();
-        it++)
+    // every string has to be in exactly one slot, which leaves at least half of the
+    // slots empty so a probe for a missing string ends. A probe for a string has to
+    // reach it from its home slot before it hits an empty slot, the walk therefore
+    // starts after an empty slot and counts the filled slots of the current cluster
+    const uint32_t mask = (uint32_t)n_slots - 1;
+    uint32_t start = 0;
+    while (start < n_slots && hash_index[start].index)
+        start++;
+    if (start == n_slots)
+        return false;
+
+    vector<bool> seen(strings.size());
+    uint32_t n_used = 0;
+    uint32_t cluster_size = 0;
+    for (uint32_t k = 1; k <= n_slots; k++)
     {
-        const auto entry = strings[it->second - 1];
-        const auto canidate = string_view {&string_data[entry.offset], entry.length};
-        if (canidate == str)
+        const uint32_t slot_idx = (start + k) & mask;
+        const auto& slot = hash_index[slot_idx];
+        if (!slot.index)
+        {
+            cluster_size = 0;
+            continue;
+        }
+        cluster_size++;
+
+        if (slot.index > strings.size() || strings[slot.index - 1].crc32 != slot.crc32
+            || seen[slot.index - 1])
         {
-            idx = it->second;
-            usage_counts[idx - 1].second++;
-            break;
+            return false;
         }
+        seen[slot.index - 1] = true;
+        n_used++;
+
+        if (((slot_idx - HomeSlot(slot.crc32)) & mask) >= cluster_size)
+            return false;
     }
+    return n_used == strings.size();
+}
 
-    if (!idx)
+uint32_t StringTable::AddString (const string_view & str) {
+    // cerr << "called " << __FUNCTION__ << " (" << str << ")" << endl;
+
+    const uint32_t crc =
+        FINALIZE_CRC32C(crc32c(INITIAL_CRC32C, str.data(), str.size()));
+
+    return AddString(str.data(), (uint32_t)str.size(), crc);
+}
+
+uint32_t StringTable::AddString (const char* str_data, uint32_t str_size, uint32_t crc) {
+    if (hash_index.empty())
+        ResizeIndex(64);
+
+    const uint32_t slot = FindSlot(str_data, str_size, crc);
+    uint32_t idx = hash_index[slot].index;
+    if (idx)
+    {
+        usage_counts[idx - 1].second++;
+    }
+    else
     // couldn't find the string insert it
     {
         uint32_t offset = (uint32_t) string_data.size();
-        StringEntry entry { crc, (uint32_t)str.size(), offset };
-        string_data.insert(string_data.end(), str.begin(), str.end());
+        StringEntry entry { crc, str_size, offset };
+        string_data.insert(string_data.end(), str_data, str_data + str_size);
         string_data.push_back('\0');
         strings.push_back(entry);
         idx = strings.size();
         usage_counts.push_back({idx, 1});
-        crc32_to_indecies.emplace(crc, idx);
+        hash_index[slot] = {crc, idx};
+
+        // at most half full keeps the probe sequences short
+        if (strings.size() * 2 > hash_index.size())
+            ResizeIndex(hash_index.size() * 2);
     }
     return idx;
 }
@@ -133,23 +349,47 @@ uint32_t StringTable::LookupString (const string_view& str) {
 }
 
 uint32_t StringTable::LookupString (const char* str_data, uint32_t str_size, uint32_t crc_input) {
-    uint idx = 0;
-    // using entry_t = decltype(strings)::value_type;
+    if (hash_index.empty())
+        return 0;
 
-    for (auto it = crc32_to_indecies.find(crc_input);
-         it != crc32_to_indecies.end();
-         it++
-    ) {
-        const auto s = strings[it->second - 1];
-        if (str_size == s.length
-            && 0 == strncmp(&string_data[s.offset], str_data, str_size))
-        {
-            idx = (it->second);
-            break;
-        }
+    return hash_index[FindSlot(str_data, str_size, crc_input)].index;
+}
+
+vector<uint32_t> StringTable::ReorderByUsage (void) {
+    const uint32_t n_strings = strings.size();
+    // only tables built with AddString know their usage
+    assert(usage_counts.size() == n_strings);
+
+    // usage_counts may have been sorted already, the old ids are kept in first
+    vector<pair<uint32_t, uint32_t> > order = usage_counts;
+    sort(order.begin(), order.end(),
+        [] (const pair<uint32_t, uint32_t>& a, const pair<uint32_t, uint32_t>& b) {
+            return (a.second != b.second) ? a.second > b.second : a.first < b.first;
+        });
+
+    vector<uint32_t> new_ids(n_strings + 1, 0);
+    vector<char> new_string_data;
+    vector<StringEntry> new_strings;
+    new_string_data.reserve(string_data.size());
+    new_strings.reserve(n_strings);
+    for (const auto& usage : order)
+    {
+        auto entry = strings[usage.first - 1];
+        const uint32_t offset = (uint32_t) new_string_data.size();
+        new_string_data.insert(new_string_data.end(),
+            &string_data[entry.offset], &string_data[entry.offset] + entry.length + 1);
+        entry.offset = offset;
+        new_strings.push_back(entry);
+        new_ids[usage.first] = (uint32_t) new_strings.size();
     }
 
-    return idx;
+    string_data.swap(new_string_data);
+    strings.swap(new_strings);
+    for (uint32_t i = 0; i < n_strings; i++)
+        usage_counts[i] = {i + 1, order[i].second};
+    RebuildIndex();
+
+    return new_ids;
 }
 
 string_view StringTable::LookupId (uint32_t idx) {
@@ -185,61 +425,656 @@ void StringTable::Serialize (Serializer& serializer) {
 
     // serializer.EndField();
 
-    // we only need to store the number of strings as we can
-    // reproduce the string entires by reading in the null
-    // terminated strings in order.
-    serializer.WriteU32(strings.size());
+    // the entries and the hash index are stored as they are,
+    // so loading them needs no strlen, crc32 or insert per string
+    {
+        const uint32_t n_strings = strings.size();
+
+        serializer.WriteU32(n_strings);
+        auto ptr = (const char*)strings.data();
+        WRITE_ARRAY_DATA_SIZE(serializer, ptr, n_strings * sizeof(StringEntry));
+    }
+
+    {
+        if (hash_index.empty())
+            RebuildIndex();
+
+        serializer.WriteU32(index_bits);
+        auto ptr = (const char*)hash_index.data();
+        WRITE_ARRAY_DATA_SIZE(serializer, ptr, hash_index.size() * sizeof(StringIndexSlot));
+    }
 }
 
+// The entries and the index are taken as they are stored, which saves a crc32 and
+// an insert per string. They are still checked, a corrupt or foreign file falls back
+// to recomputing them from the strings.
+// Storing them is a deliberate trade-off for readers built with NO_CRC32, as bld.sh
+// builds list_streets: for 200k strings loading takes 11 ms instead of 19 ms. A reader
+// which checks the crcs has to checksum the arrays, about three times the bytes of the
+// strings, and takes 42 ms instead of 25 ms. The layout can not depend on how the
+// reader was built, so the arrays are always stored.
+// From a mapped file each array is copied out of the mapping in one go.
 void StringTable::DeSerialize (Serializer& serializer) {
     // serialize string data.
 
     // serializer.BeginField("vector<char>", "string_data");
     {
         uint32_t n_chars = serializer.ReadU32();
-        string_data.resize(n_chars);
-        auto ptr = string_data.data();
-
-        READ_ARRAY_DATA_SIZE(serializer, ptr, n_chars);
+        if (!ReadArray(serializer, string_data, n_chars))
+        {
+            fprintf(stderr, "string table with %u bytes of strings past the end of the file\n", n_chars);
+            string_data.clear();
+            RebuildEntries();
+            RebuildIndex();
+            return;
+        }
     }
     // serializer.EndField();
 
-    // let's recreate the strings vector
     {
-        auto n_strings = serializer.ReadU32();
+        const uint32_t n_strings = serializer.ReadU32();
+        // every string is followed by its terminator, more can not be valid
+        // and nothing after the entries can be located anymore
+        if (n_strings > string_data.size())
+        {
+            fprintf(stderr, "string table with %u strings in %u bytes, recomputing its entries\n",
+                n_strings, (uint32_t)string_data.size());
+            RebuildEntries();
+            RebuildIndex();
+            return;
+        }
+        if (!ReadArray(serializer, strings, n_strings))
+        {
+            fprintf(stderr, "string table entries past the end of the file, recomputing them\n");
+            RebuildEntries();
+            RebuildIndex();
+            return;
+        }
+    }
+
+    {
+        index_bits = serializer.ReadU32();
+        if (index_bits < 6 || index_bits > 31)
+            hash_index.clear();
+        else if (!ReadArray(serializer, hash_index, (size_t)1 << index_bits))
+            hash_index.clear();
+    }
 
-        const char * const string_data_begin = string_data.data();
-        const char* string_ptr = string_data.data();
+    if (!EntriesValid())
+    {
+        fprintf(stderr, "string table entries point outside of the strings, recomputing them\n");
+        RebuildEntries();
+        RebuildIndex();
+    }
+    else if (!IndexValid())
+    {
+        fprintf(stderr, "string table index does not fit its %u strings, rebuilding it\n",
+            (uint32_t)strings.size());
+        RebuildIndex();
+    }
+}
+
+// Interning from many threads at once, for importers which decode blocks in parallel.
+// The strings are spread over shards by the high bits of their crc32c, every shard
+// is a StringTable behind its own mutex, threads only wait on each other when they
+// add strings of the same shard at the same moment.
+// The ids handed out are provisional and uses are not counted here, the caller counts
+// them by provisional id. Finish() then adds the strings which were used to a StringTable
+// in an order which does not depend on the thread a string was added by first.
+struct ConcurrentStringTable
+{
+    static const uint32_t SHARD_BITS = 6;
+    static const uint32_t N_SHARDS = 1u << SHARD_BITS;
 
-        strings.resize(n_strings);
+    // The handle of one thread to the table.
+    // Few strings make up most of the tags, without a cache every thread would queue
+    // on the shards of "highway" and "yes". Recently added short strings are kept per
+    // thread, hitting them locks nothing.
+    struct Interner
+    {
+        Interner(ConcurrentStringTable& table) : table(table), cache(N_CACHED) {}
 
-        for(StringEntry& e : strings)
+        /// Returns the provisional id of the string, never 0
+        uint32_t AddString(const string_view& str);
+
+    private:
+        static const uint32_t CACHE_BITS = 10;
+        static const uint32_t N_CACHED = 1u << CACHE_BITS;
+        static const uint32_t MAX_CACHED_LENGTH = 52;
+
+        /// a cache line each
+        struct CachedString
         {
-            const char* const word_begin = string_ptr;
-            e.offset = (uint32_t)(word_begin - string_data_begin);
+            uint32_t crc32;
+            /// the provisional id, 0 for an empty entry
+            uint32_t id;
+            uint32_t length;
+            char data[MAX_CACHED_LENGTH];
+        };
 
-            uint32_t length = strlen(word_begin);
-            assert(length);
+        ConcurrentStringTable& table;
+        vector<CachedString> cache;
+    };
 
-            e.length = length;
-            e.crc32 = FINALIZE_CRC32C(
-                crc32c(INITIAL_CRC32C, string_ptr, length)
-            );
-            string_ptr += length;
-            string_ptr++;
-        }
-        assert((uint32_t)(string_ptr - string_data_begin) == string_data.size());
+    /// Returns the provisional id of the string, never 0. May be called from any thread
+    uint32_t AddString(const char* str_data, uint32_t str_size, uint32_t crc);
+
+    /// Adds the strings with n_uses[provisional id] > 0 to table with that many uses,
+    /// strings already in it keep their ids. The new ones are appended shard by shard,
+    /// sorted by their bytes within a shard. Returns the ids in table by provisional id,
+    /// 0 for the strings which were not used. No thread may add strings meanwhile
+    vector<uint32_t> Finish(StringTable& table, const vector<uint32_t>& n_uses) const;
+
+    /// drops all strings, no thread may add strings meanwhile
+    void Clear(void);
+
+private:
+    /// on cache lines of their own, so locking one shard does not slow down its neighbours
+    struct alignas(64) Shard
+    {
+        mutex lock;
+        StringTable table;
+    };
+
+    Shard shards[N_SHARDS];
+};
+
+uint32_t ConcurrentStringTable::AddString (const char* str_data, uint32_t str_size, uint32_t crc) {
+    const uint32_t shard = crc >> (32 - SHARD_BITS);
+    uint32_t local_id;
+    {
+        lock_guard<mutex> guard(shards[shard].lock);
+        local_id = shards[shard].table.AddString(str_data, str_size, crc);
     }
+    // at most 2^26 strings per shard
+    assert(local_id < (1u << (32 - SHARD_BITS)));
+    return (local_id << SHARD_BITS) | shard;
+}
 
+vector<uint32_t> ConcurrentStringTable::Finish (StringTable& table, const vector<uint32_t>& n_uses) const {
+    vector<uint32_t> ids(n_uses.size(), 0);
+    for (uint32_t shard = 0; shard < N_SHARDS; shard++)
     {
-        // now recreate the map
-        // crc32_to_indecies
-        int idx = 1;
-        for(auto& e : strings)
+        const auto& local = shards[shard].table;
+        auto Bytes = [&local] (uint32_t local_id) {
+            const auto& entry = local.strings[local_id - 1];
+            return string_view(&local.string_data[entry.offset], entry.length);
+        };
+
+        vector<uint32_t> order;
+        for (uint32_t local_id = 1; local_id <= local.strings.size(); local_id++)
         {
-            crc32_to_indecies.emplace(e.crc32, idx++);
+            const uint32_t provisional_id = (local_id << SHARD_BITS) | shard;
+            if (provisional_id < n_uses.size() && n_uses[provisional_id])
+                order.push_back(local_id);
+        }
+        sort(order.begin(), order.end(), [&] (uint32_t a, uint32_t b) {
+            return Bytes(a) < Bytes(b);
+        });
+
+        for (auto local_id : order)
+        {
+            const uint32_t provisional_id = (local_id << SHARD_BITS) | shard;
+            const auto& entry = local.strings[local_id - 1];
+            const uint32_t id = table.AddString(&local.string_data[entry.offset], entry.length, entry.crc32);
+            // AddString counted one use already
+            table.usage_counts[id - 1].second += n_uses[provisional_id] - 1;
+            ids[provisional_id] = id;
         }
     }
+    return ids;
+}
+
+void ConcurrentStringTable::Clear (void) {
+    for (auto& shard : shards)
+        shard.table = StringTable {};
+}
+
+uint32_t ConcurrentStringTable::Interner::AddString (const string_view& str) {
+    const char* str_data = str.data();
+    const uint32_t str_size = str.size();
+    const uint32_t crc =
+        FINALIZE_CRC32C(crc32c(INITIAL_CRC32C, str_data, str_size));
+
+    if (str_size > MAX_CACHED_LENGTH)
+        return table.AddString(str_data, str_size, crc);
+
+    auto& cached = cache[(crc * 2654435761u) >> (32 - CACHE_BITS)];
+    if (cached.id && cached.crc32 == crc && cached.length == str_size
+        && 0 == memcmp(cached.data, str_data, str_size))
+        return cached.id;
+
+    cached.crc32 = crc;
+    cached.id = table.AddString(str_data, str_size, crc);
+    cached.length = str_size;
+    memcpy(cached.data, str_data, str_size);
+    return cached.id;
 }
 
 #undef SORT_VEC
+
+#ifdef TEST_MAIN
+#include <time.h>
+#include <math.h>
+#include <string>
+#include <thread>
+#include <chrono>
+
+// Appends 4 bytes to prefix so its crc32c becomes crc.
+// Every step of the crc32c shifts one byte out of the register, the table entry
+// which was xored in can be told from the top byte alone, so the register can be
+// unwound from the wanted crc back to right after the prefix.
+static std::string force_crc32c(const std::string& prefix, uint32_t crc)
+{
+    uint32_t table[256];
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+        table[i] = c;
+    }
+
+    uint32_t reg = crc ^ 0xFFFFFFFF;
+    for (int i = 0; i < 4; i++)
+    {
+        uint32_t k = 0;
+        while ((table[k] >> 24) != (reg >> 24))
+            k++;
+        reg = ((reg ^ table[k]) << 8) | k;
+    }
+    reg ^= crc32c(INITIAL_CRC32C, prefix.data(), (uint32_t)prefix.size());
+
+    std::string result = prefix;
+    for (int i = 0; i < 4; i++)
+        result.push_back((char)(reg >> (8 * i)));
+    return result;
+}
+
+static double now_ns(void)
+{
+    return (double)clock() * (1e9 / CLOCKS_PER_SEC);
+}
+
+static std::string random_string(uint32_t* seed)
+{
+    std::string s;
+    const uint32_t length = 4 + (*seed >> 28);
+    for (uint32_t i = 0; i < length; i++)
+    {
+        *seed = *seed * 1664525u + 1013904223u;
+        s.push_back('a' + (*seed >> 24) % 26);
+    }
+    return s;
+}
+
+// Strings which all share one crc32c among a growing number of random ones,
+// the cost of looking them up and of missing must not grow with the table.
+// Returns false if a colliding lookup in the largest table costs more than
+// a few times as much as in the smallest one
+static bool test_collisions(void)
+{
+    const uint32_t crc = 0x3F233FF2; // "addr:housenumber"
+    std::vector<std::string> colliding;
+    for (uint32_t i = 0; colliding.size() < 64; i++)
+    {
+        auto s = force_crc32c("collision" + std::to_string(i) + ":", crc);
+        // the forged bytes may contain a terminator
+        if (strlen(s.c_str()) == s.size())
+            colliding.push_back(s);
+    }
+    uint32_t not_forged = 0;
+    for (const auto& s : colliding)
+    {
+        const uint32_t forged = FINALIZE_CRC32C(crc32c(INITIAL_CRC32C, s.data(), (uint32_t)s.size()));
+        not_forged += (forged != crc);
+    }
+    if (not_forged)
+    {
+        printf("%u strings do not have the forged crc32c\n", not_forged);
+        return false;
+    }
+
+    double first_hit_ns = 0, first_miss_ns = 0;
+    double last_hit_ns = 0, last_miss_ns = 0;
+    for (uint32_t n_strings = 1000; n_strings <= 1000000; n_strings *= 10)
+    {
+        StringTable table {};
+        uint32_t seed = n_strings;
+        std::vector<std::string> randoms;
+        for (uint32_t i = 0; i < n_strings; i++)
+            randoms.push_back(random_string(&seed));
+
+        // half of the colliding strings are in the table, the other half are misses
+        for (uint32_t i = 0; i < n_strings; i++)
+        {
+            table.AddString(randoms[i]);
+            const uint32_t step = n_strings / 32;
+            if (i % step == 0 && i / step < 32)
+                table.AddString(colliding[i / step]);
+        }
+        // adding them again finds them, each under an id of its own
+        const uint32_t n_added = table.strings.size();
+        std::vector<uint32_t> colliding_ids;
+        for (uint32_t i = 0; i < 32; i++)
+            colliding_ids.push_back(table.AddString(colliding[i]));
+        std::sort(colliding_ids.begin(), colliding_ids.end());
+        if (table.strings.size() != n_added || !colliding_ids[0]
+            || std::unique(colliding_ids.begin(), colliding_ids.end()) != colliding_ids.end())
+        {
+            printf("the colliding strings were not found under distinct ids\n");
+            return false;
+        }
+
+        const uint32_t rounds = 200000;
+        uint64_t found = 0;
+        double begin = now_ns();
+        for (uint32_t r = 0; r < rounds; r++)
+            found += (table.LookupString(colliding[r % 32]) != 0);
+        const double hit_ns = (now_ns() - begin) / rounds;
+
+        begin = now_ns();
+        for (uint32_t r = 0; r < rounds; r++)
+            found += (table.LookupString(colliding[32 + r % 32]) != 0);
+        const double miss_ns = (now_ns() - begin) / rounds;
+
+        begin = now_ns();
+        for (uint32_t r = 0; r < rounds; r++)
+            found += (table.LookupString(randoms[(r * 7919) % n_strings]) != 0);
+        const double random_ns = (now_ns() - begin) / rounds;
+
+        // found is printed so the lookups can not be optimized away
+        printf("%8u strings: colliding hit %6.1f ns, colliding miss %6.1f ns, random hit %6.1f ns, %u found\n",
+            n_added, hit_ns, miss_ns, random_ns, (uint32_t)found);
+        if (found != 2 * rounds)
+        {
+            printf("expected %u strings to be found\n", 2 * rounds);
+            return false;
+        }
+
+        if (n_strings == 1000)
+        {
+            first_hit_ns = hit_ns;
+            first_miss_ns = miss_ns;
+        }
+        last_hit_ns = hit_ns;
+        last_miss_ns = miss_ns;
+    }
+
+    // the chains of the colliding strings are as long in every table, only the
+    // caches can make the large table slower. A tenth of a nanosecond keeps the
+    // factor meaningful when a lookup in the small table is too quick for clock()
+    const double max_factor = 4.0;
+    const double hit_factor = last_hit_ns / max(first_hit_ns, 0.1);
+    const double miss_factor = last_miss_ns / max(first_miss_ns, 0.1);
+    printf("colliding lookups in the largest table cost %.2fx (hits) and %.2fx (misses) of the smallest one\n",
+        hit_factor, miss_factor);
+    if (hit_factor > max_factor || miss_factor > max_factor)
+    {
+        printf("colliding lookups got more than %.0fx slower with the size of the table\n", max_factor);
+        return false;
+    }
+    return true;
+}
+
+// The loaded table has to find every string without having rehashed any of them
+static bool test_serialize(void)
+{
+    using serialize_mode_t = Serializer::serialize_mode_t;
+
+    StringTable table {};
+    uint32_t seed = 1;
+    std::vector<std::string> randoms;
+    for (uint32_t i = 0; i < 200000; i++)
+    {
+        randoms.push_back(random_string(&seed));
+        table.AddString(randoms.back());
+    }
+
+    {
+        Serializer writer { "test_st.dat", serialize_mode_t::Writing };
+        table.Serialize(writer);
+    }
+
+    const serialize_mode_t read_modes[] = {serialize_mode_t::Reading, serialize_mode_t::MappedReading};
+    for (auto mode : read_modes)
+    {
+        StringTable loaded {};
+        {
+            Serializer reader { "test_st.dat", mode };
+            const double begin = now_ns();
+            loaded.DeSerialize(reader);
+            printf("loading %u strings %s took %f milliseconds\n", (uint32_t)loaded.strings.size(),
+                mode == serialize_mode_t::Reading ? "buffered" : "mapped  ", (now_ns() - begin) * 1e-6);
+        }
+
+        uint32_t wrong = (loaded.strings.size() != table.strings.size());
+        for (const auto& str : randoms)
+            wrong += (loaded.LookupString(str) != table.LookupString(str));
+        wrong += (loaded.LookupString("not in the table") != 0);
+        for (uint32_t i = 1; i <= loaded.strings.size(); i++)
+            wrong += (loaded.LookupId(i) != table.LookupId(i));
+        if (wrong)
+        {
+            printf("%u lookups in the loaded table are wrong\n", wrong);
+            return false;
+        }
+    }
+
+    {
+        StringTable rebuilt {};
+        rebuilt.string_data = table.string_data;
+        const double begin = now_ns();
+        rebuilt.RebuildEntries();
+        rebuilt.RebuildIndex();
+        printf("recomputing the entries and the index instead took %f milliseconds\n", (now_ns() - begin) * 1e-6);
+    }
+    return true;
+}
+
+// Stored entries and indexes which can not belong to the strings have to be
+// recomputed, the table has to find every string afterwards
+static bool test_corrupt(void)
+{
+    using serialize_mode_t = Serializer::serialize_mode_t;
+
+    StringTable table {};
+    uint32_t seed = 3;
+    std::vector<std::string> randoms;
+    for (uint32_t i = 0; i < 1000; i++)
+    {
+        randoms.push_back(random_string(&seed));
+        table.AddString(randoms.back());
+    }
+    const uint32_t n_strings = table.strings.size();
+
+    // string_data is kept, what follows it is forged
+    enum Corruption { HUGE_INDEX_BITS, SMALL_INDEX, SLOT_OUT_OF_RANGE, ENTRY_OUT_OF_RANGE, TOO_MANY_STRINGS, TRUNCATED_INDEX,
+                      FULL_INDEX, MISPLACED_SLOT, N_CORRUPTIONS };
+    for (int corruption = 0; corruption < N_CORRUPTIONS; corruption++)
+    {
+        {
+            Serializer writer { "test_st.dat", serialize_mode_t::Writing };
+            writer.WriteU32(table.string_data.size());
+            auto ptr = (const char*)table.string_data.data();
+            WRITE_ARRAY_DATA_SIZE(writer, ptr, table.string_data.size());
+
+            auto entries = table.strings;
+            if (corruption == ENTRY_OUT_OF_RANGE)
+                entries[n_strings / 2].offset = table.string_data.size() - 1;
+            writer.WriteU32(corruption == TOO_MANY_STRINGS ? 0xFFFFFFF0 : n_strings);
+            ptr = (const char*)entries.data();
+            WRITE_ARRAY_DATA_SIZE(writer, ptr, n_strings * sizeof(StringEntry));
+
+            auto slots = table.hash_index;
+            uint32_t bits = table.index_bits;
+            if (corruption == HUGE_INDEX_BITS)
+                bits = 70;
+            if (corruption == SMALL_INDEX)
+            {
+                bits = 6;
+                slots.resize(64);
+            }
+            if (corruption == SLOT_OUT_OF_RANGE)
+            {
+                for (auto& slot : slots)
+                    if (!slot.index)
+                    {
+                        slot.index = n_strings + 1;
+                        break;
+                    }
+            }
+            // every slot refers to a string with its crc32, a miss would probe forever
+            if (corruption == FULL_INDEX)
+            {
+                for (size_t k = 0; k < slots.size(); k++)
+                    slots[k] = {table.strings[k % n_strings].crc32, (uint32_t)(k % n_strings) + 1};
+            }
+            // a string moves behind an empty slot, where no probe from its home slot gets to
+            if (corruption == MISPLACED_SLOT)
+            {
+                const size_t mask = slots.size() - 1;
+                size_t from = 0;
+                while (!slots[from].index)
+                    from++;
+                size_t to = 1;
+                while (slots[to].index || slots[(to - 1) & mask].index)
+                    to++;
+                slots[to] = slots[from];
+                slots[from] = {0, 0};
+            }
+            // the file ends in the middle of the index
+            if (corruption == TRUNCATED_INDEX)
+                slots.resize(slots.size() / 2);
+            writer.WriteU32(bits);
+            ptr = (const char*)slots.data();
+            WRITE_ARRAY_DATA_SIZE(writer, ptr, slots.size() * sizeof(StringIndexSlot));
+        }
+
+        StringTable loaded {};
+        {
+            Serializer reader { "test_st.dat", serialize_mode_t::MappedReading };
+            loaded.DeSerialize(reader);
+        }
+
+        uint32_t wrong = (loaded.strings.size() != n_strings);
+        for (const auto& str : randoms)
+            wrong += (loaded.LookupId(loaded.LookupString(str)) != str);
+        wrong += (loaded.LookupString("not in the table") != 0);
+        if (wrong)
+        {
+            printf("%u lookups are wrong after corruption %d\n", wrong, corruption);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Tags like distributed strings interned from 1 to 16 threads, every thread count has to
+// end up with the same ids and usage counts as a single StringTable. Where the machine has
+// the cores for it, the threads have to add the strings at least half as fast per thread as one
+static bool test_concurrent(void)
+{
+    // the k-th most common string is used about 1/k as often
+    const uint32_t n_distinct = 100000;
+    const uint32_t n_adds = 4000000;
+    uint32_t seed = 7;
+    std::vector<std::string> distinct;
+    for (uint32_t i = 0; i < n_distinct; i++)
+        distinct.push_back(random_string(&seed));
+    std::vector<uint32_t> picks(n_adds);
+    for (auto& pick : picks)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        const double u = (seed >> 8) * (1.0 / (1 << 24));
+        pick = (uint32_t)pow((double)n_distinct, u) - 1;
+    }
+
+    auto wall_ms = [] (std::chrono::steady_clock::time_point begin) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    };
+
+    StringTable reference {};
+    auto begin = std::chrono::steady_clock::now();
+    for (auto pick : picks)
+        reference.AddString(distinct[pick]);
+    printf("StringTable, 1 thread: %u adds took %f milliseconds\n", n_adds, wall_ms(begin));
+
+    const unsigned n_cores = std::thread::hardware_concurrency();
+    std::vector<uint32_t> first_ids;
+    double single_thread_ms = 0;
+    for (unsigned n_threads = 1; n_threads <= 16; n_threads *= 2)
+    {
+        ConcurrentStringTable concurrent;
+        std::vector<uint32_t> ids(n_adds);
+
+        begin = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < n_threads; t++)
+        {
+            threads.emplace_back([&, t] {
+                ConcurrentStringTable::Interner interner {concurrent};
+                const uint32_t chunk = (n_adds + n_threads - 1) / n_threads;
+                for (uint32_t i = t * chunk; i < min(n_adds, (t + 1) * chunk); i++)
+                    ids[i] = interner.AddString(distinct[picks[i]]);
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+        const double add_ms = wall_ms(begin);
+        if (n_threads == 1)
+            single_thread_ms = add_ms;
+
+        begin = std::chrono::steady_clock::now();
+        std::vector<uint32_t> n_uses;
+        for (auto id : ids)
+        {
+            if (id >= n_uses.size())
+                n_uses.resize(id + 1, 0);
+            n_uses[id]++;
+        }
+        StringTable table {};
+        const auto global_ids = concurrent.Finish(table, n_uses);
+        for (auto& id : ids)
+            id = global_ids[id];
+        const double finish_ms = wall_ms(begin);
+
+        const double speedup = single_thread_ms / add_ms;
+        printf("ConcurrentStringTable, %2u threads: %u adds took %f milliseconds (%.2fx of 1 thread), finishing took %f milliseconds\n",
+            n_threads, n_adds, add_ms, speedup, finish_ms);
+
+        uint32_t wrong = (table.strings.size() != reference.strings.size());
+        for (uint32_t i = 0; i < n_adds; i++)
+            wrong += (table.LookupId(ids[i]) != distinct[picks[i]]);
+        for (uint32_t id = 1; id <= table.strings.size(); id++)
+        {
+            const auto reference_id = reference.LookupString(table.LookupId(id));
+            wrong += (!reference_id
+                || table.usage_counts[id - 1].second != reference.usage_counts[reference_id - 1].second);
+        }
+        // the ids do not depend on the thread count
+        if (first_ids.empty())
+            first_ids = ids;
+        wrong += (ids != first_ids);
+        if (wrong)
+        {
+            printf("%u ids or usage counts differ from the StringTable with %u threads\n", wrong, n_threads);
+            return false;
+        }
+
+        if (n_threads <= n_cores && speedup < n_threads / 2.0)
+        {
+            printf("%u threads on %u cores added the strings only %.2fx as fast as one\n", n_threads, n_cores, speedup);
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    if (!test_collisions() || !test_serialize() || !test_corrupt() || !test_concurrent())
+        return 1;
+    printf("string table tests passed\n");
+}
+#endif
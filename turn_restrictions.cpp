@@ -0,0 +1,278 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+#include "ways.h"
+#include "serializer.cpp"
+#include "road_graph.cpp"
+
+using namespace std;
+
+// A restriction relation as it is tagged, only the ones via a single node are kept.
+// only is set for the only_* kinds, which forbid every other turn.
+struct TurnRestriction
+{
+    uint64_t from_way;
+    uint64_t via_node;
+    uint64_t to_way;
+    bool only;
+};
+
+// Turn restrictions of a RoadGraph indexed by their via node.
+// An arrival is a node entered over an edge some restriction starts with,
+// it owns the list of the next nodes which are forbidden, or the only
+// allowed ones. Nodes without restrictions only cost two reads of first_arrival.
+// Two ways between the same pair of intersections can not be told apart,
+// a restriction applies to both of them.
+struct TurnRestrictions
+{
+    /// the arrivals at node v are [first_arrival[v], first_arrival[v + 1])
+    vector<uint32_t> first_arrival;
+    vector<uint32_t> arrival_from;
+    vector<uint32_t> arrival_via;
+    /// set if the turns of the arrival are the only allowed ones, otherwise they are forbidden
+    vector<uint8_t> arrival_only;
+
+    /// the turns of arrival a are [first_turn[a], first_turn[a + 1])
+    vector<uint32_t> first_turn;
+    vector<uint32_t> turn_to;
+
+    uint32_t ArrivalCount() const
+    {
+        return (uint32_t)arrival_from.size();
+    }
+
+    /// Returns 0 if from -> via does not start a restriction or the arrival index + 1
+    uint32_t FindArrival(uint32_t from, uint32_t via) const
+    {
+        for (uint32_t a = first_arrival[via]; a < first_arrival[via + 1]; a++)
+        {
+            if (arrival_from[a] == from)
+                return a + 1;
+        }
+        return 0;
+    }
+
+    /// may the arrival go on to the node to
+    bool Allowed(uint32_t arrival, uint32_t to) const
+    {
+        bool listed = false;
+        for (uint32_t t = first_turn[arrival]; t < first_turn[arrival + 1]; t++)
+            listed |= (turn_to[t] == to);
+        return listed == (bool)arrival_only[arrival];
+    }
+
+    /// resolves the restrictions against the ways the graph was built from,
+    /// returns how many could not be resolved
+    uint32_t Build(const RoadGraph& graph, const vector<Way>& ways, const vector<TurnRestriction>& restrictions);
+
+    void Serialize(Serializer& serializer);
+
+    /// n_graph_nodes is the node count of the graph they were built for.
+    /// Returns false, with no restrictions left, if they were built for another graph,
+    /// the stored counts do not fit the section or a node lies outside of the graph
+    bool DeSerialize(Serializer& serializer, uint32_t n_graph_nodes);
+
+private:
+    struct GraphTurn
+    {
+        uint32_t from;
+        uint32_t via;
+        uint32_t to;
+        uint8_t only;
+    };
+
+    /// the graph nodes next to via along the way, the way has to start or end at via
+    static uint32_t Neighbours(const RoadGraph& graph, const Way& way, uint64_t via, uint32_t neighbours[2]);
+};
+
+uint32_t TurnRestrictions::Neighbours(const RoadGraph& graph, const Way& way, uint64_t via, uint32_t neighbours[2])
+{
+    const uint32_t n_refs = (uint32_t)way.refs.size();
+    uint32_t n = 0;
+    if (n_refs < 2)
+        return 0;
+
+    if (way.refs[0] == via)
+    {
+        for (uint32_t i = 1; i < n_refs && n == 0; i++)
+        {
+            const auto node = graph.FindNode(way.refs[i]);
+            if (node != INVALID_GRAPH_NODE)
+                neighbours[n++] = node;
+        }
+    }
+    // closed ways start and end at via
+    if (way.refs[n_refs - 1] == via)
+    {
+        for (uint32_t i = n_refs - 1; i-- > 0; )
+        {
+            const auto node = graph.FindNode(way.refs[i]);
+            if (node != INVALID_GRAPH_NODE)
+            {
+                neighbours[n++] = node;
+                break;
+            }
+        }
+    }
+    return n;
+}
+
+uint32_t TurnRestrictions::Build(const RoadGraph& graph, const vector<Way>& ways,
+                                 const vector<TurnRestriction>& restrictions)
+{
+    const uint32_t n_nodes = graph.NodeCount();
+
+    // the ways by osmid
+    vector<pair<uint64_t, uint32_t> > way_index;
+    way_index.reserve(ways.size());
+    for (uint32_t w = 0; w < ways.size(); w++)
+        way_index.push_back({ways[w].osmid, w});
+    sort(way_index.begin(), way_index.end());
+    auto FindWay = [&] (uint64_t osmid) -> const Way* {
+        auto it = lower_bound(way_index.begin(), way_index.end(), make_pair(osmid, 0u));
+        if (it == way_index.end() || it->first != osmid)
+            return nullptr;
+        return &ways[it->second];
+    };
+
+    uint32_t n_unresolved = 0;
+    vector<GraphTurn> turns;
+    for (const auto& r : restrictions)
+    {
+        const Way* from_way = FindWay(r.from_way);
+        const Way* to_way = FindWay(r.to_way);
+        const uint32_t via = graph.FindNode(r.via_node);
+        uint32_t from[2], to[2];
+        const uint32_t n_from = from_way ? Neighbours(graph, *from_way, r.via_node, from) : 0;
+        const uint32_t n_to = to_way ? Neighbours(graph, *to_way, r.via_node, to) : 0;
+        if (via == INVALID_GRAPH_NODE || !n_from || !n_to)
+        {
+            n_unresolved++;
+            continue;
+        }
+
+        for (uint32_t i = 0; i < n_from; i++)
+            for (uint32_t j = 0; j < n_to; j++)
+                turns.push_back({from[i], via, to[j], r.only});
+    }
+
+    // grouped by via and from, the only turns first
+    sort(turns.begin(), turns.end(), [] (const GraphTurn& a, const GraphTurn& b) {
+        if (a.via != b.via)
+            return a.via < b.via;
+        if (a.from != b.from)
+            return a.from < b.from;
+        if (a.only != b.only)
+            return a.only > b.only;
+        return a.to < b.to;
+    });
+
+    first_arrival.assign(n_nodes + 1, 0);
+    arrival_from.clear();
+    arrival_via.clear();
+    arrival_only.clear();
+    first_turn.assign(1, 0);
+    turn_to.clear();
+    for (uint32_t i = 0; i < turns.size(); )
+    {
+        const auto& t = turns[i];
+        arrival_from.push_back(t.from);
+        arrival_via.push_back(t.via);
+        // an only turn makes the forbidden ones of the same arrival redundant
+        arrival_only.push_back(t.only);
+        for (; i < turns.size() && turns[i].via == t.via && turns[i].from == t.from; i++)
+        {
+            if (turns[i].only == t.only && (turn_to.size() == first_turn.back() || turn_to.back() != turns[i].to))
+                turn_to.push_back(turns[i].to);
+        }
+        first_turn.push_back((uint32_t)turn_to.size());
+        first_arrival[t.via + 1]++;
+    }
+    for (uint32_t v = 0; v < n_nodes; v++)
+        first_arrival[v + 1] += first_arrival[v];
+
+    return n_unresolved;
+}
+
+void TurnRestrictions::Serialize(Serializer& serializer)
+{
+    const uint32_t n_nodes = first_arrival.empty() ? 0 : (uint32_t)first_arrival.size() - 1;
+
+    serializer.WriteU32(n_nodes);
+    serializer.WriteU32(ArrivalCount());
+
+    // arrivals are sorted by via, so their vias are delta coded
+    uint32_t last_via = 0;
+    for (uint32_t a = 0; a < ArrivalCount(); a++)
+    {
+        serializer.WriteVarInt(arrival_via[a] - last_via);
+        serializer.WriteVarInt((int64_t)arrival_from[a] - arrival_via[a]);
+        serializer.WriteU8(arrival_only[a]);
+        serializer.WriteVarInt(first_turn[a + 1] - first_turn[a]);
+        for (uint32_t t = first_turn[a]; t < first_turn[a + 1]; t++)
+            serializer.WriteVarInt((int64_t)turn_to[t] - arrival_via[a]);
+        last_via = arrival_via[a];
+    }
+}
+
+bool TurnRestrictions::DeSerialize(Serializer& serializer, uint32_t n_graph_nodes)
+{
+    auto Fail = [this] {
+        *this = TurnRestrictions {};
+        return false;
+    };
+
+    const uint32_t n_nodes = serializer.ReadU32();
+    const uint32_t n_arrivals = serializer.ReadU32();
+    // an arrival takes at least four bytes, nothing is allocated for more
+    if (n_nodes != n_graph_nodes || (uint64_t)n_arrivals * 4 > serializer.BytesLeft())
+        return Fail();
+
+    first_arrival.assign(n_nodes + 1, 0);
+    arrival_from.resize(n_arrivals);
+    arrival_via.resize(n_arrivals);
+    arrival_only.resize(n_arrivals);
+    first_turn.assign(1, 0);
+    turn_to.clear();
+
+    // the vias ascend, every node read is one of the graph
+    auto InGraph = [n_nodes] (int64_t node) {
+        return node >= 0 && node < n_nodes;
+    };
+    uint32_t via = 0;
+    for (uint32_t a = 0; a < n_arrivals; a++)
+    {
+        int64_t value;
+        serializer.ReadVarInt(&value);
+        if (!InGraph((int64_t)via + value))
+            return Fail();
+        via += (uint32_t)value;
+        arrival_via[a] = via;
+        serializer.ReadVarInt(&value);
+        if (!InGraph((int64_t)via + value))
+            return Fail();
+        arrival_from[a] = (uint32_t)(via + value);
+        arrival_only[a] = serializer.ReadU8();
+
+        int64_t n_turns;
+        serializer.ReadVarInt(&n_turns);
+        // a turn takes at least a byte
+        if (n_turns < 0 || (uint64_t)n_turns > serializer.BytesLeft())
+            return Fail();
+        for (int64_t t = 0; t < n_turns; t++)
+        {
+            serializer.ReadVarInt(&value);
+            if (!InGraph((int64_t)via + value))
+                return Fail();
+            turn_to.push_back((uint32_t)(via + value));
+        }
+        first_turn.push_back((uint32_t)turn_to.size());
+        first_arrival[via + 1]++;
+    }
+    for (uint32_t v = 0; v < n_nodes; v++)
+        first_arrival[v + 1] += first_arrival[v];
+    return true;
+}
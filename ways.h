@@ -4,6 +4,7 @@
 #include <vector>
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
 
 #include "pool.c"
 
@@ -47,6 +48,14 @@ struct qSpan
         AllocFromPool(n, pool);
     }
 
+    /// copies the contents of vec into memory from the pool
+    qSpan(const vector<T>& vec, Pool* pool) :
+        begin_(nullptr), end_(nullptr) {
+        AllocFromPool(vec.size(), pool);
+        if (vec.size())
+            memcpy(begin(), vec.data(), vec.size() * sizeof(T));
+    }
+
     constexpr qSpan(const T* begin, const T* end) :
         begin_(begin), end_(end),
             memoryFlags(MemoryFlags::External) {}
@@ -138,25 +147,29 @@ struct Way
 };
 
 // We keep every node and the how many times it is used in order to detect crossings
+// Coordinates are int32 fixed-point in units of 1e-7 degrees
 struct Node {
     Node() = default;
 
-    Node(uint64_t osmid_, double lon, double lat, short_tags_t tags_) :
-        osmid(osmid_), uses(0), lon_m(lon), lat_m(lat), tags(tags_) {}
+    Node(uint64_t osmid_, int32_t lon, int32_t lat, short_tags_t tags_) :
+        osmid(osmid_), lon_e7(lon), lat_e7(lat), uses(0), tags(tags_) {}
 
     uint64_t osmid;
+    int32_t lon_e7;
+    int32_t lat_e7;
     int32_t uses;
-    double lon_m;
-    double lat_m;
     //Tags tags;
     short_tags_t tags;
 
+    double lon() const { return lon_e7 * 1e-7; }
+    double lat() const { return lat_e7 * 1e-7; }
+
     void print_node()
     {
         printf("id: %lu, lon: %f, lat: %f, {#tags %d}\n"
             , osmid
-            , lon_m
-            , lat_m
+            , lon()
+            , lat()
             , (int)tags.size()
         );
     }